@@ -0,0 +1,90 @@
+/**
+ * Bounded blocking queue of pointers, used to connect the stages of batch mode
+ *
+ * push blocks while the queue is full, pop blocks while it is empty.  Once the producers
+ * are done they close the queue: pop then drains what is left and returns NULL.
+*/
+
+#ifndef BATCH_QUEUE_H
+#define BATCH_QUEUE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    void **items;
+    int cap;
+    int head;               // index of the oldest item
+    int count;
+    int producers;          // open producers, queue closes when this reaches 0
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} batch_queue_t;
+
+
+/* Set up an empty queue holding at most cap items, fed by 'producers' threads */
+bool queue_init(batch_queue_t *q, int cap, int producers) {
+    q->items = (void **) malloc(sizeof(void *) * (cap > 0 ? cap : 1));
+    if (q->items == NULL) {
+        return false;
+    }
+    q->cap = cap > 0 ? cap : 1;
+    q->head = 0;
+    q->count = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return true;
+}
+
+void queue_free(batch_queue_t *q) {
+    free(q->items);
+    q->items = NULL;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+/* Add item, waiting for space */
+void queue_push(batch_queue_t *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->cap] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Take the oldest item, waiting for one; NULL once the queue is closed and empty */
+void *queue_pop(batch_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    void *item = NULL;
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/* One producer is finished; the last one closes the queue */
+void queue_close(batch_queue_t *q) {
+    pthread_mutex_lock(&q->lock);
+    if (--q->producers <= 0) {
+        pthread_cond_broadcast(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+#endif
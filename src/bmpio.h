@@ -1,17 +1,51 @@
+#ifndef BMPIO_H
+#define BMPIO_H
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+#ifdef _WIN32
+#define BMPIO_NO_MMAP
+#include <fcntl.h>
+#include <io.h>
+struct iovec { void *iov_base; size_t iov_len; };
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
 /**
  * http://www.vbforums.com/showthread.php?t=261522
  * http://en.wikipedia.org/wiki/BMP_file_format
  * 
  * Manage reading and writing BMPs.  Use STB library for format conversion
+ *
+ * Reading maps the whole file and converts it a row at a time, so decode is a
+ * handful of bulk copies instead of a stream of small reads.  8-bit grayscale
+ * files stored top-down with no row padding can be used in place as a view of
+ * the mapping (open_bmp with allow_view), in which case nothing is copied.
+ *
+ * Writing assembles padded rows in a large buffer and hands them to the kernel with
+ * writev (8-bit rows that need no padding are written straight from the caller's
+ * image), or fills a memory mapped output file when BMP_WRITE_MMAP is given.
 */
 
 #define BMP_ID 0x4D42 // BMP filetype ID
+#define BMP_BI_RGB 0            // uncompressed
+#define BMP_BI_BITFIELDS 3      // uncompressed with channel masks
+#define BMP_FILE_HEADER_SIZE 14 // magic + file header as stored on disk
+#define BMP_INFO_HEADER_SIZE 40 // BITMAPINFOHEADER as stored on disk
+#define BMP_PALETTE_SIZE 1024   // 256 RGBX entries for 8-bit output
+#define BMP_WRITE_CHUNK (1 << 20)   // bytes of rows assembled per write
+#define BMP_WRITE_IOV 64            // rows/chunks gathered per writev
+
+#define BMP_WRITE_MMAP 1        // write_bmp flag: fill a memory mapped output file
 
 typedef struct {
     uint8_t magic[2];
@@ -30,7 +64,7 @@ typedef struct {
     int32_t width;
     int32_t height;
     uint16_t nplanes; // color planes = 1
-    uint16_t nbytes; // bytes per pixel
+    uint16_t nbytes; // bits per pixel (8, 24 or 32 supported)
     uint32_t compress; // compress type
     uint32_t bmp_size; // size of bmp in bytes
     int32_t ppm_x; // pixels per meter x-axis
@@ -48,141 +82,560 @@ typedef struct {
 
 typedef unsigned char pixel_t;
 
+typedef struct {
+    pixel_t *pixels;        // top-down rows of width * channels bytes
+    int32_t width;
+    int32_t height;
+    int channels;           // 1 gray, 2 gray+alpha, 3 RGB, 4 RGBA
+    bitmap_info_header_t info;
 
-/**
- * Read BMP file to pixel data, return pointer to pixel_t array (error handling within function)
-*/
-pixel_t *load_bmp(const char *filename, bitmap_info_header_t *bmp_info_head) {
+    // internal: set when pixels points into the file mapping rather than an allocation
+    void *map;
+    size_t map_len;
+} bmp_image_t;
+
+
+// ======== File mapping ========
+
+/* Map a whole file read-only, NULL on failure (falls back to one bulk read without mmap) */
+static const uint8_t *bmp_map_file(const char *filename, size_t *len) {
+#ifndef BMPIO_NO_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Couldn't open file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "Could not stat BMP file\n");
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Couldn't map file");
+        return NULL;
+    }
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+    *len = (size_t) st.st_size;
+    return (const uint8_t *) map;
+#else
     FILE *file = fopen(filename, "rb");
     if (file == NULL) {
         perror("Couldn't open file");
         return NULL;
     }
-
-    bmpfile_magic_t magic_info;
-    if (fread(&magic_info, sizeof(bmpfile_magic_t), 1, file) != 1) {
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *buf = size > 0 ? (uint8_t *) malloc((size_t) size) : NULL;
+    if (buf == NULL || fread(buf, 1, (size_t) size, file) != (size_t) size) {
+        fprintf(stderr, "Could not read BMP file\n");
+        free(buf);
         fclose(file);
         return NULL;
     }
+    fclose(file);
+    *len = (size_t) size;
+    return buf;
+#endif
+}
 
-    if (*((uint16_t *) magic_info.magic) != BMP_ID) {
-        fprintf(stderr, "Not a BMP file: magic=%c%c\n", magic_info.magic[0], magic_info.magic[1]);
-        fclose(file);
-        return NULL;
+static void bmp_unmap_file(const uint8_t *map, size_t len) {
+    if (map == NULL) {
+        return;
     }
+#ifndef BMPIO_NO_MMAP
+    munmap((void *) map, len);
+#else
+    free((void *) map);
+#endif
+}
 
-    bmpfile_header_t bmp_head;
-    if (fread(&bmp_head, sizeof(bmpfile_header_t), 1, file) != 1) {
-        fprintf(stderr, "Could not read BMP header");
-        fclose(file);
-        return NULL;
+
+// ======== Row conversion ========
+
+static uint16_t bmp_get16(const uint8_t *p) { return (uint16_t) (p[0] | (p[1] << 8)); }
+static uint32_t bmp_get32(const uint8_t *p) { return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24); }
+
+/* Same weights as stb_image so gray output matches whichever decoder produced it */
+static inline pixel_t bmp_luma(int r, int g, int b) {
+    return (pixel_t) ((r * 77 + g * 150 + b * 29) >> 8);
+}
+
+static int bmp_mask_shift(uint32_t mask) {
+    int s = 0;
+    if (mask == 0) {
+        return -1;
     }
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        s++;
+    }
+    return (mask == 0xff) ? s : -1; // only byte-wide channel masks supported
+}
 
-    if (fread(bmp_info_head, sizeof(bitmap_info_header_t), 1, file) != 1) {
-        fprintf(stderr, "Could not read BMP info header");
-        fclose(file);
-        return NULL;
+/* Convert one stored 8-bit row through palette 'lut' (RGBA entries) */
+static void bmp_row_8(const uint8_t *src, pixel_t *dst, int32_t w, int c, const rgb_t *lut) {
+    switch (c) {
+        case 1:
+        for (int32_t x = 0; x < w; x++) dst[x] = lut[src[x]].a; // .a holds precomputed luma
+        break;
+
+        case 2:
+        for (int32_t x = 0; x < w; x++) { dst[2*x] = lut[src[x]].a; dst[2*x + 1] = 255; }
+        break;
+
+        case 3:
+        for (int32_t x = 0; x < w; x++) { const rgb_t p = lut[src[x]]; dst[3*x] = p.r; dst[3*x + 1] = p.g; dst[3*x + 2] = p.b; }
+        break;
+
+        default:
+        for (int32_t x = 0; x < w; x++) { const rgb_t p = lut[src[x]]; dst[4*x] = p.r; dst[4*x + 1] = p.g; dst[4*x + 2] = p.b; dst[4*x + 3] = 255; }
     }
+}
+
+/* Convert one stored row of 'sb' byte pixels with the given channel byte offsets (ao < 0: opaque) */
+static void bmp_row_rgb(const uint8_t *src, pixel_t *dst, int32_t w, int c, int sb, int ro, int go, int bo, int ao) {
+    switch (c) {
+        case 1:
+        for (int32_t x = 0; x < w; x++, src += sb) dst[x] = bmp_luma(src[ro], src[go], src[bo]);
+        break;
+
+        case 2:
+        for (int32_t x = 0; x < w; x++, src += sb) { dst[2*x] = bmp_luma(src[ro], src[go], src[bo]); dst[2*x + 1] = ao < 0 ? 255 : src[ao]; }
+        break;
 
-    if (bmp_info_head->compress != 0) {
-        fprintf(stderr, "Compression not supported");
+        case 3:
+        for (int32_t x = 0; x < w; x++, src += sb) { dst[3*x] = src[ro]; dst[3*x + 1] = src[go]; dst[3*x + 2] = src[bo]; }
+        break;
+
+        default:
+        for (int32_t x = 0; x < w; x++, src += sb) { dst[4*x] = src[ro]; dst[4*x + 1] = src[go]; dst[4*x + 2] = src[bo]; dst[4*x + 3] = ao < 0 ? 255 : src[ao]; }
     }
+}
 
-    if (fseek(file, bmp_head.bmp_off, SEEK_SET)) {
-        fprintf(stderr, "Failure while seeking start of BMP bits");
-        fclose(file);
-        return NULL;
+
+/**
+ * Decode BMP bytes already in memory into img.  desired_channels 0 keeps the file's own layout.
+ * If allow_view and the stored rows are already exactly the requested layout, img->pixels
+ * points into buf and no copy is made (caller must keep buf alive), true on success
+*/
+bool decode_bmp(const uint8_t *buf, size_t len, bmp_image_t *img, int desired_channels, bool allow_view) {
+    memset(img, 0, sizeof(bmp_image_t));
+    if (len < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE) {
+        fprintf(stderr, "BMP file truncated\n");
+        return false;
+    }
+    if (bmp_get16(buf) != BMP_ID) {
+        fprintf(stderr, "Not a BMP file: magic=%c%c\n", buf[0], buf[1]);
+        return false;
     }
 
-    pixel_t *bitmap = (pixel_t *) malloc(bmp_info_head->bmp_size * sizeof(pixel_t));
+    const uint8_t *ih = buf + BMP_FILE_HEADER_SIZE;
+    bitmap_info_header_t *info = &img->info;
+    const uint32_t bmp_off = bmp_get32(buf + 10);
+    info->header_size = bmp_get32(ih);
+    info->width = (int32_t) bmp_get32(ih + 4);
+    info->height = (int32_t) bmp_get32(ih + 8);
+    info->nplanes = bmp_get16(ih + 12);
+    info->nbytes = bmp_get16(ih + 14);
+    info->compress = bmp_get32(ih + 16);
+    info->bmp_size = bmp_get32(ih + 20);
+    info->ppm_x = (int32_t) bmp_get32(ih + 24);
+    info->ppm_y = (int32_t) bmp_get32(ih + 28);
+    info->ncolors = bmp_get32(ih + 32);
+    info->ncolors_imp = bmp_get32(ih + 36);
 
-    if (bitmap == NULL) {
-        fprintf(stderr, "Failure allocating memory for bitmap");
-        fclose(file);
-        return NULL;
+    if (info->header_size < BMP_INFO_HEADER_SIZE || BMP_FILE_HEADER_SIZE + (size_t) info->header_size > len) {
+        fprintf(stderr, "Unsupported BMP info header\n");
+        return false;
+    }
+    const int bits = info->nbytes;
+    if (bits != 8 && bits != 24 && bits != 32) {
+        fprintf(stderr, "Unsupported BMP depth: %d bits\n", bits);
+        return false;
+    }
+    if (info->compress != BMP_BI_RGB && ! (info->compress == BMP_BI_BITFIELDS && bits == 32)) {
+        fprintf(stderr, "Compression not supported\n");
+        return false;
+    }
+
+    const bool top_down = info->height < 0;
+    const int32_t w = info->width;
+    const int32_t h = top_down ? -info->height : info->height;
+    if (w <= 0 || h <= 0) {
+        fprintf(stderr, "Invalid BMP dimensions\n");
+        return false;
+    }
+    const size_t src_stride = (((size_t) w * bits + 31) / 32) * 4;
+    if (bmp_off > len || (len - bmp_off) / src_stride < (size_t) h) {
+        fprintf(stderr, "BMP pixel data truncated\n");
+        return false;
     }
 
-    size_t pad;
-    unsigned char c;
-    pad = 4*ceil(bmp_info_head->nbytes*bmp_info_head->width/32.) - bmp_info_head->width;
-    for (size_t i = 0; i < bmp_info_head->height; i++) {
-        for (size_t j = 0; j < bmp_info_head->width; j++) {
-            if (fread(&c, sizeof(unsigned char), 1, file) != 1) {
-                fprintf(stderr, "Failure reading pixel data");
-                fclose(file);
-                return NULL;
+    // channel byte offsets within a stored pixel, B G R (A) unless masks say otherwise
+    int ro = 2, go = 1, bo = 0, ao = -1;
+    rgb_t lut[256];
+    bool gray = false, identity = false;
+    int native;
+
+    if (bits == 8) {
+        const uint8_t *pal = ih + info->header_size;
+        uint32_t ncol = (info->ncolors == 0 || info->ncolors > 256) ? 256 : info->ncolors;
+        if ((size_t) (pal - buf) + 4 * (size_t) ncol > bmp_off) {
+            fprintf(stderr, "BMP palette truncated\n");
+            return false;
+        }
+        gray = true;
+        identity = true;
+        memset(lut, 0, sizeof(lut));
+        for (uint32_t i = 0; i < ncol; i++) {
+            lut[i].b = pal[4*i];
+            lut[i].g = pal[4*i + 1];
+            lut[i].r = pal[4*i + 2];
+            lut[i].a = bmp_luma(lut[i].r, lut[i].g, lut[i].b);
+            gray = gray && lut[i].r == lut[i].g && lut[i].g == lut[i].b;
+            identity = identity && lut[i].r == i;
+        }
+        identity = identity && gray && ncol == 256;
+        if (gray) { // keep exact gray levels rather than re-weighting equal channels
+            for (uint32_t i = 0; i < ncol; i++) lut[i].a = lut[i].r;
+        }
+        native = gray ? 1 : 3;
+    }
+    else if (bits == 24) {
+        native = 3;
+    }
+    else {
+        ao = 3;
+        if (info->compress == BMP_BI_BITFIELDS) {
+            const uint8_t *m = ih + BMP_INFO_HEADER_SIZE; // masks follow a 40 byte header, or live inside V4/V5
+            if ((size_t) (m - buf) + 12 > len) {
+                fprintf(stderr, "BMP channel masks truncated\n");
+                return false;
             }
+            const int rs = bmp_mask_shift(bmp_get32(m));
+            const int gs = bmp_mask_shift(bmp_get32(m + 4));
+            const int bs = bmp_mask_shift(bmp_get32(m + 8));
+            const int as = (info->header_size >= 56 && (size_t) (m - buf) + 16 <= len) ? bmp_mask_shift(bmp_get32(m + 12)) : -1;
+            if (rs < 0 || gs < 0 || bs < 0) {
+                fprintf(stderr, "Unsupported BMP channel masks\n");
+                return false;
+            }
+            ro = rs / 8;
+            go = gs / 8;
+            bo = bs / 8;
+            ao = (as < 0) ? -1 : as / 8;
         }
-        fseek(file, pad, SEEK_CUR);
+        native = 4;
     }
 
-    fclose(file);
-    return bitmap;
+    const int c = (desired_channels >= 1 && desired_channels <= 4) ? desired_channels : native;
+    const size_t dst_stride = (size_t) w * c;
+    const uint8_t *bits_base = buf + bmp_off;
+
+    img->width = w;
+    img->height = h;
+    img->channels = c;
+
+    // stored rows already match the output exactly, hand out the mapping itself
+    if (allow_view && top_down && bits == 8 && identity && c == 1 && src_stride == dst_stride) {
+        img->pixels = (pixel_t *) bits_base;
+        return true;
+    }
+
+    pixel_t *out = (pixel_t *) malloc(dst_stride * h);
+    if (out == NULL) {
+        fprintf(stderr, "Failure allocating memory for bitmap\n");
+        return false;
+    }
+
+    const int sb = bits / 8;
+    uint8_t all_a = 0;
+    for (int32_t y = 0; y < h; y++) {
+        const uint8_t *src = bits_base + (size_t) (top_down ? y : h - 1 - y) * src_stride;
+        pixel_t *dst = out + (size_t) y * dst_stride;
+        if (bits == 8) {
+            if (identity && c == 1) {
+                memcpy(dst, src, dst_stride);
+            }
+            else {
+                bmp_row_8(src, dst, w, c, lut);
+            }
+        }
+        else {
+            bmp_row_rgb(src, dst, w, c, sb, ro, go, bo, ao);
+            if (ao >= 0 && (c == 2 || c == 4)) {
+                for (int32_t x = 0; x < w; x++) all_a |= dst[x * c + c - 1];
+            }
+        }
+    }
+
+    // 32-bit files written without alpha usually leave the 4th byte zero: treat as opaque
+    if (ao >= 0 && info->compress == BMP_BI_RGB && all_a == 0 && (c == 2 || c == 4)) {
+        for (size_t i = c - 1; i < dst_stride * h; i += c) out[i] = 255;
+    }
+
+    img->pixels = out;
+    return true;
 }
 
 /**
- * Write pixel data out to a BMP, true on success
+ * Read BMP file into img (see decode_bmp), release with close_bmp, true on success
 */
-bool save_bmp(const char *filename, const bitmap_info_header_t *bmp_ih, const pixel_t *data) {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
+bool open_bmp(const char *filename, bmp_image_t *img, int desired_channels, bool allow_view) {
+    size_t len = 0;
+    const uint8_t *map = bmp_map_file(filename, &len);
+    if (map == NULL) {
+        memset(img, 0, sizeof(bmp_image_t));
         return false;
     }
-    bmpfile_magic_t magic_info = {{0x42, 0x4D}};
-    if (fwrite(&magic_info, sizeof(bmpfile_magic_t), 1, file) != 1) {
-        fclose(file);
+    if (! decode_bmp(map, len, img, desired_channels, allow_view)) {
+        bmp_unmap_file(map, len);
         return false;
     }
-    const uint32_t offset = sizeof(bmpfile_magic_t) + sizeof(bmpfile_header_t) + sizeof(bitmap_info_header_t) +
-            ((1U << bmp_ih->nbytes) * 4);
-    bmpfile_header_t bmp_h;
-    bmp_h.file_size = offset + bmp_ih->bmp_size;
-    bmp_h.r1 = 0;
-    bmp_h.r2 = 0;
-    bmp_h.bmp_off = offset;
+    if ((const uint8_t *) img->pixels >= map && (const uint8_t *) img->pixels < map + len) {
+        img->map = (void *) map; // view into the mapping, keep it until close_bmp
+        img->map_len = len;
+    }
+    else {
+        bmp_unmap_file(map, len);
+    }
+    return true;
+}
 
-    // write initial header
-    if (fwrite(&bmp_h, sizeof(bmpfile_header_t), 1, file) != 1) {
-        fclose(file);
-        return false;
+/* Release pixels from open_bmp */
+void close_bmp(bmp_image_t *img) {
+    if (img->map != NULL) {
+        bmp_unmap_file((const uint8_t *) img->map, img->map_len);
     }
+    else {
+        free(img->pixels);
+    }
+    memset(img, 0, sizeof(bmp_image_t));
+}
 
-    // write info header
-    if (fwrite(bmp_ih, sizeof(bitmap_info_header_t), 1, file) != 1) {
-        fclose(file);
-        return false;
+/**
+ * Read BMP file to pixel data, return pointer to pixel_t array (error handling within function)
+ * Rows are top-down in the file's own channel layout (1 gray, 3 RGB or 4 RGBA); free() when done
+*/
+pixel_t *load_bmp(const char *filename, bitmap_info_header_t *bmp_info_head) {
+    bmp_image_t img;
+    if (! open_bmp(filename, &img, 0, false)) {
+        return NULL;
     }
+    *bmp_info_head = img.info;
+    return img.pixels;
+}
 
-    // generate color palette for 8-bit per RGB channel
-    for (size_t i = 0; i < (1U << bmp_ih->bmp_size); i++) {
-        const rgb_t color = {(uint8_t) i, (uint8_t) i, (uint8_t) i};
-        if (fwrite(&color, sizeof(rgb_t), 1, file) != 1) {
-            fclose(file);
-            return false;
+// ======== Writing ========
+
+static void bmp_put16(uint8_t *p, uint16_t v) { p[0] = (uint8_t) v; p[1] = (uint8_t) (v >> 8); }
+static void bmp_put32(uint8_t *p, uint32_t v) { bmp_put16(p, (uint16_t) v); bmp_put16(p + 2, (uint16_t) (v >> 16)); }
+
+/* Bits per pixel written for an image of c channels (gray+alpha is expanded to BGRA) */
+static int bmp_out_bits(int c) {
+    return (c == 1) ? 8 : (c == 3) ? 24 : 32;
+}
+
+/* Build file header, info header and (8-bit) palette into hdr, return header length */
+static size_t bmp_build_header(uint8_t *hdr, int32_t w, int32_t h, int c, size_t stride) {
+    const int bits = bmp_out_bits(c);
+    const size_t off = BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + (bits == 8 ? BMP_PALETTE_SIZE : 0);
+    const size_t data_size = stride * h;
+
+    memset(hdr, 0, off);
+    hdr[0] = 0x42;
+    hdr[1] = 0x4D;
+    bmp_put32(hdr + 2, (uint32_t) (off + data_size));
+    bmp_put32(hdr + 10, (uint32_t) off);
+
+    uint8_t *ih = hdr + BMP_FILE_HEADER_SIZE;
+    bmp_put32(ih, BMP_INFO_HEADER_SIZE);
+    bmp_put32(ih + 4, (uint32_t) w);
+    bmp_put32(ih + 8, (uint32_t) h); // positive: bottom-up rows, the most widely read layout
+    bmp_put16(ih + 12, 1);
+    bmp_put16(ih + 14, (uint16_t) bits);
+    bmp_put32(ih + 16, BMP_BI_RGB);
+    bmp_put32(ih + 20, (uint32_t) data_size);
+    bmp_put32(ih + 24, 2835); // 72 dpi
+    bmp_put32(ih + 28, 2835);
+
+    // grayscale palette for 8-bit output, exactly 256 entries
+    if (bits == 8) {
+        uint8_t *pal = ih + BMP_INFO_HEADER_SIZE;
+        for (int i = 0; i < 256; i++) {
+            pal[4*i] = pal[4*i + 1] = pal[4*i + 2] = (uint8_t) i;
         }
     }
+    return off;
+}
 
-    size_t pad = 4*ceil(bmp_ih->bmp_size*bmp_ih->width/32.) - bmp_ih->width;
-    unsigned char c;
-    for (size_t i = 0; i < bmp_ih->height; i++) {
-        for (size_t j = 0; j < bmp_ih->width; j++) {
-            c = (unsigned char) data[j + bmp_ih->width*i];
-            if (fwrite(&c, sizeof(char), 1, file) != 1) {
-                fclose(file);
-                return false;
-            }
+/* Convert one top-down image row to its stored form, padding included */
+static void bmp_pack_row(const pixel_t *src, uint8_t *dst, int32_t w, int c, size_t stride) {
+    size_t n;
+    switch (c) {
+        case 1:
+        memcpy(dst, src, w);
+        n = w;
+        break;
+
+        case 2:
+        for (int32_t x = 0; x < w; x++) { dst[4*x] = dst[4*x + 1] = dst[4*x + 2] = src[2*x]; dst[4*x + 3] = src[2*x + 1]; }
+        n = 4 * (size_t) w;
+        break;
+
+        case 3:
+        for (int32_t x = 0; x < w; x++) { dst[3*x] = src[3*x + 2]; dst[3*x + 1] = src[3*x + 1]; dst[3*x + 2] = src[3*x]; }
+        n = 3 * (size_t) w;
+        break;
+
+        default:
+        for (int32_t x = 0; x < w; x++) { dst[4*x] = src[4*x + 2]; dst[4*x + 1] = src[4*x + 1]; dst[4*x + 2] = src[4*x]; dst[4*x + 3] = src[4*x + 3]; }
+        n = 4 * (size_t) w;
+    }
+    memset(dst + n, 0, stride - n);
+}
+
+/* writev every byte of iov, riding out short writes (pipes, sockets), true on success */
+static bool bmp_writev_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+#ifndef BMPIO_NO_MMAP
+        ssize_t n = writev(fd, iov, cnt);
+#else
+        ssize_t n = write(fd, iov->iov_base, (unsigned int) iov->iov_len);
+#endif
+        if (n < 0) {
+            return false;
+        }
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
         }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write a top-down image of c channels (1-4) as BMP to an open descriptor, true on success
+ * 1 channel -> 8-bit grayscale palette, 3 -> 24-bit, 2 and 4 -> 32-bit with alpha
+*/
+bool write_bmp_fd(int fd, int32_t w, int32_t h, int c, const pixel_t *data) {
+    if (w <= 0 || h <= 0 || c < 1 || c > 4 || data == NULL) {
+        return false;
+    }
+    const size_t stride = (((size_t) w * bmp_out_bits(c) + 31) / 32) * 4;
+    uint8_t hdr[BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + BMP_PALETTE_SIZE];
+    struct iovec iov[BMP_WRITE_IOV];
+    int cnt = 0;
+
+    iov[cnt].iov_base = hdr;
+    iov[cnt].iov_len = bmp_build_header(hdr, w, h, c, stride);
+    cnt++;
 
-        // padding
-        c = 0;
-        for(size_t j = 0; j < pad; j++) {
-            if(fwrite(&c, sizeof(char), 1, file) != 1) {
-                fclose(file);
-                return true;
+    // stored rows identical to the image's: point the kernel straight at them
+    if (c == 1 && stride == (size_t) w) {
+        for (int32_t y = h - 1; y >= 0; y--) {
+            iov[cnt].iov_base = (void *) (data + (size_t) y * w);
+            iov[cnt].iov_len = w;
+            if (++cnt == BMP_WRITE_IOV) {
+                if (! bmp_writev_all(fd, iov, cnt)) {
+                    return false;
+                }
+                cnt = 0;
             }
         }
+        return cnt == 0 || bmp_writev_all(fd, iov, cnt);
     }
 
-    fclose(file);
+    // otherwise assemble padded rows a chunk at a time
+    const int32_t chunk_rows = (stride >= BMP_WRITE_CHUNK) ? 1 : (int32_t) (BMP_WRITE_CHUNK / stride);
+    uint8_t *chunk = (uint8_t *) malloc(stride * (chunk_rows < h ? chunk_rows : h));
+    if (chunk == NULL) {
+        fprintf(stderr, "Failure allocating BMP write buffer\n");
+        return false;
+    }
+    const size_t row_bytes = (size_t) w * c;
+    int32_t y = h - 1;
+    while (y >= 0) {
+        int32_t rows = 0;
+        for (; rows < chunk_rows && y >= 0; rows++, y--) {
+            bmp_pack_row(data + (size_t) y * row_bytes, chunk + rows * stride, w, c, stride);
+        }
+        iov[cnt].iov_base = chunk;
+        iov[cnt].iov_len = rows * stride;
+        if (! bmp_writev_all(fd, iov, cnt + 1)) {
+            free(chunk);
+            return false;
+        }
+        cnt = 0;
+    }
+    free(chunk);
     return true;
-}
\ No newline at end of file
+}
+
+/* Fill a memory mapped output file, used for BMP_WRITE_MMAP */
+static bool bmp_write_mapped(int fd, int32_t w, int32_t h, int c, const pixel_t *data) {
+#ifndef BMPIO_NO_MMAP
+    const size_t stride = (((size_t) w * bmp_out_bits(c) + 31) / 32) * 4;
+    uint8_t hdr[BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE + BMP_PALETTE_SIZE];
+    const size_t off = bmp_build_header(hdr, w, h, c, stride);
+    const size_t total = off + stride * h;
+
+    if (ftruncate(fd, (off_t) total) != 0) {
+        return false;
+    }
+    uint8_t *map = (uint8_t *) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    memcpy(map, hdr, off);
+    const size_t row_bytes = (size_t) w * c;
+    for (int32_t y = 0; y < h; y++) {
+        bmp_pack_row(data + (size_t) (h - 1 - y) * row_bytes, map + off + y * stride, w, c, stride);
+    }
+    return munmap(map, total) == 0;
+#else
+    return write_bmp_fd(fd, w, h, c, data);
+#endif
+}
+
+/**
+ * Write a top-down image of c channels to a BMP file (see write_bmp_fd), true on success
+ * flags: BMP_WRITE_MMAP to write through a mapping of the output file
+*/
+bool write_bmp(const char *filename, int32_t w, int32_t h, int c, const pixel_t *data, int flags) {
+#ifdef _WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    int fd = open(filename, ((flags & BMP_WRITE_MMAP) ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        perror("Couldn't open output file");
+        return false;
+    }
+    bool ok = (flags & BMP_WRITE_MMAP) ? bmp_write_mapped(fd, w, h, c, data) : write_bmp_fd(fd, w, h, c, data);
+    ok = (close(fd) == 0) && ok;
+    if (! ok) {
+        fprintf(stderr, "Failure writing BMP file\n");
+    }
+    return ok;
+}
+
+/**
+ * Write pixel data out to a BMP, true on success
+ * data is top-down with (nbytes / 8) channels per pixel, dimensions from bmp_ih
+*/
+bool save_bmp(const char *filename, const bitmap_info_header_t *bmp_ih, const pixel_t *data) {
+    const int32_t h = bmp_ih->height < 0 ? -bmp_ih->height : bmp_ih->height;
+    return write_bmp(filename, bmp_ih->width, h, bmp_ih->nbytes / 8, data, 0);
+}
+
+#endif
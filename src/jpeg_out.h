@@ -0,0 +1,537 @@
+/**
+ * Parallel baseline JPEG writer
+ *
+ * The image is cut into bands of MCU rows and every band is color converted, transformed
+ * and Huffman coded on the thread pool by itself.  Bands are restart interval segments:
+ * the DC predictions start over at each one and its bits are padded out to a byte, so
+ * the coded bands only need an RSTn marker between them to form one baseline stream that
+ * any decoder reads (the DRI marker in the header gives the MCUs per band).
+ *
+ * quality 1-100 scales the standard (Annex K) quantization tables as libjpeg does; up to
+ * JPEG_SUBSAMPLE_MAX color is stored at half resolution both ways (4:2:0), above it at
+ * full resolution.  1 and 2 channel images are written as one component gray JPEGs,
+ * alpha is dropped.  Standard Huffman tables, float AAN forward DCT.
+*/
+
+#ifndef JPEG_OUT_H
+#define JPEG_OUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_pool.h"
+#include "bmpio.h" // bmp_writev_all, struct iovec, pixel_t
+
+#define JPEG_QUALITY_DEFAULT 90
+#define JPEG_SUBSAMPLE_MAX 90               // highest quality still coded 4:2:0
+#define JPEG_SEGMENT_PIXELS (256 * 1024)    // pixels per restart segment, at least
+#define JPEG_MAX_INTERVAL 65535             // MCUs in one restart interval (16-bit DRI field)
+#define JPEG_BLOCK_BYTES 512                // coded bytes one 8x8 block can take, stuffing included
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t bits;      // pending bits, MSB first
+    int nbits;
+} jpeg_stream_t;
+
+typedef struct {
+    uint16_t code[256];
+    uint8_t size[256];
+} jpeg_huff_t;
+
+typedef struct {
+    const pixel_t *pixels;
+    int32_t w, h;
+    int c;
+    int comps;          // 1 gray, 3 YCbCr
+    int sub;            // 2 for 4:2:0, 1 for 4:4:4
+    int mcus_x, mcus_y;
+    int rows_per_segment;   // MCU rows
+    int segments;
+    float fdtbl[2][64];     // luma, chroma: 1 / (quant * DCT scale), natural order
+
+    jpeg_stream_t *out;     // per segment
+    bool failed;
+} jpeg_job_t;
+
+
+// ======== Tables ========
+
+static const uint8_t jpeg_zigzag[64] = { // zigzag position of each natural order coefficient
+    0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42, 3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18,
+    24, 31, 40, 44, 53, 10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60, 21, 34, 37, 47,
+    50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63
+};
+
+static const uint8_t jpeg_std_quant[2][64] = {
+    {16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57, 69, 56,
+     14, 17, 22, 29, 51, 87, 80, 62, 18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+     49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99},
+    {17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99, 99, 99,
+     47, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+     99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99}
+};
+
+// standard Huffman tables: code counts per length 1-16, then the symbols
+static const uint8_t jpeg_dc_bits[2][16] = {
+    {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+    {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0}
+};
+static const uint8_t jpeg_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t jpeg_ac_bits[2][16] = {
+    {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+    {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77}
+};
+static const uint8_t jpeg_ac_vals[2][162] = {
+    {0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+     0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+     0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+     0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+     0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83,
+     0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+     0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+     0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+     0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa},
+    {0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+     0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+     0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+     0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+     0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a,
+     0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+     0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+     0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+     0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa}
+};
+
+// AAN DCT output scale per row / column
+static const float jpeg_aan_scale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+static jpeg_huff_t jpeg_dc_huff[2], jpeg_ac_huff[2];   // luma, chroma
+static pthread_once_t jpeg_tables_once = PTHREAD_ONCE_INIT;
+
+/* Canonical codes from code counts per length (JPEG Annex C) */
+static void jpeg_build_huff(jpeg_huff_t *t, const uint8_t *bits, const uint8_t *vals) {
+    uint16_t code = 0;
+    int k = 0;
+    memset(t, 0, sizeof(jpeg_huff_t));
+    for (int len = 1; len <= 16; len++) {
+        for (int i = 0; i < bits[len - 1]; i++, k++) {
+            t->code[vals[k]] = code++;
+            t->size[vals[k]] = (uint8_t) len;
+        }
+        code <<= 1;
+    }
+}
+
+static void jpeg_tables_init(void) {
+    for (int t = 0; t < 2; t++) {
+        jpeg_build_huff(&jpeg_dc_huff[t], jpeg_dc_bits[t], jpeg_dc_vals);
+        jpeg_build_huff(&jpeg_ac_huff[t], jpeg_ac_bits[t], jpeg_ac_vals[t]);
+    }
+}
+
+/* Quantization table t (0 luma, 1 chroma) for quality, natural order */
+static void jpeg_quant_table(int t, int quality, uint8_t *q) {
+    const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; i++) {
+        const int v = (jpeg_std_quant[t][i] * scale + 50) / 100;
+        q[i] = (uint8_t) (v < 1 ? 1 : (v > 255 ? 255 : v));
+    }
+}
+
+
+// ======== Coding ========
+
+static bool jpeg_reserve(jpeg_stream_t *s, size_t extra) {
+    if (s->len + extra <= s->cap) {
+        return true;
+    }
+    size_t cap = s->cap > 0 ? s->cap * 2 : 65536;
+    while (cap < s->len + extra) cap *= 2;
+    uint8_t *d = (uint8_t *) realloc(s->data, cap);
+    if (d == NULL) {
+        return false;
+    }
+    s->data = d;
+    s->cap = cap;
+    return true;
+}
+
+/* Append n bits (n <= 24), stuffing a 0 after every 0xFF byte; room reserved by the caller */
+static inline void jpeg_put_bits(jpeg_stream_t *s, uint32_t v, int n) {
+    s->bits = (s->bits << n) | v;
+    s->nbits += n;
+    while (s->nbits >= 8) {
+        s->nbits -= 8;
+        const uint8_t b = (uint8_t) (s->bits >> s->nbits);
+        s->data[s->len++] = b;
+        if (b == 0xff) {
+            s->data[s->len++] = 0;
+        }
+    }
+}
+
+/* Bits needed for |v| (the coefficient's category) */
+static inline int jpeg_category(int v) {
+    if (v < 0) v = -v;
+    int n = 0;
+    while (v > 0) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+/* In place float AAN forward DCT of an 8x8 block, rows then columns */
+static void jpeg_fdct(float *d) {
+    for (int pass = 0; pass < 2; pass++) {
+        const int step = pass == 0 ? 1 : 8;     // along a row, then down a column
+        const int next = pass == 0 ? 8 : 1;
+        for (int k = 0; k < 8; k++) {
+            float *p = d + k * next;
+            const float tmp0 = p[0] + p[7 * step], tmp7 = p[0] - p[7 * step];
+            const float tmp1 = p[step] + p[6 * step], tmp6 = p[step] - p[6 * step];
+            const float tmp2 = p[2 * step] + p[5 * step], tmp5 = p[2 * step] - p[5 * step];
+            const float tmp3 = p[3 * step] + p[4 * step], tmp4 = p[3 * step] - p[4 * step];
+
+            // even part
+            float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+            float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+            p[0] = tmp10 + tmp11;
+            p[4 * step] = tmp10 - tmp11;
+            const float z1 = (tmp12 + tmp13) * 0.707106781f;
+            p[2 * step] = tmp13 + z1;
+            p[6 * step] = tmp13 - z1;
+
+            // odd part
+            tmp10 = tmp4 + tmp5;
+            tmp11 = tmp5 + tmp6;
+            tmp12 = tmp6 + tmp7;
+            const float z5 = (tmp10 - tmp12) * 0.382683433f;
+            const float z2 = tmp10 * 0.541196100f + z5;
+            const float z4 = tmp12 * 1.306562965f + z5;
+            const float z3 = tmp11 * 0.707106781f;
+            const float z11 = tmp7 + z3, z13 = tmp7 - z3;
+            p[5 * step] = z13 + z2;
+            p[3 * step] = z13 - z2;
+            p[step] = z11 + z4;
+            p[7 * step] = z11 - z4;
+        }
+    }
+}
+
+/* Transform, quantize and code one block with table t, return its DC for the next prediction */
+static int jpeg_code_block(jpeg_stream_t *s, float *block, const float *fdtbl, int t, int dc_prev) {
+    int q[64];
+    jpeg_fdct(block);
+    for (int i = 0; i < 64; i++) {
+        float v = block[i] * fdtbl[i];
+        v = v < -1023.0f ? -1023.0f : (v > 1023.0f ? 1023.0f : v); // baseline range, only float error can reach it
+        q[jpeg_zigzag[i]] = (int) (v < 0 ? v - 0.5f : v + 0.5f);
+    }
+
+    const jpeg_huff_t *dc = &jpeg_dc_huff[t], *ac = &jpeg_ac_huff[t];
+    const int diff = q[0] - dc_prev;
+    int n = jpeg_category(diff);
+    jpeg_put_bits(s, dc->code[n], dc->size[n]);
+    if (n > 0) {
+        jpeg_put_bits(s, (uint32_t) (diff < 0 ? diff - 1 : diff) & ((1u << n) - 1), n);
+    }
+
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        if (q[k] == 0) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16) { // ZRL: sixteen zeros
+            jpeg_put_bits(s, ac->code[0xf0], ac->size[0xf0]);
+        }
+        n = jpeg_category(q[k]);
+        const int sym = (run << 4) | n;
+        jpeg_put_bits(s, ac->code[sym], ac->size[sym]);
+        jpeg_put_bits(s, (uint32_t) (q[k] < 0 ? q[k] - 1 : q[k]) & ((1u << n) - 1), n);
+        run = 0;
+    }
+    if (run > 0) { // EOB
+        jpeg_put_bits(s, ac->code[0x00], ac->size[0x00]);
+    }
+    return q[0];
+}
+
+
+// ======== Segments ========
+
+/* Level shifted Y (and Cb, Cr) of the size x size pixels at (x0, y0), edges replicated */
+static void jpeg_load_mcu(const jpeg_job_t *job, int32_t x0, int32_t y0, int size, float *y, float *cb, float *cr) {
+    const int c = job->c;
+    for (int j = 0; j < size; j++) {
+        const int32_t sy = y0 + j < job->h ? y0 + j : job->h - 1;
+        const pixel_t *row = job->pixels + (size_t) sy * job->w * c;
+        for (int i = 0; i < size; i++) {
+            const int32_t sx = x0 + i < job->w ? x0 + i : job->w - 1;
+            const pixel_t *p = row + (size_t) sx * c;
+            const int k = j * size + i;
+            if (job->comps == 1) {
+                y[k] = p[0] - 128.0f;
+                continue;
+            }
+            const float r = p[0], g = p[1], b = p[2];
+            y[k] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+            cb[k] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+            cr[k] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+        }
+    }
+}
+
+/* Pool task: code the MCU rows of restart segment seg into job->out[seg] */
+static void jpeg_segment_task(void *arg, int seg) {
+    jpeg_job_t *job = (jpeg_job_t *) arg;
+    jpeg_stream_t *s = &job->out[seg];
+    const int size = 8 * job->sub;          // MCU side in pixels
+    const int blocks = job->comps == 1 ? 1 : job->sub * job->sub + 2;
+    const int my0 = seg * job->rows_per_segment;
+    const int my1 = (my0 + job->rows_per_segment < job->mcus_y) ? my0 + job->rows_per_segment : job->mcus_y;
+    float y[256], cb[256], cr[256], block[64];
+    int dc[3] = {0, 0, 0};  // predictions start over in every restart interval
+
+    for (int my = my0; my < my1; my++) {
+        for (int mx = 0; mx < job->mcus_x; mx++) {
+            if (! jpeg_reserve(s, (size_t) blocks * JPEG_BLOCK_BYTES)) {
+                job->failed = true;
+                return;
+            }
+            jpeg_load_mcu(job, mx * size, my * size, size, y, cb, cr);
+
+            // luma blocks left to right, top to bottom within the MCU
+            for (int by = 0; by < job->sub; by++) {
+                for (int bx = 0; bx < job->sub; bx++) {
+                    for (int j = 0; j < 8; j++) {
+                        memcpy(block + j * 8, y + (by * 8 + j) * size + bx * 8, 8 * sizeof(float));
+                    }
+                    dc[0] = jpeg_code_block(s, block, job->fdtbl[0], 0, dc[0]);
+                }
+            }
+            if (job->comps == 1) {
+                continue;
+            }
+
+            // chroma, averaged over 2x2 pixels when subsampled
+            for (int k = 0; k < 2; k++) {
+                const float *src = k == 0 ? cb : cr;
+                for (int j = 0; j < 8; j++) {
+                    for (int i = 0; i < 8; i++) {
+                        if (job->sub == 1) {
+                            block[j * 8 + i] = src[j * 8 + i];
+                        }
+                        else {
+                            const float *p = src + (2 * j) * size + 2 * i;
+                            block[j * 8 + i] = 0.25f * (p[0] + p[1] + p[size] + p[size + 1]);
+                        }
+                    }
+                }
+                dc[1 + k] = jpeg_code_block(s, block, job->fdtbl[1], 1, dc[1 + k]);
+            }
+        }
+    }
+
+    // pad the last byte with 1 bits so the next segment starts byte aligned
+    if (jpeg_reserve(s, 2)) {
+        if (s->nbits > 0) {
+            const int pad = 8 - s->nbits;
+            jpeg_put_bits(s, (1u << pad) - 1, pad);
+        }
+    }
+    else {
+        job->failed = true;
+    }
+}
+
+/* Append a marker segment header (marker, 16-bit length including itself) */
+static uint8_t *jpeg_marker(uint8_t *p, uint8_t marker, int len) {
+    *p++ = 0xff;
+    *p++ = marker;
+    *p++ = (uint8_t) (len >> 8);
+    *p++ = (uint8_t) len;
+    return p;
+}
+
+/* Everything from SOI to the SOS header into out (room for 1024 bytes), return its length */
+static size_t jpeg_headers(const jpeg_job_t *job, const uint8_t quant[2][64], uint8_t *out) {
+    static const uint8_t jfif[14] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    const int tables = job->comps == 1 ? 1 : 2;
+    uint8_t *p = out;
+    *p++ = 0xff;
+    *p++ = 0xd8; // SOI
+
+    p = jpeg_marker(p, 0xe0, 2 + sizeof(jfif));
+    memcpy(p, jfif, sizeof(jfif));
+    p += sizeof(jfif);
+
+    p = jpeg_marker(p, 0xdb, 2 + 65 * tables);
+    for (int t = 0; t < tables; t++) {
+        *p++ = (uint8_t) t; // 8-bit entries, table t
+        for (int i = 0; i < 64; i++) {
+            p[jpeg_zigzag[i]] = quant[t][i];
+        }
+        p += 64;
+    }
+
+    p = jpeg_marker(p, 0xc0, 8 + 3 * job->comps); // SOF0: baseline
+    *p++ = 8;
+    *p++ = (uint8_t) (job->h >> 8);
+    *p++ = (uint8_t) job->h;
+    *p++ = (uint8_t) (job->w >> 8);
+    *p++ = (uint8_t) job->w;
+    *p++ = (uint8_t) job->comps;
+    for (int k = 0; k < job->comps; k++) {
+        *p++ = (uint8_t) (k + 1);
+        *p++ = k == 0 ? (uint8_t) (job->sub << 4 | job->sub) : 0x11;
+        *p++ = k == 0 ? 0 : 1;
+    }
+
+    int dht_len = 2;
+    for (int t = 0; t < tables; t++) {
+        dht_len += 2 * 17 + sizeof(jpeg_dc_vals) + sizeof(jpeg_ac_vals[t]);
+    }
+    p = jpeg_marker(p, 0xc4, dht_len);
+    for (int t = 0; t < tables; t++) {
+        *p++ = (uint8_t) t; // DC table t
+        memcpy(p, jpeg_dc_bits[t], 16);
+        memcpy(p + 16, jpeg_dc_vals, sizeof(jpeg_dc_vals));
+        p += 16 + sizeof(jpeg_dc_vals);
+        *p++ = (uint8_t) (0x10 | t); // AC table t
+        memcpy(p, jpeg_ac_bits[t], 16);
+        memcpy(p + 16, jpeg_ac_vals[t], sizeof(jpeg_ac_vals[t]));
+        p += 16 + sizeof(jpeg_ac_vals[t]);
+    }
+
+    if (job->segments > 1) { // DRI: MCUs per restart interval
+        const int interval = job->rows_per_segment * job->mcus_x;
+        p = jpeg_marker(p, 0xdd, 4);
+        *p++ = (uint8_t) (interval >> 8);
+        *p++ = (uint8_t) interval;
+    }
+
+    p = jpeg_marker(p, 0xda, 6 + 2 * job->comps); // SOS
+    *p++ = (uint8_t) job->comps;
+    for (int k = 0; k < job->comps; k++) {
+        *p++ = (uint8_t) (k + 1);
+        *p++ = k == 0 ? 0x00 : 0x11;
+    }
+    *p++ = 0;       // spectral selection 0-63, no successive approximation
+    *p++ = 63;
+    *p++ = 0;
+    return (size_t) (p - out);
+}
+
+/**
+ * Encode a top-down image of c channels (1-4) as baseline JPEG to an open descriptor,
+ * quality 1-100, true on success
+*/
+bool write_jpeg_fd(int fd, int32_t w, int32_t h, int c, const pixel_t *data, int quality) {
+    if (w <= 0 || h <= 0 || w > 65535 || h > 65535 || c < 1 || c > 4 || data == NULL) {
+        return false;
+    }
+    pthread_once(&jpeg_tables_once, jpeg_tables_init);
+    quality = quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+
+    jpeg_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pixels = data;
+    job.w = w;
+    job.h = h;
+    job.c = c;
+    job.comps = c >= 3 ? 3 : 1;
+    job.sub = (job.comps == 3 && quality <= JPEG_SUBSAMPLE_MAX) ? 2 : 1;
+    job.mcus_x = (w + 8 * job.sub - 1) / (8 * job.sub);
+    job.mcus_y = (h + 8 * job.sub - 1) / (8 * job.sub);
+
+    uint8_t quant[2][64];
+    for (int t = 0; t < 2; t++) {
+        jpeg_quant_table(t, quality, quant[t]);
+        for (int i = 0; i < 64; i++) {
+            job.fdtbl[t][i] = 1.0f / (quant[t][i] * jpeg_aan_scale[i / 8] * jpeg_aan_scale[i % 8] * 8.0f);
+        }
+    }
+
+    // enough MCU rows per segment to amortize the restart, enough segments to keep the pool busy
+    const int64_t mcu_pixels = (int64_t) job.mcus_x * 64 * job.sub * job.sub;
+    int rows = (int) ((JPEG_SEGMENT_PIXELS + mcu_pixels - 1) / mcu_pixels);
+    const int spread = (job.mcus_y + 4 * pool_threads() - 1) / (4 * pool_threads());
+    if (rows < spread) rows = spread;
+    if (rows > JPEG_MAX_INTERVAL / job.mcus_x) rows = JPEG_MAX_INTERVAL / job.mcus_x;
+    if (rows < 1) rows = 1;
+    job.rows_per_segment = rows;
+    job.segments = (job.mcus_y + rows - 1) / rows;
+
+    job.out = (jpeg_stream_t *) calloc(job.segments, sizeof(jpeg_stream_t));
+    uint8_t (*rst)[2] = (uint8_t (*)[2]) malloc(2 * job.segments);
+    struct iovec *iov = (struct iovec *) malloc(sizeof(struct iovec) * (2 * job.segments + 2));
+    bool ok = job.out && rst && iov;
+
+    if (ok) {
+        pool_parallel_for(job.segments, jpeg_segment_task, &job);
+        ok = ! job.failed;
+    }
+
+    if (ok) {
+        static const uint8_t eoi[2] = {0xff, 0xd9};
+        uint8_t head[1024];
+        int cnt = 0;
+        iov[cnt].iov_base = head;
+        iov[cnt++].iov_len = jpeg_headers(&job, quant, head);
+        for (int seg = 0; seg < job.segments; seg++) {
+            if (seg > 0) { // RST0-7 in turn between intervals
+                rst[seg][0] = 0xff;
+                rst[seg][1] = (uint8_t) (0xd0 + (seg - 1) % 8);
+                iov[cnt].iov_base = rst[seg];
+                iov[cnt++].iov_len = 2;
+            }
+            iov[cnt].iov_base = job.out[seg].data;
+            iov[cnt++].iov_len = job.out[seg].len;
+        }
+        iov[cnt].iov_base = (void *) eoi;
+        iov[cnt++].iov_len = 2;
+
+        for (int i = 0; ok && i < cnt; i += BMP_WRITE_IOV) {
+            ok = bmp_writev_all(fd, iov + i, (cnt - i < BMP_WRITE_IOV) ? cnt - i : BMP_WRITE_IOV);
+        }
+    }
+
+    if (job.out != NULL) {
+        for (int seg = 0; seg < job.segments; seg++) free(job.out[seg].data);
+    }
+    free(job.out);
+    free(rst);
+    free(iov);
+    return ok;
+}
+
+/* Encode image to a JPEG file (see write_jpeg_fd), true on success */
+bool write_jpeg(const char *filename, int32_t w, int32_t h, int c, const pixel_t *data, int quality) {
+#ifdef _WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        perror("Couldn't open output file");
+        return false;
+    }
+    bool ok = write_jpeg_fd(fd, w, h, c, data, quality);
+    ok = (close(fd) == 0) && ok;
+    if (! ok) {
+        fprintf(stderr, "Failure writing JPEG file\n");
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,328 @@
+/**
+ * Kernel file loader with a parsed-kernel cache
+ *
+ * A kernel file is a square matrix of numbers, one row per line, separated by spaces,
+ * tabs, commas or semicolons ('#' starts a comment).  An optional first line holding only
+ * the size (as in kernel.txt) is checked against the rows that follow.  The size must be
+ * odd and at most KERNEL_MAX.
+ *
+ * kernel_file_load(path) returns the parsed kernel along with its analysis: whether it is
+ * separable into a column and a row vector (rank one) and how many taps are non-zero.
+ * Results are cached by path and modification time, so batch and server runs parse a file
+ * once however many images use it; an edited file is picked up on the next load.  Loaded
+ * kernels are shared read only, give each back with kernel_file_release().
+*/
+
+#ifndef KERNEL_FILE_H
+#define KERNEL_FILE_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "repict.h"
+
+#define KERNEL_FILE_CACHE 16            // distinct kernel files kept parsed
+#define KERNEL_FILE_MAX_BYTES (1 << 20)
+#define KERNEL_SEPARABLE_EPS 1e-5f      // relative error allowed in the rank one check
+
+typedef struct kernel_file_s {
+    char *path;
+    time_t mtime;
+    off_t size;
+
+    kernel_t *k;                // kn * kn, row major
+    int kn;
+
+    bool separable;             // k[i][j] == col[i] * row[j]
+    kernel_t *col;              // kn each, set when separable
+    kernel_t *row;
+    int nonzero;                // taps that aren't 0
+    kernel_t sum;
+
+    int refs;                   // cache reference + one per kernel_file_load
+    unsigned long used;         // for evicting the least recently used file
+} kernel_file_t;
+
+static kernel_file_t *kernel_cache[KERNEL_FILE_CACHE];
+static unsigned long kernel_cache_clock = 0;
+static pthread_mutex_t kernel_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void kernel_file_free(kernel_file_t *kf) {
+    free(kf->path);
+    free(kf->k);
+    free(kf->col);
+    free(kf->row);
+    free(kf);
+}
+
+/* Rank one test: factor through the largest tap, then check every tap against col * row */
+static void kernel_file_analyze(kernel_file_t *kf) {
+    const int n = kf->kn;
+    int pr = 0, pc = 0;
+    float peak = 0;
+    kf->nonzero = 0;
+    kf->sum = 0;
+    for (int i = 0; i < n * n; i++) {
+        kf->sum += kf->k[i];
+        if (kf->k[i] != 0) {
+            kf->nonzero++;
+        }
+        if (fabsf(kf->k[i]) > peak) {
+            peak = fabsf(kf->k[i]);
+            pr = i / n;
+            pc = i % n;
+        }
+    }
+    kf->separable = false;
+    if (peak == 0) {
+        return;
+    }
+
+    kf->col = (kernel_t *) malloc(sizeof(kernel_t) * n);
+    kf->row = (kernel_t *) malloc(sizeof(kernel_t) * n);
+    if (kf->col == NULL || kf->row == NULL) {
+        return;
+    }
+    const kernel_t pivot = kf->k[pr * n + pc];
+    for (int i = 0; i < n; i++) {
+        kf->col[i] = kf->k[i * n + pc];
+        kf->row[i] = kf->k[pr * n + i] / pivot;
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (fabsf(kf->k[i * n + j] - kf->col[i] * kf->row[j]) > KERNEL_SEPARABLE_EPS * peak) {
+                free(kf->col);
+                free(kf->row);
+                kf->col = kf->row = NULL;
+                return;
+            }
+        }
+    }
+    kf->separable = true;
+}
+
+/* Parse text into kf->k / kf->kn, false (with a message) if it isn't a valid kernel */
+static bool kernel_file_parse(kernel_file_t *kf, char *text) {
+    int rows = 0, cols = -1, count = 0, header = 0;
+    bool first_line = true;
+    kernel_t *vals = (kernel_t *) malloc(sizeof(kernel_t) * KERNEL_MAX * KERNEL_MAX);
+    if (vals == NULL) {
+        return false;
+    }
+
+    for (char *line = text; line != NULL && *line != '\0'; ) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+
+        int in_row = 0;
+        char *p = line;
+        while (*p != '\0') {
+            while (*p == ' ' || *p == '\t' || *p == '\r' || *p == ',' || *p == ';') p++;
+            if (*p == '\0') {
+                break;
+            }
+            char *end;
+            const float v = strtof(p, &end);
+            if (end == p) {
+                printf("repict: kernel %s: not a number near \"%.12s\"\n", kf->path, p);
+                free(vals);
+                return false;
+            }
+            if (count == KERNEL_MAX * KERNEL_MAX) {
+                printf("repict: kernel %s: larger than %dx%d\n", kf->path, KERNEL_MAX, KERNEL_MAX);
+                free(vals);
+                return false;
+            }
+            vals[count++] = v;
+            in_row++;
+            p = end;
+        }
+        line = next;
+        if (in_row == 0) {
+            continue;
+        }
+
+        // a lone number ahead of wider rows is the size line
+        if (first_line && in_row == 1 && line != NULL && strpbrk(line, "0123456789") != NULL) {
+            header = (int) vals[0];
+            count = 0;
+            first_line = false;
+            continue;
+        }
+        first_line = false;
+        if (cols >= 0 && in_row != cols) {
+            printf("repict: kernel %s: row %d has %d values, expected %d\n", kf->path, rows + 1, in_row, cols);
+            free(vals);
+            return false;
+        }
+        cols = in_row;
+        rows++;
+    }
+
+    if (rows == 0 || rows != cols) {
+        printf("repict: kernel %s: must be a square matrix (%d rows of %d)\n", kf->path, rows, cols);
+        free(vals);
+        return false;
+    }
+    if (header != 0 && header != rows) {
+        printf("repict: kernel %s: size line says %d but there are %d rows\n", kf->path, header, rows);
+        free(vals);
+        return false;
+    }
+    if (rows % 2 == 0 || rows > KERNEL_MAX) {
+        printf("repict: kernel %s: size must be odd and at most %d\n", kf->path, KERNEL_MAX);
+        free(vals);
+        return false;
+    }
+    kf->kn = rows;
+    kf->k = (kernel_t *) realloc(vals, sizeof(kernel_t) * rows * rows);
+    if (kf->k == NULL) {
+        kf->k = vals;
+    }
+    return true;
+}
+
+/* Read and analyze one kernel file (not cached), NULL on failure */
+static kernel_file_t *kernel_file_read(const char *path, const struct stat *st) {
+    if (st->st_size <= 0 || st->st_size > KERNEL_FILE_MAX_BYTES) {
+        printf("repict: kernel %s: empty or too large\n", path);
+        return NULL;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("repict: cannot read kernel file %s\n", path);
+        return NULL;
+    }
+    char *text = (char *) malloc((size_t) st->st_size + 1);
+    kernel_file_t *kf = (kernel_file_t *) calloc(1, sizeof(kernel_file_t));
+    if (text == NULL || kf == NULL || fread(text, 1, (size_t) st->st_size, fp) != (size_t) st->st_size) {
+        printf(text == NULL || kf == NULL ? "repict: kernel %s: allocation failure\n"
+                : "repict: cannot read kernel file %s\n", path);
+        fclose(fp);
+        free(text);
+        free(kf);
+        return NULL;
+    }
+    fclose(fp);
+    text[st->st_size] = '\0';
+
+    kf->path = strdup(path);
+    kf->mtime = st->st_mtime;
+    kf->size = st->st_size;
+    const bool ok = kf->path != NULL && kernel_file_parse(kf, text);
+    free(text);
+    if (! ok) {
+        kernel_file_free(kf);
+        return NULL;
+    }
+    kernel_file_analyze(kf);
+    return kf;
+}
+
+/* Drop a reference (cache lock held) */
+static void kernel_file_unref(kernel_file_t *kf) {
+    if (--kf->refs == 0) {
+        kernel_file_free(kf);
+    }
+}
+
+/* Parsed kernel for path, from the cache when the file hasn't changed, NULL on failure */
+const kernel_file_t *kernel_file_load(const char *path) {
+    struct stat st;
+    if (path == NULL || stat(path, &st) != 0) {
+        printf("repict: cannot open kernel file %s\n", path != NULL ? path : "");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&kernel_cache_lock);
+    for (int i = 0; i < KERNEL_FILE_CACHE; i++) {
+        kernel_file_t *kf = kernel_cache[i];
+        if (kf != NULL && strcmp(kf->path, path) == 0) {
+            if (kf->mtime == st.st_mtime && kf->size == st.st_size) {
+                kf->refs++;
+                kf->used = ++kernel_cache_clock;
+                pthread_mutex_unlock(&kernel_cache_lock);
+                return kf;
+            }
+            kernel_cache[i] = NULL; // stale: users keep their copy until they release it
+            kernel_file_unref(kf);
+        }
+    }
+    pthread_mutex_unlock(&kernel_cache_lock);
+
+    // parse outside the lock; a thread that raced us here and inserted first wins
+    kernel_file_t *kf = kernel_file_read(path, &st);
+    if (kf == NULL) {
+        return NULL;
+    }
+    kf->refs = 2;
+
+    pthread_mutex_lock(&kernel_cache_lock);
+    for (int i = 0; i < KERNEL_FILE_CACHE; i++) {
+        kernel_file_t *cached = kernel_cache[i];
+        if (cached != NULL && strcmp(cached->path, path) == 0) {
+            if (cached->mtime == st.st_mtime && cached->size == st.st_size) {
+                cached->refs++;
+                cached->used = ++kernel_cache_clock;
+                pthread_mutex_unlock(&kernel_cache_lock);
+                kernel_file_free(kf);
+                return cached;
+            }
+            kernel_cache[i] = NULL;
+            kernel_file_unref(cached);
+        }
+    }
+    int slot = 0;
+    for (int i = 0; i < KERNEL_FILE_CACHE; i++) {
+        if (kernel_cache[i] == NULL) {
+            slot = i;
+            break;
+        }
+        if (kernel_cache[i]->used < kernel_cache[slot]->used) {
+            slot = i;
+        }
+    }
+    if (kernel_cache[slot] != NULL) {
+        kernel_file_unref(kernel_cache[slot]);
+    }
+    kernel_cache[slot] = kf;
+    kf->used = ++kernel_cache_clock;
+    pthread_mutex_unlock(&kernel_cache_lock);
+    return kf;
+}
+
+/* Give back a kernel from kernel_file_load */
+void kernel_file_release(const kernel_file_t *kf) {
+    if (kf == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&kernel_cache_lock);
+    kernel_file_unref((kernel_file_t *) kf);
+    pthread_mutex_unlock(&kernel_cache_lock);
+}
+
+/* Free every cached kernel no one is using */
+void kernel_file_cache_clear(void) {
+    pthread_mutex_lock(&kernel_cache_lock);
+    for (int i = 0; i < KERNEL_FILE_CACHE; i++) {
+        if (kernel_cache[i] != NULL) {
+            kernel_file_unref(kernel_cache[i]);
+            kernel_cache[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&kernel_cache_lock);
+}
+
+#endif
@@ -0,0 +1,195 @@
+/**
+ * Hardware performance counters around CLI stages (Linux perf_event_open)
+ *
+ * perf_open() opens one counter group on the calling thread: cycles, instructions,
+ * L1D read misses, last level cache misses and branch misses, user space only.  The group
+ * is inherited by every thread the caller starts afterwards (the thread pool's workers,
+ * which run the convolution tiles and PNG/JPEG blocks) and a read sums them all, so open it
+ * before the pool starts.
+ * perf_begin()/perf_end(name, pixels) bracket a stage and add its counts to the row for
+ * name, perf_cancel() drops a stage that failed; perf_report() prints IPC, cycles and
+ * misses per pixel, and LLC traffic as bytes per pixel (LLC misses * cache line) which
+ * tells a compute bound pass (high IPC, few bytes/px) from a memory bound one.  Counters a CPU or VM lacks are shown as "-".
+ * Elsewhere every call is a no-op and perf_open() fails.
+*/
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define PERF_EVENTS 5
+#define PERF_MAX_ROWS 32
+#define PERF_LINE_BYTES 64      // cache line, for LLC misses -> bytes
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES };
+
+typedef struct {
+    const char *name;
+    uint64_t count[PERF_EVENTS];
+    double pixels;
+    int runs;
+} perf_row_t;
+
+static int perf_fd[PERF_EVENTS] = {-1, -1, -1, -1, -1};
+static int perf_slot[PERF_EVENTS];          // position of each event in a group read, -1 = not open
+static int perf_open_count = 0;
+static perf_row_t perf_rows[PERF_MAX_ROWS];
+static int perf_row_count = 0;
+
+
+#ifdef __linux__
+static int perf_open_event(uint32_t type, uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group == -1);          // the group runs when its leader is enabled
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;                       // threads started later count into the same group
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/* Open the counter group on the calling thread and its future threads, false (errno set) when cycles can't be counted */
+bool perf_open(void) {
+#ifdef __linux__
+    static const struct { uint32_t type; uint64_t config; } events[PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+    };
+    perf_open_count = 0;
+    perf_row_count = 0;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        perf_fd[e] = perf_open_event(events[e].type, events[e].config, e == 0 ? -1 : perf_fd[0]);
+        perf_slot[e] = perf_fd[e] >= 0 ? perf_open_count++ : -1;
+        if (e == 0 && perf_fd[0] < 0) {
+            return false;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void perf_close(void) {
+#ifdef __linux__
+    for (int e = PERF_EVENTS - 1; e >= 0; e--) {
+        if (perf_fd[e] >= 0) {
+            close(perf_fd[e]);
+            perf_fd[e] = -1;
+        }
+    }
+#endif
+    perf_open_count = 0;
+}
+
+/* Zero and start the counters */
+void perf_begin(void) {
+#ifdef __linux__
+    if (perf_fd[0] < 0) {
+        return;
+    }
+    ioctl(perf_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/* Stop the counters and add them to the row for name, covering 'pixels' pixels */
+void perf_end(const char *name, double pixels) {
+#ifdef __linux__
+    if (perf_fd[0] < 0) {
+        return;
+    }
+    ioctl(perf_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t buf[3 + PERF_EVENTS];      // nr, time enabled, time running, values
+    if (read(perf_fd[0], buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t))) {
+        return;
+    }
+    // multiplexed with other users of the PMU: scale up to the whole interval
+    const double scale = buf[2] > 0 ? (double) buf[1] / buf[2] : 1.0;
+
+    perf_row_t *row = NULL;
+    for (int r = 0; r < perf_row_count; r++) {
+        if (strcmp(perf_rows[r].name, name) == 0) {
+            row = &perf_rows[r];
+        }
+    }
+    if (row == NULL) {
+        if (perf_row_count == PERF_MAX_ROWS) {
+            return;
+        }
+        row = &perf_rows[perf_row_count++];
+        memset(row, 0, sizeof(perf_row_t));
+        row->name = name;
+    }
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        if (perf_slot[e] >= 0 && perf_slot[e] < (int) buf[0]) {
+            row->count[e] += (uint64_t) (buf[3 + perf_slot[e]] * scale);
+        }
+    }
+    row->pixels += pixels;
+    row->runs++;
+#endif
+}
+
+/* Stop the counters without recording anything (the stage failed) */
+void perf_cancel(void) {
+#ifdef __linux__
+    if (perf_fd[0] >= 0) {
+        ioctl(perf_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+/* Per pixel value of event e in row, printed as "-" when the event isn't available */
+static void perf_print_per_pixel(const perf_row_t *row, int e, double mult) {
+    if (perf_slot[e] < 0 || row->pixels <= 0) {
+        printf(" %10s", "-");
+    }
+    else {
+        printf(" %10.3f", row->count[e] * mult / row->pixels);
+    }
+}
+
+/* Print one line per row recorded since perf_open */
+void perf_report(void) {
+    printf("%-12s %6s %10s %10s %10s %10s %10s\n",
+            "stage", "IPC", "cycles/px", "L1D m/px", "LLC B/px", "br m/px", "Mcycles");
+    for (int r = 0; r < perf_row_count; r++) {
+        const perf_row_t *row = &perf_rows[r];
+        printf("%-12s", row->name);
+        if (perf_slot[PERF_INSTRUCTIONS] >= 0 && row->count[PERF_CYCLES] > 0) {
+            printf(" %6.2f", (double) row->count[PERF_INSTRUCTIONS] / row->count[PERF_CYCLES]);
+        }
+        else {
+            printf(" %6s", "-");
+        }
+        perf_print_per_pixel(row, PERF_CYCLES, 1.0);
+        perf_print_per_pixel(row, PERF_L1D_MISSES, 1.0);
+        perf_print_per_pixel(row, PERF_LLC_MISSES, PERF_LINE_BYTES);
+        perf_print_per_pixel(row, PERF_BRANCH_MISSES, 1.0);
+        printf(" %10.2f\n", row->count[PERF_CYCLES] / 1e6);
+    }
+}
+
+#endif
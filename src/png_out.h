@@ -0,0 +1,634 @@
+/**
+ * Parallel PNG writer
+ *
+ * The image is cut into blocks of rows and every block is filtered and deflated on the
+ * thread pool by itself.  A block's compressor is primed with the 32K of filtered data
+ * just before it (so matches still reach back across the seam) and ends with a sync flush,
+ * which leaves its output byte aligned so the pieces concatenate into one zlib stream.
+ * Each piece is written as its own IDAT chunk and the adler32s are combined at the end.
+ *
+ * level 0 stores rows uncompressed, 1-9 trade speed for size like zlib's levels.
+ * filter PNG_FILTER_BEST picks a filter per row (smallest sum of residuals),
+ * 0-4 forces one (PNG_FILTER_FAST is Up, the cheapest one that still helps photos).
+*/
+
+#ifndef PNG_OUT_H
+#define PNG_OUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread_pool.h"
+#include "bmpio.h" // bmp_writev_all, struct iovec, pixel_t
+
+#define PNG_LEVEL_DEFAULT 6
+#define PNG_FILTER_BEST -1
+#define PNG_FILTER_FAST 2
+
+#define PNG_BLOCK_BYTES (256 * 1024)    // filtered bytes per block, at least
+#define PNG_MAX_BLOCKS 1024
+#define PNG_WINDOW 32768                // deflate window, also the priming length
+#define PNG_HASH_BITS 15
+#define PNG_MIN_MATCH 3
+#define PNG_MAX_MATCH 258
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t bits;      // pending bits, LSB first
+    int nbits;
+} png_stream_t;
+
+typedef struct {
+    const pixel_t *pixels;
+    int32_t w, h;
+    int c;
+    int level;
+    int filter;
+    int32_t rows_per_block;
+    int blocks;
+
+    // per block results
+    png_stream_t *out;
+    uint32_t *adler;
+    size_t *filtered_len;
+    uint32_t *crc;
+    bool failed;
+} png_job_t;
+
+
+// ======== Checksums ========
+
+static uint32_t png_crc_table[256];
+static pthread_once_t png_crc_once = PTHREAD_ONCE_INIT;
+
+static void png_crc_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        png_crc_table[n] = c;
+    }
+}
+
+static uint32_t png_crc_update(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = png_crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t png_adler32(const uint8_t *p, size_t len) {
+    uint32_t s1 = 1, s2 = 0;
+    while (len > 0) {
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            s1 += *p++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+/* adler32 of A followed by B, given adler(A), adler(B) and len(B) */
+static uint32_t png_adler32_combine(uint32_t a1, uint32_t a2, size_t len2) {
+    const uint32_t base = 65521;
+    const uint32_t rem = (uint32_t) (len2 % base);
+    uint32_t sum1 = a1 & 0xffff;
+    uint32_t sum2 = (uint32_t) (((uint64_t) rem * sum1) % base);
+    sum1 += (a2 & 0xffff) + base - 1;
+    sum2 += ((a1 >> 16) & 0xffff) + ((a2 >> 16) & 0xffff) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= (base << 1)) sum2 -= (base << 1);
+    if (sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+
+// ======== Bit output ========
+
+static bool png_reserve(png_stream_t *s, size_t extra) {
+    if (s->len + extra <= s->cap) {
+        return true;
+    }
+    size_t cap = s->cap ? s->cap : 4096;
+    while (cap < s->len + extra) {
+        cap *= 2;
+    }
+    uint8_t *p = (uint8_t *) realloc(s->data, cap);
+    if (p == NULL) {
+        return false;
+    }
+    s->data = p;
+    s->cap = cap;
+    return true;
+}
+
+/* Append up to 32 bits (caller reserves space: at most 4 bytes leave per call) */
+static inline void png_put_bits(png_stream_t *s, uint32_t v, int n) {
+    s->bits |= (uint64_t) v << s->nbits;
+    s->nbits += n;
+    while (s->nbits >= 8) {
+        s->data[s->len++] = (uint8_t) s->bits;
+        s->bits >>= 8;
+        s->nbits -= 8;
+    }
+}
+
+static inline void png_align(png_stream_t *s) {
+    if (s->nbits > 0) {
+        png_put_bits(s, 0, 8 - s->nbits);
+    }
+}
+
+
+// ======== Fixed Huffman deflate ========
+
+static const uint16_t png_len_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t png_len_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t png_dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const uint8_t png_dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+typedef struct {
+    uint16_t lit_code[288];     // bit reversed fixed Huffman codes
+    uint8_t lit_bits[288];
+    uint8_t len_sym[PNG_MAX_MATCH + 1];     // match length -> length symbol index
+    uint8_t dist_sym[512];                  // see png_dist_index
+} png_tables_t;
+
+static png_tables_t png_tables;
+static pthread_once_t png_tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t png_bitrev(uint32_t code, int n) {
+    uint32_t r = 0;
+    while (n--) {
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+static void png_tables_init(void) {
+    png_tables_t *t = &png_tables;
+    for (int n = 0; n < 288; n++) {
+        uint32_t code;
+        int bits;
+        if (n <= 143)      { code = 0x30 + n;          bits = 8; }
+        else if (n <= 255) { code = 0x190 + n - 144;   bits = 9; }
+        else if (n <= 279) { code = n - 256;           bits = 7; }
+        else               { code = 0xc0 + n - 280;    bits = 8; }
+        t->lit_code[n] = (uint16_t) png_bitrev(code, bits);
+        t->lit_bits[n] = (uint8_t) bits;
+    }
+    for (int len = PNG_MIN_MATCH, j = 0; len <= PNG_MAX_MATCH; len++) {
+        while (j < 28 && len >= png_len_base[j + 1]) j++;
+        t->len_sym[len] = (uint8_t) j;
+    }
+    // distances 1..256 directly, above that in steps of 128
+    for (int d = 1, j = 0; d <= 256; d++) {
+        while (j < 29 && d >= png_dist_base[j + 1]) j++;
+        t->dist_sym[d - 1] = (uint8_t) j;
+    }
+    for (int i = 2, j = 0; i < 256; i++) {
+        const int d = (i << 7) + 1;
+        while (j < 29 && d >= png_dist_base[j + 1]) j++;
+        t->dist_sym[256 + i] = (uint8_t) j;
+    }
+}
+
+static inline int png_dist_index(int d) {
+    return (d <= 256) ? png_tables.dist_sym[d - 1] : png_tables.dist_sym[256 + ((d - 1) >> 7)];
+}
+
+static inline void png_put_literal(png_stream_t *s, int lit) {
+    png_put_bits(s, png_tables.lit_code[lit], png_tables.lit_bits[lit]);
+}
+
+static inline void png_put_match(png_stream_t *s, int len, int dist) {
+    const int ls = png_tables.len_sym[len];
+    png_put_bits(s, png_tables.lit_code[257 + ls], png_tables.lit_bits[257 + ls]);
+    if (png_len_extra[ls]) {
+        png_put_bits(s, len - png_len_base[ls], png_len_extra[ls]);
+    }
+    const int ds = png_dist_index(dist);
+    png_put_bits(s, png_bitrev(ds, 5), 5);
+    if (png_dist_extra[ds]) {
+        png_put_bits(s, dist - png_dist_base[ds], png_dist_extra[ds]);
+    }
+}
+
+static inline uint32_t png_hash(const uint8_t *p) {
+    return (((uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2]) * 2654435761u) >> (32 - PNG_HASH_BITS);
+}
+
+static inline int png_match_len(const uint8_t *a, const uint8_t *b, int limit) {
+    int n = 0;
+    while (n < limit && a[n] == b[n]) n++;
+    return n;
+}
+
+/* Longest match for buf[pos] in the window, length (0 if < PNG_MIN_MATCH) and *dist */
+static int png_longest(const uint8_t *buf, size_t pos, size_t end, const int32_t *head, const int32_t *prev,
+        int chain, int nice, int *dist) {
+    const int limit = (end - pos < PNG_MAX_MATCH) ? (int) (end - pos) : PNG_MAX_MATCH;
+    int best = PNG_MIN_MATCH - 1;
+    if (limit < PNG_MIN_MATCH) {
+        return 0;
+    }
+    int32_t cand = head[png_hash(buf + pos)];
+    while (cand >= 0 && pos - (size_t) cand <= PNG_WINDOW && chain-- > 0) {
+        if (buf[cand + best] == buf[pos + best]) {
+            const int l = png_match_len(buf + cand, buf + pos, limit);
+            if (l > best) {
+                best = l;
+                *dist = (int) (pos - cand);
+                if (l >= nice || l >= limit) {
+                    break;
+                }
+            }
+        }
+        const int32_t next = prev[cand & (PNG_WINDOW - 1)];
+        if (next >= cand) {
+            break;
+        }
+        cand = next;
+    }
+    return best >= PNG_MIN_MATCH ? best : 0;
+}
+
+static inline void png_insert(const uint8_t *buf, size_t pos, int32_t *head, int32_t *prev) {
+    const uint32_t h = png_hash(buf + pos);
+    prev[pos & (PNG_WINDOW - 1)] = head[h];
+    head[h] = (int32_t) pos;
+}
+
+/**
+ * Deflate buf[dict, dict + len) using buf[0, dict) as preset history.  'last' ends the
+ * stream (BFINAL), otherwise the output ends with a sync flush.  false on allocation failure
+*/
+static bool png_deflate_block(const uint8_t *buf, size_t dict, size_t len, int level, bool last, png_stream_t *s) {
+    // level 0: stored blocks, already byte aligned at the end
+    if (level <= 0) {
+        size_t pos = dict;
+        const size_t end = dict + len;
+        if (! png_reserve(s, len + 5 * (len / 65535 + 1) + 8)) {
+            return false;
+        }
+        do {
+            const size_t n = (end - pos > 65535) ? 65535 : end - pos;
+            png_put_bits(s, (last && pos + n == end) ? 1 : 0, 1);
+            png_put_bits(s, 0, 2);
+            png_align(s);
+            png_put_bits(s, (uint32_t) n, 16);
+            png_put_bits(s, (uint32_t) (~n & 0xffff), 16);
+            memcpy(s->data + s->len, buf + pos, n);
+            s->len += n;
+            pos += n;
+        } while (pos < end);
+        return true;
+    }
+
+    static const int chains[10] = { 0, 4, 8, 16, 16, 32, 64, 128, 256, 1024 };
+    static const int nices[10]  = { 0, 16, 32, 64, 64, 128, 128, 258, 258, 258 };
+    const int chain = chains[level > 9 ? 9 : level];
+    const int nice = nices[level > 9 ? 9 : level];
+    const bool lazy = level >= 4;
+    const bool insert_all = level >= 3;
+
+    int32_t *head = (int32_t *) malloc(sizeof(int32_t) << PNG_HASH_BITS);
+    int32_t *prev = (int32_t *) malloc(sizeof(int32_t) * PNG_WINDOW);
+    // worst case: 9 bits per literal, plus headers and flush
+    if (head == NULL || prev == NULL || ! png_reserve(s, len + len / 8 + 64)) {
+        free(head);
+        free(prev);
+        return false;
+    }
+    memset(head, 0xff, sizeof(int32_t) << PNG_HASH_BITS);
+    const size_t end = dict + len;
+    for (size_t p = 0; p + PNG_MIN_MATCH <= dict; p++) {
+        png_insert(buf, p, head, prev);
+    }
+
+    png_put_bits(s, last ? 1 : 0, 1);
+    png_put_bits(s, 1, 2); // fixed Huffman
+
+    size_t pos = dict;
+    while (pos < end) {
+        int dist = 0;
+        int l = (end - pos >= PNG_MIN_MATCH) ? png_longest(buf, pos, end, head, prev, chain, nice, &dist) : 0;
+        if (l > 0 && lazy && l < nice && pos + 1 + PNG_MIN_MATCH <= end) {
+            int dist2 = 0;
+            png_insert(buf, pos, head, prev);
+            const int l2 = png_longest(buf, pos + 1, end, head, prev, chain >> 1, nice, &dist2);
+            if (l2 > l) { // better match one byte on: emit this byte as a literal
+                png_put_literal(s, buf[pos]);
+                pos++;
+                continue;
+            }
+            if (insert_all) {
+                for (size_t p = pos + 1; p < pos + l && p + PNG_MIN_MATCH <= end; p++) png_insert(buf, p, head, prev);
+            }
+            png_put_match(s, l, dist);
+            pos += l;
+            continue;
+        }
+        if (l > 0) {
+            const size_t stop = insert_all ? pos + l : pos + 1;
+            for (size_t p = pos; p < stop && p + PNG_MIN_MATCH <= end; p++) png_insert(buf, p, head, prev);
+            png_put_match(s, l, dist);
+            pos += l;
+        }
+        else {
+            if (pos + PNG_MIN_MATCH <= end) {
+                png_insert(buf, pos, head, prev);
+            }
+            png_put_literal(s, buf[pos]);
+            pos++;
+        }
+    }
+    png_put_literal(s, 256); // end of block
+
+    if (last) {
+        png_align(s);
+    }
+    else { // sync flush: empty stored block
+        png_put_bits(s, 0, 3);
+        png_align(s);
+        png_put_bits(s, 0x0000, 16);
+        png_put_bits(s, 0xffff, 16);
+    }
+    free(head);
+    free(prev);
+    return true;
+}
+
+
+// ======== Filtering ========
+
+static inline uint8_t png_paeth(int a, int b, int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (uint8_t) a;
+    return (uint8_t) ((pb <= pc) ? b : c);
+}
+
+/* Filter one row with filter 'type' into out (no type byte), prev is the row above (zeros for the first) */
+static void png_filter_row(const uint8_t *row, const uint8_t *prev, size_t n, int bpp, int type, uint8_t *out) {
+    size_t i;
+    switch (type) {
+        case 0:
+        memcpy(out, row, n);
+        break;
+
+        case 1:
+        for (i = 0; i < (size_t) bpp; i++) out[i] = row[i];
+        for (; i < n; i++) out[i] = row[i] - row[i - bpp];
+        break;
+
+        case 2:
+        for (i = 0; i < n; i++) out[i] = row[i] - prev[i];
+        break;
+
+        case 3:
+        for (i = 0; i < (size_t) bpp; i++) out[i] = row[i] - (prev[i] >> 1);
+        for (; i < n; i++) out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        break;
+
+        default:
+        for (i = 0; i < (size_t) bpp; i++) out[i] = row[i] - prev[i];
+        for (; i < n; i++) out[i] = row[i] - png_paeth(row[i - bpp], prev[i], prev[i - bpp]);
+    }
+}
+
+/* Filter image rows [y0, y1) into out as PNG scanlines (type byte + data) */
+static void png_filter_rows(const png_job_t *job, int32_t y0, int32_t y1, uint8_t *out, uint8_t *scratch, const uint8_t *zeros) {
+    const size_t n = (size_t) job->w * job->c;
+    for (int32_t y = y0; y < y1; y++) {
+        const uint8_t *row = job->pixels + (size_t) y * n;
+        const uint8_t *prev = (y > 0) ? row - n : zeros;
+        uint8_t *dst = out + (size_t) (y - y0) * (n + 1);
+
+        if (job->filter >= 0) {
+            dst[0] = (uint8_t) job->filter;
+            png_filter_row(row, prev, n, job->c, job->filter, dst + 1);
+            continue;
+        }
+        // try all five, keep the smallest sum of residuals
+        int best = 0;
+        uint64_t best_est = UINT64_MAX;
+        for (int f = 0; f < 5; f++) {
+            uint8_t *cand = scratch + f * n;
+            png_filter_row(row, prev, n, job->c, f, cand);
+            uint64_t est = 0;
+            for (size_t i = 0; i < n; i++) est += (uint64_t) abs((int8_t) cand[i]);
+            if (est < best_est) {
+                best_est = est;
+                best = f;
+            }
+        }
+        dst[0] = (uint8_t) best;
+        memcpy(dst + 1, scratch + best * n, n);
+    }
+}
+
+
+// ======== Blocks ========
+
+/* Pool task: filter and deflate block b (plus the rows priming its window) */
+static void png_block_task(void *arg, int b) {
+    png_job_t *job = (png_job_t *) arg;
+    const size_t line = (size_t) job->w * job->c + 1;
+    const int32_t y0 = b * job->rows_per_block;
+    const int32_t y1 = (y0 + job->rows_per_block < job->h) ? y0 + job->rows_per_block : job->h;
+    int32_t prime_rows = 0;
+    if (b > 0 && job->level > 0) {
+        prime_rows = (int32_t) ((PNG_WINDOW + line - 1) / line);
+        if (prime_rows > y0) prime_rows = y0;
+    }
+
+    const size_t dict = (size_t) prime_rows * line;
+    const size_t len = (size_t) (y1 - y0) * line;
+    uint8_t *filt = (uint8_t *) malloc(dict + len);
+    uint8_t *scratch = (job->filter < 0) ? (uint8_t *) malloc(5 * (line - 1)) : NULL;
+    uint8_t *zeros = (uint8_t *) calloc(line, 1);
+    png_stream_t *s = &job->out[b];
+
+    if (filt == NULL || zeros == NULL || (job->filter < 0 && scratch == NULL)) {
+        job->failed = true;
+    }
+    else {
+        png_filter_rows(job, y0 - prime_rows, y1, filt, scratch, zeros);
+        // first block carries the zlib header (32K window, no preset dictionary)
+        if (b == 0 && png_reserve(s, 2)) {
+            s->data[s->len++] = 0x78;
+            s->data[s->len++] = 0x01;
+        }
+        if (! png_deflate_block(filt, dict, len, job->level, b == job->blocks - 1, s)) {
+            job->failed = true;
+        }
+        job->adler[b] = png_adler32(filt + dict, len);
+        job->filtered_len[b] = len;
+        job->crc[b] = png_crc_update(png_crc_update(0, (const uint8_t *) "IDAT", 4), s->data, s->len);
+    }
+    free(filt);
+    free(scratch);
+    free(zeros);
+}
+
+static void png_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+/* Write a whole chunk (type + data) with length and CRC into out, return bytes used */
+static size_t png_chunk(uint8_t *out, const char *type, const uint8_t *data, uint32_t len) {
+    png_put32(out, len);
+    memcpy(out + 4, type, 4);
+    if (len > 0) {
+        memcpy(out + 8, data, len);
+    }
+    png_put32(out + 8 + len, png_crc_update(0, out + 4, 4 + len));
+    return 12 + len;
+}
+
+/**
+ * Encode a top-down image of c channels (1-4) as PNG to an open descriptor, true on success
+ * level 0-9, filter PNG_FILTER_BEST or 0-4
+*/
+bool write_png_fd(int fd, int32_t w, int32_t h, int c, const pixel_t *data, int level, int filter) {
+    if (w <= 0 || h <= 0 || c < 1 || c > 4 || data == NULL) {
+        return false;
+    }
+    pthread_once(&png_crc_once, png_crc_init);
+    pthread_once(&png_tables_once, png_tables_init);
+
+    png_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.pixels = data;
+    job.w = w;
+    job.h = h;
+    job.c = c;
+    job.level = level < 0 ? 0 : (level > 9 ? 9 : level);
+    job.filter = (filter < 0 || filter > 4) ? PNG_FILTER_BEST : filter;
+
+    // enough rows per block to amortize priming, enough blocks to keep the pool busy
+    const size_t line = (size_t) w * c + 1;
+    int32_t rows = (int32_t) ((PNG_BLOCK_BYTES + line - 1) / line);
+    const int32_t spread = (h + 4 * pool_threads() - 1) / (4 * pool_threads());
+    if (rows < spread) rows = spread;
+    if ((h + rows - 1) / rows > PNG_MAX_BLOCKS) rows = (h + PNG_MAX_BLOCKS - 1) / PNG_MAX_BLOCKS;
+    job.rows_per_block = rows;
+    job.blocks = (h + rows - 1) / rows;
+
+    job.out = (png_stream_t *) calloc(job.blocks, sizeof(png_stream_t));
+    job.adler = (uint32_t *) calloc(job.blocks, sizeof(uint32_t));
+    job.filtered_len = (size_t *) calloc(job.blocks, sizeof(size_t));
+    job.crc = (uint32_t *) calloc(job.blocks, sizeof(uint32_t));
+    struct iovec *iov = (struct iovec *) malloc(sizeof(struct iovec) * (3 * job.blocks + 2));
+    bool ok = job.out && job.adler && job.filtered_len && job.crc && iov;
+
+    if (ok) {
+        pool_parallel_for(job.blocks, png_block_task, &job);
+        ok = ! job.failed;
+    }
+
+    if (ok) {
+        static const uint8_t sig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        static const uint8_t ctype[5] = { 0, 0, 4, 2, 6 };
+        uint8_t head[8 + 25];
+        uint8_t ihdr[13];
+        uint8_t (*idat_head)[8] = (uint8_t (*)[8]) malloc(8 * job.blocks);
+        uint8_t (*idat_crc)[4] = (uint8_t (*)[4]) malloc(4 * job.blocks);
+        uint8_t tail[16 + 12];
+        int cnt = 0;
+
+        memcpy(head, sig, 8);
+        png_put32(ihdr, (uint32_t) w);
+        png_put32(ihdr + 4, (uint32_t) h);
+        ihdr[8] = 8;            // bit depth
+        ihdr[9] = ctype[c];     // color type
+        ihdr[10] = 0;           // deflate
+        ihdr[11] = 0;           // adaptive filtering
+        ihdr[12] = 0;           // no interlace
+        png_chunk(head + 8, "IHDR", ihdr, 13);
+        iov[cnt].iov_base = head;
+        iov[cnt++].iov_len = sizeof(head);
+
+        uint32_t adler = job.adler[0];
+        for (int b = 0; b < job.blocks; b++) {
+            if (b > 0) {
+                adler = png_adler32_combine(adler, job.adler[b], job.filtered_len[b]);
+            }
+            if (idat_head == NULL || idat_crc == NULL) {
+                continue;
+            }
+            png_put32(idat_head[b], (uint32_t) job.out[b].len);
+            memcpy(idat_head[b] + 4, "IDAT", 4);
+            png_put32(idat_crc[b], job.crc[b]);
+            iov[cnt].iov_base = idat_head[b];
+            iov[cnt++].iov_len = 8;
+            iov[cnt].iov_base = job.out[b].data;
+            iov[cnt++].iov_len = job.out[b].len;
+            iov[cnt].iov_base = idat_crc[b];
+            iov[cnt++].iov_len = 4;
+        }
+
+        // zlib trailer in its own IDAT, then IEND
+        uint8_t adler_be[4];
+        png_put32(adler_be, adler);
+        size_t tail_len = png_chunk(tail, "IDAT", adler_be, 4);
+        tail_len += png_chunk(tail + tail_len, "IEND", NULL, 0);
+        iov[cnt].iov_base = tail;
+        iov[cnt++].iov_len = tail_len;
+
+        ok = idat_head != NULL && idat_crc != NULL;
+        for (int i = 0; ok && i < cnt; i += BMP_WRITE_IOV) {
+            ok = bmp_writev_all(fd, iov + i, (cnt - i < BMP_WRITE_IOV) ? cnt - i : BMP_WRITE_IOV);
+        }
+        free(idat_head);
+        free(idat_crc);
+    }
+
+    if (job.out != NULL) {
+        for (int b = 0; b < job.blocks; b++) free(job.out[b].data);
+    }
+    free(job.out);
+    free(job.adler);
+    free(job.filtered_len);
+    free(job.crc);
+    free(iov);
+    return ok;
+}
+
+/* Encode image to a PNG file (see write_png_fd), true on success */
+bool write_png(const char *filename, int32_t w, int32_t h, int c, const pixel_t *data, int level, int filter) {
+#ifdef _WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        perror("Couldn't open output file");
+        return false;
+    }
+    bool ok = write_png_fd(fd, w, h, c, data, level, filter);
+    ok = (close(fd) == 0) && ok;
+    if (! ok) {
+        fprintf(stderr, "Failure writing PNG file\n");
+    }
+    return ok;
+}
+
+#endif
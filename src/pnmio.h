@@ -0,0 +1,283 @@
+#ifndef PNMIO_H
+#define PNMIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "bmpio.h"      // file mapping and writev helpers
+
+/**
+ * http://netpbm.sourceforge.net/doc/pgm.html
+ * http://netpbm.sourceforge.net/doc/ppm.html
+ *
+ * Binary PGM (P5, gray) and PPM (P6, RGB) reading and writing.  Raw netpbm is a short text
+ * header followed by the samples exactly as repict holds them, which makes it the cheapest
+ * way to hand images between pipeline stages: no deflate, no row padding, no bottom-up rows.
+ *
+ * Reading maps the file; when the samples are 8-bit and the requested channels are the
+ * file's own, the image is a view of the mapping and nothing is copied (open_pnm with
+ * allow_view).  Other maxvals (1-65535) are scaled to 0-255.  Writing hands the header and
+ * the caller's image to the kernel in one writev when no conversion is needed.
+*/
+
+#define PNM_HEADER_MAX 64           // "P6\n<w> <h>\n255\n"
+#define PNM_WRITE_CHUNK (1 << 20)   // bytes of converted rows assembled per write
+
+typedef struct {
+    pixel_t *pixels;        // top-down rows of width * channels bytes
+    int32_t width;
+    int32_t height;
+    int channels;           // as requested (1-4), or the file's own: 1 for P5, 3 for P6
+    int maxval;
+
+    // internal: set when pixels points into the file mapping rather than an allocation
+    void *map;
+    size_t map_len;
+} pnm_image_t;
+
+
+// ======== Reading ========
+
+/* Next header number at *pos (skipping whitespace and # comments), -1 if there is none */
+static long pnm_header_value(const uint8_t *buf, size_t len, size_t *pos) {
+    size_t p = *pos;
+    while (p < len) {
+        if (buf[p] == '#') {
+            while (p < len && buf[p] != '\n' && buf[p] != '\r') p++;
+        }
+        else if (buf[p] == ' ' || buf[p] == '\t' || buf[p] == '\n' || buf[p] == '\r') {
+            p++;
+        }
+        else {
+            break;
+        }
+    }
+    if (p >= len || buf[p] < '0' || buf[p] > '9') {
+        return -1;
+    }
+    long v = 0;
+    for (; p < len && buf[p] >= '0' && buf[p] <= '9'; p++) {
+        if (v < (1L << 30)) { // anything this big fails the size checks anyway
+            v = v * 10 + (buf[p] - '0');
+        }
+    }
+    *pos = p;
+    return v;
+}
+
+/* Convert one row of native 8-bit samples (n channels, 1 or 3) to c channels */
+static void pnm_row(const uint8_t *src, pixel_t *dst, int32_t w, int n, int c) {
+    if (n == c) {
+        memcpy(dst, src, (size_t) w * c);
+        return;
+    }
+    for (int32_t x = 0; x < w; x++, src += n, dst += c) {
+        // RGB to gray takes the plain average, as repict_bw does
+        const pixel_t g = n == 1 ? src[0] : (pixel_t) ((src[0] + src[1] + src[2]) / 3);
+        switch (c) {
+            case 1:
+            dst[0] = g;
+            break;
+
+            case 2:
+            dst[0] = g;
+            dst[1] = 255;
+            break;
+
+            default:
+            dst[0] = n == 1 ? g : src[0];
+            dst[1] = n == 1 ? g : src[1];
+            dst[2] = n == 1 ? g : src[2];
+            if (c == 4) {
+                dst[3] = 255;
+            }
+        }
+    }
+}
+
+/**
+ * Decode PGM/PPM bytes already in memory into img.  desired_channels 0 keeps the file's own
+ * layout.  If allow_view and the samples are already exactly the requested layout,
+ * img->pixels points into buf and no copy is made (caller must keep buf alive), true on success
+*/
+bool decode_pnm(const uint8_t *buf, size_t len, pnm_image_t *img, int desired_channels, bool allow_view) {
+    memset(img, 0, sizeof(pnm_image_t));
+    if (len < 3 || buf[0] != 'P' || (buf[1] != '5' && buf[1] != '6')) {
+        fprintf(stderr, "Not a binary PGM/PPM file\n");
+        return false;
+    }
+    const int native = buf[1] == '5' ? 1 : 3;
+    size_t pos = 2;
+    const long w = pnm_header_value(buf, len, &pos);
+    const long h = pnm_header_value(buf, len, &pos);
+    const long maxval = pnm_header_value(buf, len, &pos);
+    if (w <= 0 || h <= 0 || maxval <= 0 || maxval > 65535 || pos >= len) {
+        fprintf(stderr, "Invalid PGM/PPM header\n");
+        return false;
+    }
+    pos++; // the single whitespace byte ending the header
+
+    const int sb = maxval > 255 ? 2 : 1; // bytes per sample, 16-bit ones big-endian
+    const size_t src_stride = (size_t) w * native * sb;
+    if ((len - pos) / src_stride < (size_t) h) {
+        fprintf(stderr, "PGM/PPM pixel data truncated\n");
+        return false;
+    }
+    const int c = (desired_channels >= 1 && desired_channels <= 4) ? desired_channels : native;
+    const size_t dst_stride = (size_t) w * c;
+    const uint8_t *samples = buf + pos;
+
+    img->width = (int32_t) w;
+    img->height = (int32_t) h;
+    img->channels = c;
+    img->maxval = (int) maxval;
+
+    // stored samples already match the output exactly, hand out the mapping itself
+    if (allow_view && maxval == 255 && c == native) {
+        img->pixels = (pixel_t *) samples;
+        return true;
+    }
+
+    pixel_t *out = (pixel_t *) malloc(dst_stride * h);
+    uint8_t *scaled = (maxval != 255) ? (uint8_t *) malloc((size_t) w * native) : NULL;
+    if (out == NULL || (maxval != 255 && scaled == NULL)) {
+        fprintf(stderr, "Failure allocating memory for PGM/PPM\n");
+        free(out);
+        free(scaled);
+        return false;
+    }
+    for (int32_t y = 0; y < h; y++) {
+        const uint8_t *src = samples + (size_t) y * src_stride;
+        if (scaled != NULL) { // other depths: scale every sample to 0-255 first
+            for (long i = 0; i < w * native; i++) {
+                const long v = sb == 2 ? (src[2 * i] << 8 | src[2 * i + 1]) : src[i];
+                scaled[i] = (uint8_t) (((v > maxval ? maxval : v) * 255 + maxval / 2) / maxval);
+            }
+            src = scaled;
+        }
+        pnm_row(src, out + (size_t) y * dst_stride, (int32_t) w, native, c);
+    }
+    free(scaled);
+
+    img->pixels = out;
+    return true;
+}
+
+/**
+ * Read PGM/PPM file into img (see decode_pnm), release with close_pnm, true on success
+*/
+bool open_pnm(const char *filename, pnm_image_t *img, int desired_channels, bool allow_view) {
+    size_t len = 0;
+    const uint8_t *map = bmp_map_file(filename, &len);
+    if (map == NULL) {
+        memset(img, 0, sizeof(pnm_image_t));
+        return false;
+    }
+    if (! decode_pnm(map, len, img, desired_channels, allow_view)) {
+        bmp_unmap_file(map, len);
+        return false;
+    }
+    if ((const uint8_t *) img->pixels >= map && (const uint8_t *) img->pixels < map + len) {
+        img->map = (void *) map; // view into the mapping, keep it until close_pnm
+        img->map_len = len;
+    }
+    else {
+        bmp_unmap_file(map, len);
+    }
+    return true;
+}
+
+/* Release pixels from open_pnm */
+void close_pnm(pnm_image_t *img) {
+    if (img->map != NULL) {
+        bmp_unmap_file((const uint8_t *) img->map, img->map_len);
+    }
+    else {
+        free(img->pixels);
+    }
+    memset(img, 0, sizeof(pnm_image_t));
+}
+
+
+// ======== Writing ========
+
+/**
+ * Write a top-down image of c channels (1-4) to an open descriptor as PGM (rgb false: gray,
+ * RGB averaged) or PPM (rgb true: gray replicated), alpha dropped, true on success
+*/
+bool write_pnm_fd(int fd, int32_t w, int32_t h, int c, const pixel_t *data, bool rgb) {
+    if (w <= 0 || h <= 0 || c < 1 || c > 4 || data == NULL) {
+        return false;
+    }
+    const int oc = rgb ? 3 : 1;
+    char hdr[PNM_HEADER_MAX];
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = (size_t) snprintf(hdr, sizeof(hdr), "P%c\n%d %d\n255\n", rgb ? '6' : '5', (int) w, (int) h);
+
+    // samples already stored as the file wants them: header and image in one writev
+    if (c == oc) {
+        iov[1].iov_base = (void *) data;
+        iov[1].iov_len = (size_t) w * h * c;
+        return bmp_writev_all(fd, iov, 2);
+    }
+
+    const size_t row_bytes = (size_t) w * oc;
+    const int32_t chunk_rows = (row_bytes >= PNM_WRITE_CHUNK) ? 1 : (int32_t) (PNM_WRITE_CHUNK / row_bytes);
+    uint8_t *chunk = (uint8_t *) malloc(row_bytes * (chunk_rows < h ? chunk_rows : h));
+    if (chunk == NULL) {
+        fprintf(stderr, "Failure allocating PGM/PPM write buffer\n");
+        return false;
+    }
+    bool first = true;
+    for (int32_t y = 0; y < h; ) {
+        int32_t rows = 0;
+        for (; rows < chunk_rows && y < h; rows++, y++) {
+            const pixel_t *src = data + (size_t) y * w * c;
+            uint8_t *dst = chunk + rows * row_bytes;
+            for (int32_t x = 0; x < w; x++, src += c) {
+                if (rgb) { // gray (+ alpha) replicated, RGBA loses alpha
+                    dst[3 * x] = src[0];
+                    dst[3 * x + 1] = c >= 3 ? src[1] : src[0];
+                    dst[3 * x + 2] = c >= 3 ? src[2] : src[0];
+                }
+                else {
+                    dst[x] = c >= 3 ? (pixel_t) ((src[0] + src[1] + src[2]) / 3) : src[0];
+                }
+            }
+        }
+        iov[1].iov_base = chunk;
+        iov[1].iov_len = rows * row_bytes;
+        if (! bmp_writev_all(fd, first ? iov : iov + 1, first ? 2 : 1)) { // header goes with the first chunk
+            free(chunk);
+            return false;
+        }
+        first = false;
+    }
+    free(chunk);
+    return true;
+}
+
+/* Write a top-down image of c channels to a PGM/PPM file (see write_pnm_fd), true on success */
+bool write_pnm(const char *filename, int32_t w, int32_t h, int c, const pixel_t *data, bool rgb) {
+#ifdef _WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        perror("Couldn't open output file");
+        return false;
+    }
+    bool ok = write_pnm_fd(fd, w, h, c, data, rgb);
+    ok = (close(fd) == 0) && ok;
+    if (! ok) {
+        fprintf(stderr, "Failure writing PGM/PPM file\n");
+    }
+    return ok;
+}
+
+#endif
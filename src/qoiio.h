@@ -0,0 +1,355 @@
+#ifndef QOIIO_H
+#define QOIIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "bmpio.h"      // file mapping and writev helpers
+
+/**
+ * https://qoiformat.org/qoi-specification.pdf
+ *
+ * QOI ("Quite OK Image") reading and writing.  Lossless like PNG, but each pixel is coded
+ * on its own from the previous one and a 64 entry cache of recent colors - a run, a cache
+ * index, a small difference or the literal value - with no entropy coding.  Both ways run
+ * at hundreds of MB/s on one core, so it suits intermediates between pipeline stages that
+ * must stay lossless and would otherwise spend most of their time in deflate.
+ *
+ * QOI stores RGB or RGBA: gray images are written as RGB (gray + alpha as RGBA) and read
+ * back to any of 1-4 channels, RGB to gray taking the plain average as repict_bw does.
+*/
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING 8                   // end marker: seven 0x00 then 0x01
+#define QOI_MAX_PIXELS 400000000u       // limit of the reference implementation
+
+#define QOI_OP_INDEX 0x00   // 00xxxxxx
+#define QOI_OP_DIFF 0x40    // 01xxxxxx
+#define QOI_OP_LUMA 0x80    // 10xxxxxx
+#define QOI_OP_RUN 0xc0     // 11xxxxxx
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+
+typedef union {
+    struct { uint8_t r, g, b, a; } rgba;
+    uint32_t v;
+} qoi_rgba_t;
+
+static inline int qoi_hash(qoi_rgba_t p) {
+    return (p.rgba.r * 3 + p.rgba.g * 5 + p.rgba.b * 7 + p.rgba.a * 11) & 63;
+}
+
+static inline uint32_t qoi_read32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline void qoi_write32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+
+// ======== Reading ========
+
+/* Store one decoded pixel as c channels (c is a constant in each caller, so this folds away) */
+static inline void qoi_put(pixel_t *dst, qoi_rgba_t p, int c) {
+    switch (c) {
+        case 1:
+        dst[0] = (pixel_t) ((p.rgba.r + p.rgba.g + p.rgba.b) / 3);
+        break;
+
+        case 2:
+        dst[0] = (pixel_t) ((p.rgba.r + p.rgba.g + p.rgba.b) / 3);
+        dst[1] = p.rgba.a;
+        break;
+
+        case 3:
+        dst[0] = p.rgba.r;
+        dst[1] = p.rgba.g;
+        dst[2] = p.rgba.b;
+        break;
+
+        default:
+        memcpy(dst, &p, 4);
+    }
+}
+
+/* Decode the chunks in [p, end) into n pixels of c channels, false if the data runs out */
+static inline bool qoi_decode_pixels(const uint8_t *p, const uint8_t *end, pixel_t *out, size_t n, int c) {
+    qoi_rgba_t index[64];
+    memset(index, 0, sizeof(index));
+    qoi_rgba_t px;
+    px.v = 0;
+    px.rgba.a = 255;
+
+    for (size_t i = 0; i < n; ) {
+        if (p >= end) {
+            return false;
+        }
+        const int b1 = *p++;
+        if (b1 == QOI_OP_RGB) {
+            if (end - p < 3) {
+                return false;
+            }
+            px.rgba.r = p[0];
+            px.rgba.g = p[1];
+            px.rgba.b = p[2];
+            p += 3;
+        }
+        else if (b1 == QOI_OP_RGBA) {
+            if (end - p < 4) {
+                return false;
+            }
+            memcpy(&px, p, 4);
+            p += 4;
+        }
+        else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+            px = index[b1];
+        }
+        else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+            px.rgba.r += ((b1 >> 4) & 3) - 2;
+            px.rgba.g += ((b1 >> 2) & 3) - 2;
+            px.rgba.b += (b1 & 3) - 2;
+        }
+        else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+            if (p >= end) {
+                return false;
+            }
+            const int b2 = *p++;
+            const int vg = (b1 & 0x3f) - 32;
+            px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+            px.rgba.g += vg;
+            px.rgba.b += vg - 8 + (b2 & 0x0f);
+        }
+        else { // run of the previous pixel, which is already in the index
+            size_t run = (size_t) (b1 & 0x3f) + 1;
+            if (run > n - i) {
+                run = n - i;
+            }
+            for (; run > 0; run--, i++) {
+                qoi_put(out + i * c, px, c);
+            }
+            continue;
+        }
+        index[qoi_hash(px)] = px;
+        qoi_put(out + i * c, px, c);
+        i++;
+    }
+    return true;
+}
+
+/**
+ * Decode QOI bytes in memory to a malloc'd top-down image of desired_channels (1-4, 0 keeps
+ * the file's 3 or 4), size in *w, *h and channels in *channels, NULL on failure
+*/
+pixel_t *decode_qoi(const uint8_t *buf, size_t len, int32_t *w, int32_t *h, int *channels, int desired_channels) {
+    if (len < QOI_HEADER_SIZE + QOI_PADDING || memcmp(buf, "qoif", 4) != 0) {
+        fprintf(stderr, "Not a QOI file\n");
+        return NULL;
+    }
+    const uint32_t width = qoi_read32(buf + 4);
+    const uint32_t height = qoi_read32(buf + 8);
+    const int native = buf[12];
+    if (width == 0 || height == 0 || (native != 3 && native != 4)
+            || height >= QOI_MAX_PIXELS / width) {
+        fprintf(stderr, "Invalid QOI header\n");
+        return NULL;
+    }
+    const int c = (desired_channels >= 1 && desired_channels <= 4) ? desired_channels : native;
+    const size_t n = (size_t) width * height;
+    pixel_t *out = (pixel_t *) malloc(n * c);
+    if (out == NULL) {
+        fprintf(stderr, "Failure allocating memory for QOI\n");
+        return NULL;
+    }
+
+    const uint8_t *p = buf + QOI_HEADER_SIZE, *end = buf + len - QOI_PADDING;
+    bool ok;
+    switch (c) { // one specialised loop per output layout
+        case 1: ok = qoi_decode_pixels(p, end, out, n, 1); break;
+        case 2: ok = qoi_decode_pixels(p, end, out, n, 2); break;
+        case 3: ok = qoi_decode_pixels(p, end, out, n, 3); break;
+        default: ok = qoi_decode_pixels(p, end, out, n, 4);
+    }
+    if (! ok) {
+        fprintf(stderr, "QOI pixel data truncated\n");
+        free(out);
+        return NULL;
+    }
+    *w = (int32_t) width;
+    *h = (int32_t) height;
+    *channels = c;
+    return out;
+}
+
+/* Read a QOI file (see decode_qoi), free() the result, NULL on failure */
+pixel_t *load_qoi(const char *filename, int32_t *w, int32_t *h, int *channels, int desired_channels) {
+    size_t len = 0;
+    const uint8_t *map = bmp_map_file(filename, &len);
+    if (map == NULL) {
+        return NULL;
+    }
+    pixel_t *out = decode_qoi(map, len, w, h, channels, desired_channels);
+    bmp_unmap_file(map, len);
+    return out;
+}
+
+
+// ======== Writing ========
+
+/* One pixel of c channels as RGBA, gray replicated and alpha 255 where missing */
+static inline qoi_rgba_t qoi_get(const pixel_t *src, int c) {
+    qoi_rgba_t p;
+    switch (c) {
+        case 1:
+        p.rgba.r = p.rgba.g = p.rgba.b = src[0];
+        p.rgba.a = 255;
+        break;
+
+        case 2:
+        p.rgba.r = p.rgba.g = p.rgba.b = src[0];
+        p.rgba.a = src[1];
+        break;
+
+        case 3:
+        p.rgba.r = src[0];
+        p.rgba.g = src[1];
+        p.rgba.b = src[2];
+        p.rgba.a = 255;
+        break;
+
+        default:
+        memcpy(&p, src, 4);
+    }
+    return p;
+}
+
+/* Code n pixels of c channels into out (room for the worst case), return the bytes written */
+static inline size_t qoi_encode_pixels(const pixel_t *data, size_t n, int c, uint8_t *out) {
+    qoi_rgba_t index[64];
+    memset(index, 0, sizeof(index));
+    qoi_rgba_t prev;
+    prev.v = 0;
+    prev.rgba.a = 255;
+    uint8_t *o = out;
+    int run = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const qoi_rgba_t px = qoi_get(data + i * c, c);
+        if (px.v == prev.v) {
+            if (++run == 62) {
+                *o++ = (uint8_t) (QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            *o++ = (uint8_t) (QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        const int h = qoi_hash(px);
+        if (index[h].v == px.v) {
+            *o++ = (uint8_t) (QOI_OP_INDEX | h);
+        }
+        else {
+            index[h] = px;
+            if (px.rgba.a == prev.rgba.a) {
+                const int8_t vr = (int8_t) (px.rgba.r - prev.rgba.r);
+                const int8_t vg = (int8_t) (px.rgba.g - prev.rgba.g);
+                const int8_t vb = (int8_t) (px.rgba.b - prev.rgba.b);
+                const int8_t vg_r = (int8_t) (vr - vg);
+                const int8_t vg_b = (int8_t) (vb - vg);
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                    *o++ = (uint8_t) (QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+                }
+                else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                    *o++ = (uint8_t) (QOI_OP_LUMA | (vg + 32));
+                    *o++ = (uint8_t) ((vg_r + 8) << 4 | (vg_b + 8));
+                }
+                else {
+                    *o++ = QOI_OP_RGB;
+                    *o++ = px.rgba.r;
+                    *o++ = px.rgba.g;
+                    *o++ = px.rgba.b;
+                }
+            }
+            else {
+                *o++ = QOI_OP_RGBA;
+                memcpy(o, &px, 4);
+                o += 4;
+            }
+        }
+        prev = px;
+    }
+    if (run > 0) {
+        *o++ = (uint8_t) (QOI_OP_RUN | (run - 1));
+    }
+    return (size_t) (o - out);
+}
+
+/**
+ * Write a top-down image of c channels (1-4) to an open descriptor as QOI, RGB for 1 and 3
+ * channels, RGBA for 2 and 4, true on success.  The file is coded in memory and written once
+*/
+bool write_qoi_fd(int fd, int32_t w, int32_t h, int c, const pixel_t *data) {
+    if (w <= 0 || h <= 0 || c < 1 || c > 4 || data == NULL
+            || (uint32_t) h >= QOI_MAX_PIXELS / (uint32_t) w) {
+        return false;
+    }
+    const int oc = (c == 2 || c == 4) ? 4 : 3;
+    const size_t n = (size_t) w * h;
+    uint8_t *buf = (uint8_t *) malloc(QOI_HEADER_SIZE + n * (oc + 1) + QOI_PADDING);
+    if (buf == NULL) {
+        fprintf(stderr, "Failure allocating QOI write buffer\n");
+        return false;
+    }
+
+    memcpy(buf, "qoif", 4);
+    qoi_write32(buf + 4, (uint32_t) w);
+    qoi_write32(buf + 8, (uint32_t) h);
+    buf[12] = (uint8_t) oc;
+    buf[13] = 0;            // sRGB with linear alpha
+    size_t len = QOI_HEADER_SIZE;
+    switch (c) { // one specialised loop per input layout
+        case 1: len += qoi_encode_pixels(data, n, 1, buf + len); break;
+        case 2: len += qoi_encode_pixels(data, n, 2, buf + len); break;
+        case 3: len += qoi_encode_pixels(data, n, 3, buf + len); break;
+        default: len += qoi_encode_pixels(data, n, 4, buf + len);
+    }
+    memset(buf + len, 0, QOI_PADDING - 1);
+    buf[len + QOI_PADDING - 1] = 1;
+    len += QOI_PADDING;
+
+    struct iovec iov = { buf, len };
+    const bool ok = bmp_writev_all(fd, &iov, 1);
+    free(buf);
+    return ok;
+}
+
+/* Write a top-down image of c channels to a QOI file (see write_qoi_fd), true on success */
+bool write_qoi(const char *filename, int32_t w, int32_t h, int c, const pixel_t *data) {
+#ifdef _WIN32
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        perror("Couldn't open output file");
+        return false;
+    }
+    bool ok = write_qoi_fd(fd, w, h, c, data);
+    ok = (close(fd) == 0) && ok;
+    if (! ok) {
+        fprintf(stderr, "Failure writing QOI file\n");
+    }
+    return ok;
+}
+
+#endif
@@ -14,28 +14,51 @@
  * 
  * I/O currently must be handled externally - repict only deals with pixel matrices
  * 
+ * All of this state is kept per thread, so several threads can each run their own
+ * image through the library at once (set source, filter, get result on one thread)
+ * 
  * There is also a persistent kernel stored in repict that can be set 
  * #################################################################################
  * 
  * 
  * ############## How To Use #######################################################
  * ====== BASIC : ======
- * repict_set_source(*input, width, height, channels);  --> must be set before use
+ * repict_set_source(*input, width, height, channels, ownership);  --> must be set before use
  * ...                                                      ...
  * repict_bw(args, ... );                               --> pass filter arguments
  * ...                                                      ...
  * pixel_t *result = repict_get_result();               --> pointer to working image
  * repict_clean()                                       --> clean internal memory
  * 
+ * The source is borrowed (REPICT_SOURCE_BORROW, read only and left to the caller),
+ * copied (REPICT_SOURCE_COPY) or handed over (REPICT_SOURCE_ADOPT, freed by repict once a
+ * filter replaces it; repict_adopt_source(..., dealloc) for memory free() can't release)
+ * 
  * 
  * ====== MORE : ======
  * repict_get_working_channels]();                      --> get working image channels
+ * repict_get_working_width() / _height()               --> get working image dimensions
  * repict_get_result_as_copy();                         --> get copy of working image
  * 
  * 
  * ====== UTILITY : ======
+ * repict_convolve_s16(ker, kn, out, norm, scale)      --> signed response (int16) of working image, no clamping
+ * repict_convolve_bank(kers, kn, count, outs, fuse)    --> several responses in one pass (gradient magnitude...)
  * repict_alloc_image(width, height, channels)          --> alloc image sized chunk
  * repict_copy_image(image, width, height, channels)    --> return copy of image
+ * repict_set_buffer_pool(max_bytes)                    --> reuse freed images (long running callers)
+ * repict_set_trace(fn, user)                           --> fn(name, begin, user) around each stage
+ * repict_gauss_cache_clear()                           --> free cached gaussian kernels
+ * repict_set_edge_mode(mode, value)                    --> border handling: zero, trash, clamp, mirror, wrap, constant
+ * repict_set_parallel(fn)                              --> fn(count, task, arg) runs convolution tiles (thread pool)
+ * 
+ * 
+ * ====== REGIONS OF INTEREST : ======
+ * repict_gaussian_filter_roi(sig, n, x, y, w, h)       --> blur only a rectangle of the working image, in place
+ * repict_average_filter_roi / repict_convolve_roi / repict_bw_roi   --> likewise
+ * repict_view(data, w, h, stride, channels)            --> describe a strided image (or part of one)
+ * repict_view_roi(view, x, y, w, h)                    --> sub-rectangle of a view, no copy
+ * repict_convolve_view(src, x, y, dst, ker, kn)        --> convolve the dst sized rectangle at (x, y) of src into dst
  * 
  * #################################################################################
  * 
@@ -45,7 +68,6 @@
  * - handle I/O
  * - canny
  * - optimize convolution
- * - parse txt into kernel_t array
 */
 
 #ifndef REPICT_IMPLEMENTATION
@@ -53,10 +75,24 @@
 
 #include <float.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+
+// SSE2 paths (any x86-64), REPICT_NO_SIMD builds the plain C ones only
+#if defined(__SSE2__) && !defined(REPICT_NO_SIMD)
+#include <emmintrin.h>
+#define REPICT_SSE2 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define REPICT_FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define REPICT_FORCE_INLINE inline
+#endif
 
 #ifndef M_PI // make sure to define pi
 #define M_PI 3.1415926535
@@ -79,53 +115,186 @@
 // UI
 #define ERROR_MSG "Error:"
 
-// kernel edge method
-#define REPICT_EDGE_ALL 0
-#define REPICT_EDGE_TRASH 1
+// kernel edge method: what taps past the image border read (repict_set_edge_mode)
+#define REPICT_EDGE_ALL 0       // zero
+#define REPICT_EDGE_TRASH 1     // border pixels aren't convolved, set to TRASH_VALUE
+#define REPICT_EDGE_CLAMP 2     // nearest edge pixel
+#define REPICT_EDGE_MIRROR 3    // reflected about the edge pixel (dcb|abcd|cba)
+#define REPICT_EDGE_WRAP 4      // opposite side of the image
+#define REPICT_EDGE_CONSTANT 5  // a given value
 
-#ifndef REPICT_EDGE_STRATEGY
+#ifndef REPICT_EDGE_STRATEGY    // mode threads start with
 #define REPICT_EDGE_STRATEGY REPICT_EDGE_ALL
 #endif
 
+// normalization for signed (int16) convolution output
+#define REPICT_NORM_NONE 0      // raw response * scale (derivatives: Sobel, Laplacian...)
+#define REPICT_NORM_SUM 1       // divide by the kernel sum, like repict_convolve (none if it sums to 0)
+#define REPICT_NORM_ABS 2       // divide by the sum of |taps|, keeps any response within -255..255
+
+// kernel banks (repict_convolve_bank)
+#define REPICT_BANK_MAX 8       // kernels convolved in one pass
+#define REPICT_FUSE_NONE 0      // one output per kernel
+#define REPICT_FUSE_GRADIENT 1  // x, y derivative -> magnitude, orientation
+#define REPICT_FUSE_MAX 2       // strongest |response| and which kernel gave it
+#define REPICT_ANGLE_SCALE 100  // orientation unit: 1/100 degree
+
+// who owns the source image (repict_set_source), false / true still mean borrow / copy
+#define REPICT_SOURCE_BORROW 0  // the caller's, read only: never written or freed by repict
+#define REPICT_SOURCE_COPY 1    // copied into a repict buffer first
+#define REPICT_SOURCE_ADOPT 2   // handed over, repict frees it (free() or the repict_adopt_source deallocator)
+
 
 typedef unsigned char pixel_t;      // 8-bit format for a pixel channel type
 typedef float kernel_t;             // kernel unit type
 
+// an image or a rectangle of one, rows stride bytes apart (repict_view, repict_view_roi)
+typedef struct {
+    pixel_t *data;          // top-left pixel
+    int32_t width, height;
+    size_t stride;          // bytes from one row to the next, at least width * channels
+    int channels;
+} repict_view_t;
+
+// library state is per thread: separate threads can each work on their own image
+#ifndef REPICT_TLS
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define REPICT_TLS _Thread_local
+#elif defined(_MSC_VER)
+#define REPICT_TLS __declspec(thread)
+#else
+#define REPICT_TLS __thread
+#endif
+#endif
+
 // internal store
-size_t kernel_n         = 1;        // dimensions of kernel (kernel dim -> 2*kernel_n + 1)
-size_t kernel_n_store   = 0;        // store old dimensions to minimize realloc
-kernel_t *kernel        = NULL;     // pointer to kernel matrix
-pixel_t *working_img    = NULL;     // current working copy of output image
+REPICT_TLS size_t kernel_n         = 1;        // dimensions of kernel (kernel dim -> 2*kernel_n + 1)
+REPICT_TLS size_t kernel_n_store   = 0;        // store old dimensions to minimize realloc
+REPICT_TLS kernel_t *kernel        = NULL;     // pointer to kernel matrix
+REPICT_TLS pixel_t *working_img    = NULL;     // current working copy of output image
+
+// the source while it is still the working image (borrowed or adopted, NULL once a filter replaced it)
+typedef void (*repict_free_fn) (void *p);
+static REPICT_TLS pixel_t *r_source         = NULL;
+static REPICT_TLS int r_source_mode         = REPICT_SOURCE_COPY;
+static REPICT_TLS repict_free_fn r_source_free = NULL;
 
 // image dimensions
-static unsigned int r_channels   = 3;    // channels of source image (can be changed)
-static int32_t r_width           = 0;    // dimensions of source image (can be changed)
-static int32_t r_height          = 0;    // ...
+static REPICT_TLS unsigned int r_channels   = 3;    // channels of source image (can be changed)
+static REPICT_TLS int32_t r_width           = 0;    // dimensions of source image (can be changed)
+static REPICT_TLS int32_t r_height          = 0;    // ...
+
+// convolution borders
+static REPICT_TLS int r_edge_mode           = REPICT_EDGE_STRATEGY;
+static REPICT_TLS pixel_t r_edge_value      = 0;    // for REPICT_EDGE_CONSTANT
+
+// recycled image buffers, kept warm between images when a pool limit is set
+#define REPICT_POOL_SLOTS 8
+static REPICT_TLS pixel_t *r_pool_buf[REPICT_POOL_SLOTS];
+static REPICT_TLS size_t r_pool_size[REPICT_POOL_SLOTS];
+static REPICT_TLS size_t r_pool_bytes       = 0;    // bytes currently held
+static REPICT_TLS size_t r_pool_limit       = 0;    // 0: pooling off, buffers are freed
+
+// tracing hook, called from whichever thread runs a stage (NULL: off, costs one branch)
+typedef void (*repict_trace_fn) (const char *name, bool begin, void *user);
+static repict_trace_fn r_trace_fn   = NULL;
+static void *r_trace_user           = NULL;
+
+// parallel hook for tiled ops: run task(arg, i) for every i in [0, count) and return once
+// all are done (NULL: tiles run one after another on the calling thread)
+typedef void (*repict_parallel_fn) (int count, void (*task)(void *arg, int index), void *arg);
+static repict_parallel_fn r_parallel = NULL;
+
+// neighbourhood ops (convolutions, banks) run over tiles of this many output pixels
+#ifndef REPICT_TILE_W
+#define REPICT_TILE_W 2048
+#endif
+#ifndef REPICT_TILE_H
+#define REPICT_TILE_H 32
+#endif
+typedef void (*m_tile_fn) (void *op, int32_t x0, int32_t y0, int32_t x1, int32_t y1);  // output [x0, x1) x [y0, y1)
+
+// generated gaussian kernels, shared read only by all threads (least recently used evicted)
+#define REPICT_GAUSS_CACHE 8
+#define REPICT_GAUSS_QUANT 100          // sigma is quantized to 1/100 for the cache key
+
+typedef struct {
+    int sigma_q;                // sigma * REPICT_GAUSS_QUANT
+    int kw;                     // kernel width
+    kernel_t *k2d;              // kw * kw taps g(x, y) / (2 pi sig^2)
+
+    int refs;                   // cache + users
+    unsigned long used;
+} repict_gauss_t;
+
+static repict_gauss_t *r_gauss_cache[REPICT_GAUSS_CACHE];
+static unsigned long r_gauss_clock  = 0;
+static pthread_mutex_t r_gauss_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef REPICT_NO_TRACE
+#define REPICT_TRACE(name, begin) do { if (r_trace_fn != NULL) r_trace_fn((name), (begin), r_trace_user); } while (0)
+#else
+#define REPICT_TRACE(name, begin) ((void) 0)
+#endif
 
 
 // ======== Internal functions ========
 static void m_set_kernel_size(int c);
 static kernel_t *m_generate_kernel_space(int c);
+static const repict_gauss_t *m_gauss_acquire(float sigma);                // cached gaussian kernels for sigma
+static void m_gauss_release(const repict_gauss_t *g);
 static void m_generate_kernel_internal(int c);
 static void m_convolve(pixel_t *input, pixel_t *output);                                // internal convolution using kernel, result -> output
 static void m_convolve_kernel(pixel_t *input, pixel_t *output, kernel_t *ker, int kn);  // convolution using specified kernel, result -> output
+static void m_run_tiled(int32_t width, int32_t height, m_tile_fn fn, void *op);         // fn over every tile, in parallel if hooked
+static void m_run_tiled_rect(int32_t x, int32_t y, int32_t width, int32_t height,
+        m_tile_fn fn, void *op);                                                        // same over a rectangle of the output
+static void m_convolve_view(repict_view_t src, int32_t x, int32_t y, repict_view_t dst,
+        const kernel_t *ker, int kn);                                                   // rectangle of src at (x, y) -> dst
+static int m_convolve_roi(const kernel_t *ker, int kn, int n,
+        int32_t x, int32_t y, int32_t w, int32_t h);                                    // rectangle of the working image, in place
 static void m_alloc_working(int32_t w, int32_t h, int bpp);     // allocate the working image
 static void m_swap_working(pixel_t *output);                    // place output in working image
+static void m_release_working(void);                            // give up the working image (source back to its owner)
+static pixel_t *m_writable_working(void);                       // working image, copied first if it is borrowed
+static void m_release_image(pixel_t *p, size_t size);           // free or pool an image buffer
 
 // ======== Repict functions ========
 int repict_convolve(kernel_t *ker, int kn);                     // convolution with input kernel (doesn't change internal)
+int repict_convolve_s16(const kernel_t *ker, int kn, int16_t *out,
+        int norm, float scale);                                 // signed convolution of working image into out (w * h * channels)
+int repict_convolve_bank(const kernel_t *const *kernels, int kn, int count,
+        int16_t **outputs, int fuse);                           // several kernels in one pass, optionally fused
 int repict_gaussian_filter(float sig, int n, bool keep);        // compute gaussian
 int repict_bw(bool keep);                                       // apply B&W filter, keep all channels or output to 1 channel
 int repict_average_filter(float width, int n, bool keep);
+int repict_convolve_roi(const kernel_t *ker, int kn, int32_t x, int32_t y, int32_t w, int32_t h);  // convolve a rectangle of the working image
+int repict_gaussian_filter_roi(float sig, int n, int32_t x, int32_t y, int32_t w, int32_t h);      // gaussian over a rectangle
+int repict_average_filter_roi(float width, int n, int32_t x, int32_t y, int32_t w, int32_t h);     // average over a rectangle
+int repict_bw_roi(int32_t x, int32_t y, int32_t w, int32_t h);                                     // gray a rectangle, channels kept
+int repict_convolve_view(repict_view_t src, int32_t x, int32_t y, repict_view_t dst,
+        const kernel_t *ker, int kn);                                                           // rectangle of a view into another view
+repict_view_t repict_view(pixel_t *data, int32_t w, int32_t h, size_t stride, int c);          // view of a strided image (stride 0: packed rows)
+repict_view_t repict_view_roi(repict_view_t v, int32_t x, int32_t y, int32_t w, int32_t h);    // rectangle of a view, clipped to it
+repict_view_t repict_working_view(void);                                                        // the working image as a view
 
 void repict_set_source(pixel_t *in, const int32_t w, const int32_t h, 
-        const unsigned int c, bool copy);                                                  // set source image properties
+        const unsigned int c, int ownership);                                   // set source image (REPICT_SOURCE_*)
+void repict_adopt_source(pixel_t *in, const int32_t w, const int32_t h,
+        const unsigned int c, repict_free_fn dealloc);                          // take over source, freed with dealloc
 pixel_t *repict_get_result(void);                                               // get pointer to working image
 pixel_t *repict_get_result_as_copy(void);                                       // get pointer to copy of working image
 int repict_get_working_channels(void);                                          // get number of channels in working image
+int32_t repict_get_working_width(void);                                         // get dimensions of working image
+int32_t repict_get_working_height(void);
 pixel_t *repict_copy_image(const pixel_t *in, int32_t w, int32_t h, int bpp);   // copy an image
 pixel_t *repict_alloc_image(int32_t w, int32_t h, int bpp);                     // malloc image of dimensions
 void repict_clean(void);                                                        // free internal memory
+void repict_set_buffer_pool(size_t max_bytes);                                  // keep up to max_bytes of freed images for reuse
+void repict_set_trace(repict_trace_fn fn, void *user);                          // report begin/end of each stage to fn (NULL: off)
+void repict_gauss_cache_clear(void);                                            // free cached gaussian kernels not in use
+void repict_set_edge_mode(int mode, pixel_t value);                             // how convolutions read past the border (REPICT_EDGE_*)
+void repict_set_parallel(repict_parallel_fn fn);                                // run the tiles of neighbourhood ops through fn (NULL: serial)
 
 // ======== Utility functions ========
 static void error(const char *err);
@@ -143,7 +312,7 @@ static void m_set_kernel_size(int c) {
 static kernel_t *m_generate_kernel_space(int c) {
     if (c < 0 || c > KERNEL_MAX || (c % 2 == 0)) {
         error("kernel cannot be set to this size");
-        return;
+        return NULL;
     }
     kernel_t *k;
     int size_k = c * c;
@@ -167,9 +336,119 @@ static void m_generate_kernel_internal(int c) {
 }
 
 
+static void m_gauss_free(repict_gauss_t *g) {
+    free(g->k2d);
+    free(g);
+}
+
+/* Build the gaussian kernel for quantized sigma */
+static repict_gauss_t *m_gauss_generate(int sigma_q) {
+    const float sigma = (float) sigma_q / REPICT_GAUSS_QUANT;
+    const int kw = (2 * (int)(2 * sigma)) + 3; // kernel dimension appropriate for value of sigma
+    if (kw > KERNEL_MAX) {
+        error("sigma too large for kernel size limit");
+        return NULL;
+    }
+    repict_gauss_t *g = (repict_gauss_t *) calloc(1, sizeof(repict_gauss_t));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->sigma_q = sigma_q;
+    g->kw = kw;
+    g->k2d = (kernel_t *) malloc(kw * kw * sizeof(kernel_t));
+    if (g->k2d == NULL) {
+        m_gauss_free(g);
+        error("gaussian kernel allocation failure");
+        return NULL;
+    }
+
+    const float sig2 = sigma * sigma;
+    const float mean = (float) floor(kw / 2.0) + 1;
+
+    // generate kernel values for gaussian filter, function of sigma
+    size_t c = 0;
+    for (unsigned int i = 1; i <= kw; i++) {
+        for (unsigned int j = 1; j <= kw; j++) {
+            g->k2d[c] = (kernel_t) gaussian(i - mean, j - mean, sig2) / (2 * M_PI * sig2);
+            c++;
+        }
+    }
+    return g;
+}
+
+/* Gaussian kernels for sigma, generated once and then shared; give back with m_gauss_release */
+static const repict_gauss_t *m_gauss_acquire(float sigma) {
+    const int sigma_q = (int) lrintf(sigma * REPICT_GAUSS_QUANT);
+
+    pthread_mutex_lock(&r_gauss_lock);
+    for (int i = 0; i < REPICT_GAUSS_CACHE; i++) {
+        repict_gauss_t *g = r_gauss_cache[i];
+        if (g != NULL && g->sigma_q == sigma_q) {
+            g->refs++;
+            g->used = ++r_gauss_clock;
+            pthread_mutex_unlock(&r_gauss_lock);
+            return g;
+        }
+    }
+    pthread_mutex_unlock(&r_gauss_lock);
+
+    // generate outside the lock; a thread that raced us here and inserted first wins
+    REPICT_TRACE("gaussian kernel", true);
+    repict_gauss_t *g = m_gauss_generate(sigma_q);
+    REPICT_TRACE("gaussian kernel", false);
+    if (g == NULL) {
+        return NULL;
+    }
+    g->refs = 2;
+
+    pthread_mutex_lock(&r_gauss_lock);
+    for (int i = 0; i < REPICT_GAUSS_CACHE; i++) {
+        repict_gauss_t *cached = r_gauss_cache[i];
+        if (cached != NULL && cached->sigma_q == sigma_q) {
+            cached->refs++;
+            cached->used = ++r_gauss_clock;
+            pthread_mutex_unlock(&r_gauss_lock);
+            m_gauss_free(g);
+            return cached;
+        }
+    }
+    int slot = 0;
+    for (int i = 0; i < REPICT_GAUSS_CACHE; i++) {
+        if (r_gauss_cache[i] == NULL) {
+            slot = i;
+            break;
+        }
+        if (r_gauss_cache[i]->used < r_gauss_cache[slot]->used) {
+            slot = i;
+        }
+    }
+    repict_gauss_t *old = r_gauss_cache[slot];
+    if (old != NULL && --old->refs == 0) {
+        m_gauss_free(old);
+    }
+    r_gauss_cache[slot] = g;
+    g->used = ++r_gauss_clock;
+    pthread_mutex_unlock(&r_gauss_lock);
+    return g;
+}
+
+static void m_gauss_release(const repict_gauss_t *g) {
+    if (g == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&r_gauss_lock);
+    repict_gauss_t *e = (repict_gauss_t *) g;
+    if (--e->refs == 0) {
+        m_gauss_free(e);
+    }
+    pthread_mutex_unlock(&r_gauss_lock);
+}
+
+
 static void m_alloc_working(int32_t w, int32_t h, int bpp) {
     pixel_t *p;
-    if (working_img == NULL) {
+    if (working_img == NULL || working_img == r_source) { // the source can't be resized in place
+        m_release_working();
         p = (pixel_t *) malloc(bpp * r_width * r_height);
     }
     else {
@@ -185,11 +464,43 @@ static void m_alloc_working(int32_t w, int32_t h, int bpp) {
 static void m_swap_working(pixel_t *output) {
     //working_img = repict_copy_image(output, width, height, channels);
 
-    // working_img holds obsolete data, free
-    free(working_img);
+    REPICT_TRACE("swap", true);
+    // working_img holds obsolete data, free (or hand the source back)
+    m_release_working();
 
     // output is the allocation from a repict function that is current
     working_img = output;
+    REPICT_TRACE("swap", false);
+}
+
+/* Release the working image: a borrowed source is left alone, an adopted one goes to its
+    deallocator, anything else back to the buffer pool */
+static void m_release_working(void) {
+    if (working_img != NULL && working_img == r_source) {
+        if (r_source_mode == REPICT_SOURCE_ADOPT) {
+            r_source_free(working_img);
+        }
+    }
+    else {
+        m_release_image(working_img, (size_t) r_width * r_height * r_channels);
+    }
+    r_source = NULL;
+    working_img = NULL;
+}
+
+/* Working image for filters that write in place, a borrowed source is copied first */
+static pixel_t *m_writable_working(void) {
+    if (working_img != NULL && working_img == r_source && r_source_mode == REPICT_SOURCE_BORROW) {
+        REPICT_TRACE("source copy", true);
+        pixel_t *copy = repict_copy_image(working_img, r_width, r_height, r_channels);
+        REPICT_TRACE("source copy", false);
+        if (copy == NULL) {
+            return NULL;
+        }
+        working_img = copy;
+        r_source = NULL;
+    }
+    return working_img;
 }
 
 /* Convolution of working image and kernel, result placed in */
@@ -201,71 +512,295 @@ static void m_convolve(pixel_t *input, pixel_t *output) {
     m_convolve_kernel(input, output, kernel, kernel_n);
 }
 
-/* Convolution using kernel 'ker' that ignores edges of size (kernel width/2) */
-static void m_convolve_kernel(pixel_t *input, pixel_t *output, kernel_t *ker, int kn) {
-    if (r_width < kn || r_height < kn) {
-        error("cannot perform convolution - image too small for kernel size");
-        return;
+/* Source index for virtual index v (may be outside [0, n)) under edge mode 'mode',
+    -1 when it reads the constant */
+static inline int m_edge_index(int v, int n, int mode) {
+    if (v >= 0 && v < n) {
+        return v;
     }
-    if (kn % 2 == 0) {
-        error("kernel width must be odd");
+    switch (mode) {
+        case REPICT_EDGE_CLAMP:
+        return v < 0 ? 0 : n - 1;
+
+        case REPICT_EDGE_MIRROR: // reflect about the edge pixels: -1 -> 1, n -> n - 2
+        if (n == 1) {
+            return 0;
+        }
+        v %= 2 * (n - 1);
+        if (v < 0) {
+            v += 2 * (n - 1);
+        }
+        return v < n ? v : 2 * (n - 1) - v;
+
+        case REPICT_EDGE_WRAP:
+        v %= n;
+        return v < 0 ? v + n : v;
+
+        default: // constant, and the legacy modes (border taps read 0)
+        return -1;
+    }
+}
+
+/* Value a border tap reads when the edge mode gives no source pixel */
+static pixel_t m_edge_constant(void) {
+    return r_edge_mode == REPICT_EDGE_CONSTANT ? r_edge_value : 0;
+}
+
+// a neighbourhood op split into tiles (m_run_tiled)
+typedef struct {
+    m_tile_fn fn;
+    void *op;
+    int32_t x, y;           // output rectangle, image coordinates
+    int32_t width, height;
+    int cols;               // tiles per row of tiles
+} m_tiling_t;
+
+static void m_tile_task(void *arg, int index) {
+    const m_tiling_t *t = (const m_tiling_t *) arg;
+    const int32_t dx = (index % t->cols) * REPICT_TILE_W;
+    const int32_t dy = (index / t->cols) * REPICT_TILE_H;
+    const int32_t x1 = t->width - dx > REPICT_TILE_W ? dx + REPICT_TILE_W : t->width;
+    const int32_t y1 = t->height - dy > REPICT_TILE_H ? dy + REPICT_TILE_H : t->height;
+    t->fn(t->op, t->x + dx, t->y + dy, t->x + x1, t->y + y1);
+}
+
+/**
+ * Run fn over a width x height output one tile at a time, the tiles handed to the
+ * repict_set_parallel hook when there is one.  A tile function gets everything it needs
+ * through op (workers don't share the caller's per thread state), reads its halo (the kn/2
+ * pixels around the tile) from the input as the edge mode says and writes only its own
+ * output pixels, so tiles never wait on each other.
+*/
+static void m_run_tiled(int32_t width, int32_t height, m_tile_fn fn, void *op) {
+    m_run_tiled_rect(0, 0, width, height, fn, op);
+}
+
+/* m_run_tiled over the output rectangle [x, x + width) x [y, y + height) only */
+static void m_run_tiled_rect(int32_t x, int32_t y, int32_t width, int32_t height, m_tile_fn fn, void *op) {
+    m_tiling_t t = { fn, op, x, y, width, height, (width + REPICT_TILE_W - 1) / REPICT_TILE_W };
+    const int count = t.cols * ((height + REPICT_TILE_H - 1) / REPICT_TILE_H);
+    repict_parallel_fn parallel = r_parallel;
+    if (parallel == NULL || count < 2) {
+        for (int i = 0; i < count; i++) {
+            m_tile_task(&t, i);
+        }
         return;
     }
-    if (output == NULL) {
-        error("no output image provided for convolution");
+    parallel(count, m_tile_task, &t);
+}
+
+// one convolution (m_convolve_view), shared by its tiles
+typedef struct {
+    const pixel_t *in;      // whole image, width x height
+    size_t in_stride;
+    pixel_t *out;           // holds output pixel (out_x, out_y) of the image at its top-left
+    size_t out_stride;
+    int32_t out_x, out_y;
+    const kernel_t *ker;
+    int kn;
+    float ksum;
+    int32_t width, height;
+    int channels;
+    int edge_mode;
+    pixel_t fill;           // what border taps read when the edge mode has no source pixel
+} m_conv_op_t;
+
+/**
+ * Output pixels [x0, x1) x [y0, y1) of a convolution.  Rows outside the image are remapped
+ * by the edge mode per tap, so each tap adds a whole run of interior samples without any
+ * bounds checks; only the kn/2 columns at each side of the image look up their source
+ * column.  Tiles whose halo lies inside the image take the interior loop only.
+*/
+static void m_convolve_tile(void *arg, int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    const m_conv_op_t *op = (const m_conv_op_t *) arg;
+    const int khl = op->kn / 2;
+    const int c = op->channels;
+    const int32_t w = op->width, h = op->height;
+    const int n = (x1 - x0) * c;            // samples in a tile row
+    const bool trash = op->edge_mode == REPICT_EDGE_TRASH;
+
+    float *acc = (float *) malloc(sizeof(float) * n);
+    if (acc == NULL) {
+        error("convolution allocation failure");
         return;
     }
-    
 
-    // convolution, unoptimized
-    const int khl = kn / 2;
-    float ksum = 0;
-    for (unsigned int i = 0; i < kn*kn; i++) {
-        ksum += ker[i];
-    }
-    int stride = r_width * r_channels;
-    int xn = stride - khl;
-    int yn = r_height * r_channels - khl;
-
-    for (unsigned int x = 0; x < r_width; x += r_channels) {
-        for (unsigned int y = 0; y < r_height; y += r_channels) {
-
-            if ((x >= khl && x < xn && y >= khl && y < yn) || REPICT_EDGE_STRATEGY == REPICT_EDGE_ALL) {
-                float acc = 0.0;
-                int c = 0;
-                for (int i = -khl; i <= khl; i++) {
-                    for (int j = -khl; j <= khl; j++) {
-                        // for this strategy, kernel should operate even on edge pixels
-                        if (REPICT_EDGE_STRATEGY == REPICT_EDGE_ALL) {
-                            // don't overstep edges
-                            if (y + j < 0 || y + j >= r_height || x + i < 0 || x + i >= r_width) {
-                                continue;
-                            }
+    // columns of the tile whose taps all land inside the image
+    const int32_t xl = khl < w ? khl : w;
+    const int32_t xr = w - khl > xl ? w - khl : xl;
+    const int32_t ix0 = x0 > xl ? x0 : xl;
+    int32_t ix1 = x1 < xr ? x1 : xr;
+    if (ix1 < ix0) {
+        ix1 = ix0;
+    }
+
+    for (int32_t y = y0; y < y1; y++) {
+        pixel_t *out = op->out + (size_t) (y - op->out_y) * op->out_stride + (size_t) (x0 - op->out_x) * c;
+        if (trash && (y < khl || y >= h - khl)) {
+            memset(out, TRASH_VALUE, n);
+            continue;
+        }
+        for (int s = 0; s < n; s++) {
+            acc[s] = 0;
+        }
+
+        // tap (i, j) reads the pixel at (x - i, y - j), kernel rows run along x
+        int t = 0;
+        for (int i = -khl; i <= khl; i++) {
+            for (int j = -khl; j <= khl; j++, t++) {
+                const kernel_t k = op->ker[t];
+                if (k == 0) {
+                    continue;
+                }
+                const int sy = m_edge_index(y - j, h, op->edge_mode);
+                if (sy < 0) { // the whole row reads the constant
+                    const float v = op->fill * k;
+                    for (int s = 0; s < n; s++) {
+                        acc[s] += v;
+                    }
+                    continue;
+                }
+                const pixel_t *src = op->in + (size_t) sy * op->in_stride;
+
+                const pixel_t *from = src + (ix0 - i) * c;
+                float *to = acc + (ix0 - x0) * c;
+                const int run = (ix1 - ix0) * c;
+                int s = 0;
+#ifdef REPICT_SSE2
+                const __m128 vk = _mm_set1_ps(k);
+                const __m128i zero = _mm_setzero_si128();
+                for (; s + 8 <= run; s += 8) { // same multiply then add as below, so same result
+                    const __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (from + s)), zero);
+                    const __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(p, zero));
+                    const __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(p, zero));
+                    _mm_storeu_ps(to + s, _mm_add_ps(_mm_loadu_ps(to + s), _mm_mul_ps(lo, vk)));
+                    _mm_storeu_ps(to + s + 4, _mm_add_ps(_mm_loadu_ps(to + s + 4), _mm_mul_ps(hi, vk)));
+                }
+#endif
+                for (; s < run; s++) { // interior, no branches
+                    to[s] += from[s] * k;
+                }
+                for (int32_t x = x0; x < x1; x++) {
+                    if (x == ix0) { // skip the interior
+                        x = ix1;
+                        if (x >= x1) {
+                            break;
                         }
-                        acc += input[(y - j) * stride + x - i] * ker[c];
-                        c++;
+                    }
+                    const int sx = m_edge_index(x - i, w, op->edge_mode);
+                    float *a = acc + (x - x0) * c;
+                    for (int ch = 0; ch < c; ch++) {
+                        a[ch] += (sx < 0 ? op->fill : src[sx * c + ch]) * k;
                     }
                 }
-                acc /= ksum;
-                output[y * stride + x] = (pixel_t) acc;
             }
-            else {
-                switch (REPICT_EDGE_STRATEGY) {
-                    case REPICT_EDGE_ALL:
-                    output[y * stride + x] = (pixel_t) TRASH_VALUE;
-                    break;
+        }
 
-                    default:
-                    output[y * stride + x] = (pixel_t) TRASH_VALUE;
+        for (int s = 0; s < n; s++) {
+            float v = acc[s];
+            if (op->ksum != 0) { // zero sum kernels (edges, sharpen deltas) aren't normalized
+                v /= op->ksum;
+            }
+            out[s] = (pixel_t) (v < 0 ? 0 : (v > PIXEL_MAX ? PIXEL_MAX : v));
+        }
+        if (trash) {
+            for (int32_t x = x0; x < x1; x++) {
+                if (x < xl || x >= xr) {
+                    memset(out + (x - x0) * c, TRASH_VALUE, c);
                 }
             }
         }
     }
+    free(acc);
+}
+
+/**
+ * Convolution of input by kernel 'ker' (kn x kn) into output, every channel on its own,
+ * border taps read as the edge mode says (repict_set_edge_mode).  REPICT_EDGE_TRASH writes
+ * TRASH_VALUE over the border instead.  Runs tiled (m_run_tiled).
+*/
+static void m_convolve_kernel(pixel_t *input, pixel_t *output, kernel_t *ker, int kn) {
+    if (output == NULL) {
+        error("no output image provided for convolution");
+        return;
+    }
+    m_convolve_view(repict_view(input, r_width, r_height, 0, r_channels), 0, 0,
+            repict_view(output, r_width, r_height, 0, r_channels), ker, kn);
+}
+
+/**
+ * Convolve the dst.width x dst.height rectangle at (x, y) of src into dst.  Taps read
+ * src's own pixels around the rectangle (the halo) and only go by the edge mode past src's
+ * borders, so the rectangle comes out exactly as it would from convolving the whole of
+ * src; nothing outside it is computed.  dst must not overlap the rectangle or its halo.
+*/
+static void m_convolve_view(repict_view_t src, int32_t x, int32_t y, repict_view_t dst, const kernel_t *ker, int kn) {
+    if (kn % 2 == 0) {
+        error("kernel width must be odd");
+        return;
+    }
+
+    REPICT_TRACE("convolve pass", true);
+    m_conv_op_t op;
+    op.in = src.data;
+    op.in_stride = src.stride;
+    op.out = dst.data;
+    op.out_stride = dst.stride;
+    op.out_x = x;
+    op.out_y = y;
+    op.ker = ker;
+    op.kn = kn;
+    op.ksum = 0;
+    for (int i = 0; i < kn * kn; i++) {
+        op.ksum += ker[i];
+    }
+    op.width = src.width;
+    op.height = src.height;
+    op.channels = src.channels;
+    op.edge_mode = r_edge_mode;
+    op.fill = m_edge_constant();
+    m_run_tiled_rect(x, y, dst.width, dst.height, m_convolve_tile, &op);
+    REPICT_TRACE("convolve pass", false);
+}
+
+/* Return image buffer to the pool (if on and there is room), otherwise free it */
+static void m_release_image(pixel_t *p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    if (r_pool_bytes + size <= r_pool_limit) {
+        for (int i = 0; i < REPICT_POOL_SLOTS; i++) {
+            if (r_pool_buf[i] == NULL) {
+                r_pool_buf[i] = p;
+                r_pool_size[i] = size;
+                r_pool_bytes += size;
+                return;
+            }
+        }
+    }
+    free(p);
 }
 
 pixel_t *repict_alloc_image(int32_t w, int32_t h, int bpp) {
+    const size_t size = (size_t) bpp * w * h;
+
+    // smallest pooled buffer that fits, as long as it isn't wastefully large
+    int best = -1;
+    for (int i = 0; i < REPICT_POOL_SLOTS; i++) {
+        if (r_pool_buf[i] != NULL && r_pool_size[i] >= size && r_pool_size[i] <= 2 * size
+                && (best < 0 || r_pool_size[i] < r_pool_size[best])) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        pixel_t *p = r_pool_buf[best];
+        r_pool_buf[best] = NULL;
+        r_pool_bytes -= r_pool_size[best];
+        return p;
+    }
+
     pixel_t *p;
-    p = (pixel_t *) malloc(bpp * r_width * r_height);
+    p = (pixel_t *) malloc(size);
     if (p == NULL) {
         error("new image allocation failure");
         return NULL;
@@ -275,14 +810,21 @@ pixel_t *repict_alloc_image(int32_t w, int32_t h, int bpp) {
 
 pixel_t *repict_copy_image(const pixel_t *in, int32_t w, int32_t h, int bpp) {
     pixel_t *new_img = repict_alloc_image(w, h, bpp);
-    int64_t range = w * h * bpp;
-    for (unsigned int i = 0; i < range; i++) {
-        new_img[i] = in[i];
+    if (new_img != NULL && in != NULL) {
+        memcpy(new_img, in, (size_t) w * h * bpp);
     }
     return new_img;
 }
 
-void repict_set_source(pixel_t *in, const int32_t w, const int32_t h, const unsigned int c, bool copy) {
+/**
+ * Set the image filters start from.  ownership (REPICT_SOURCE_*) says what happens to in:
+ *   BORROW  used in place and never written or freed, the caller keeps it alive until
+ *           repict_clean (filters write new images; _roi filters copy it first)
+ *   COPY    copied, the caller can do anything with in afterwards
+ *   ADOPT   used in place and freed with free() once replaced or on repict_clean, see
+ *           repict_adopt_source for other allocators
+*/
+void repict_set_source(pixel_t *in, const int32_t w, const int32_t h, const unsigned int c, int ownership) {
     if (w < 1 || h < 1) {
         error("dimensions must be postitive non-zero");
         return;
@@ -294,14 +836,33 @@ void repict_set_source(pixel_t *in, const int32_t w, const int32_t h, const unsi
         error("channels must be 1-4");
         return;
     }
+    if (ownership < REPICT_SOURCE_BORROW || ownership > REPICT_SOURCE_ADOPT) {
+        error("unknown source ownership");
+        return;
+    }
     r_width = w;
     r_height = h;
     r_channels = c;
-    if (copy) { // copy input image instead of just setting the pointer
+    if (ownership == REPICT_SOURCE_COPY) { // copy input image instead of just setting the pointer
+        REPICT_TRACE("source copy", true);
         working_img = repict_copy_image(in, w, h, c);
+        REPICT_TRACE("source copy", false);
+        r_source = NULL;
     }
     else {
         working_img = in;
+        r_source = in;
+        r_source_free = free;
+    }
+    r_source_mode = ownership;
+}
+
+/* Adopt in as the source (REPICT_SOURCE_ADOPT), released with dealloc (NULL: free) instead of free,
+    e.g. stbi_image_free for an stb_image decode */
+void repict_adopt_source(pixel_t *in, const int32_t w, const int32_t h, const unsigned int c, repict_free_fn dealloc) {
+    repict_set_source(in, w, h, c, REPICT_SOURCE_ADOPT);
+    if (working_img == in && in != NULL) {
+        r_source_free = dealloc != NULL ? dealloc : free;
     }
 }
 
@@ -317,21 +878,110 @@ int repict_get_working_channels(void) {
     return r_channels;
 }
 
+int32_t repict_get_working_width(void) {
+    return r_width;
+}
+
+int32_t repict_get_working_height(void) {
+    return r_height;
+}
+
+/* Clip the rectangle *x, *y, *w, *h to [0, width) x [0, height), false if nothing is left */
+static bool m_clip_rect(int32_t *x, int32_t *y, int32_t *w, int32_t *h, int32_t width, int32_t height) {
+    int32_t x1 = *x + *w, y1 = *y + *h;
+    *x = *x < 0 ? 0 : *x;
+    *y = *y < 0 ? 0 : *y;
+    x1 = x1 > width ? width : x1;
+    y1 = y1 > height ? height : y1;
+    *w = x1 > *x ? x1 - *x : 0;
+    *h = y1 > *y ? y1 - *y : 0;
+    return *w > 0 && *h > 0;
+}
+
+/* View of a w x h image of c channels whose rows are stride bytes apart (0: packed, w * c) */
+repict_view_t repict_view(pixel_t *data, int32_t w, int32_t h, size_t stride, int c) {
+    repict_view_t v = { data, w, h, stride != 0 ? stride : (size_t) w * c, c };
+    return v;
+}
+
+/* The w x h rectangle at (x, y) of v, clipped to v (width or height 0 if none of it is inside) */
+repict_view_t repict_view_roi(repict_view_t v, int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (! m_clip_rect(&x, &y, &w, &h, v.width, v.height)) {
+        w = h = 0;
+    }
+    repict_view_t r = { v.data + (size_t) y * v.stride + (size_t) x * v.channels, w, h, v.stride, v.channels };
+    return r;
+}
+
+/* The working image as a view (valid until the next filter replaces it) */
+repict_view_t repict_working_view(void) {
+    return repict_view(working_img, r_width, r_height, 0, r_channels);
+}
+
 void repict_clean(void) {
     if (kernel != NULL) {
         free(kernel);
         kernel = NULL;
     }
     if (working_img != NULL) {
-        free(working_img);
-        working_img = NULL;
+        m_release_working();
+    }
+}
+
+/* Choose what convolutions on this thread read past the image border (REPICT_EDGE_*),
+    value is the pixel REPICT_EDGE_CONSTANT reads */
+void repict_set_edge_mode(int mode, pixel_t value) {
+    if (mode < REPICT_EDGE_ALL || mode > REPICT_EDGE_CONSTANT) {
+        error("unknown edge mode");
+        return;
+    }
+    r_edge_mode = mode;
+    r_edge_value = value;
+}
+
+/* Free the cached gaussian kernels (those still in use go when released) */
+void repict_gauss_cache_clear(void) {
+    pthread_mutex_lock(&r_gauss_lock);
+    for (int i = 0; i < REPICT_GAUSS_CACHE; i++) {
+        repict_gauss_t *g = r_gauss_cache[i];
+        if (g != NULL && --g->refs == 0) {
+            m_gauss_free(g);
+        }
+        r_gauss_cache[i] = NULL;
+    }
+    pthread_mutex_unlock(&r_gauss_lock);
+}
+
+/* Report the begin and end of each stage (filter, kernel build, convolution pass, swap...)
+    to fn, from the thread running it.  fn must be thread safe; NULL turns tracing off */
+void repict_set_trace(repict_trace_fn fn, void *user) {
+    r_trace_user = user;
+    r_trace_fn = fn;
+}
+
+/* Run the tiles of convolutions and kernel banks through fn, e.g. a thread pool's parallel
+    for (shared by all threads, set it before processing starts; NULL: tiles run serially) */
+void repict_set_parallel(repict_parallel_fn fn) {
+    r_parallel = fn;
+}
+
+/* Keep up to max_bytes of released images for reuse by later filters/images on this thread,
+    0 turns pooling off and frees what is held */
+void repict_set_buffer_pool(size_t max_bytes) {
+    r_pool_limit = max_bytes;
+    for (int i = 0; i < REPICT_POOL_SLOTS && r_pool_bytes > r_pool_limit; i++) {
+        if (r_pool_buf[i] != NULL) {
+            free(r_pool_buf[i]);
+            r_pool_bytes -= r_pool_size[i];
+            r_pool_buf[i] = NULL;
+        }
     }
 }
 
 
 /**
  * Convert image to black and white.  keep = true: image channels remain the same
- * keep = false: image downgrades to a single channel
+ * keep = false: image downgrades to a single channel.  A single channel image is left as it is
 */
 int repict_bw(bool keep) {
     if (working_img == NULL) {
@@ -339,6 +989,10 @@ int repict_bw(bool keep) {
         return -1;
     }
 
+    if (r_channels == 1) { // already gray (e.g. decoded straight to one channel)
+        return 1;
+    }
+    REPICT_TRACE("bw", true);
     pixel_t *new_img;
     if (keep) {
         new_img = repict_alloc_image(r_width, r_height, r_channels);
@@ -371,6 +1025,7 @@ int repict_bw(bool keep) {
     if (! keep) {
         r_channels = 1;
     }
+    REPICT_TRACE("bw", false);
     return 1;
 }
 
@@ -381,12 +1036,443 @@ int repict_convolve(kernel_t *ker, int kn) {
         error("image not initialized");
         return -1;
     }
+    REPICT_TRACE("convolve", true);
     pixel_t *new_img = repict_alloc_image(r_width, r_height, r_channels);
     m_convolve_kernel(working_img, new_img, ker, kn);
     m_swap_working(new_img);
+    REPICT_TRACE("convolve", false);
+    return 1;
+}
+
+
+/* Round to nearest (even) and saturate to int16, exactly as the SSE2 path does */
+static inline int16_t m_sat16(float v) {
+    v = v < INT16_MIN ? INT16_MIN : (v > INT16_MAX ? INT16_MAX : v);
+    return (int16_t) lrintf(v);
+}
+
+#ifdef REPICT_SSE2
+/* m_sat16 for 8 values, stored to out */
+static inline void m_sat16_x8(__m128 a, __m128 b, int16_t *out) {
+    const __m128 lo = _mm_set1_ps(INT16_MIN), hi = _mm_set1_ps(INT16_MAX);
+    a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+    b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+    _mm_storeu_si128((__m128i *) out, _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+}
+#endif
+
+// non-zero taps of a kernel bank, shared by its row passes
+typedef struct {
+    int count;              // kernels
+    int taps;               // positions where any kernel is non-zero
+    int *tx, *ty;           // tap offset from the output pixel (x, y)
+    int *off;               // same, in samples
+    kernel_t *fcoef;        // [k * taps + t]
+    int16_t *icoef;         // [k * taps + t], whole number kernels only
+    int32_t *pairs;         // [k * (taps + 1) / 2 + p]: taps 2p, 2p+1 packed for madd
+    bool integer;           // every tap a whole number, sums fit 32 bits
+
+    const pixel_t *in;      // working image
+    int32_t width, height;
+    int channels;
+    int stride;             // samples per row
+    int khl;
+    int edge_mode;
+    pixel_t fill;           // what border taps read when the edge mode has no source pixel
+
+    const float *scale;     // per kernel
+    int16_t **outputs;
+    int fuse;
+} m_bank_t;
+
+/* Tap t of the bank for output sample s (pixel x, row y), remapped at the border */
+static inline pixel_t m_bank_tap(const pixel_t *in, const m_bank_t *b, int t, int32_t x, int32_t y, int s) {
+    const int sx = m_edge_index(x - b->tx[t], b->width, b->edge_mode);
+    const int sy = m_edge_index(y - b->ty[t], b->height, b->edge_mode);
+    if (sx < 0 || sy < 0) {
+        return b->fill;
+    }
+    return in[(size_t) sy * b->stride + sx * b->channels + s % b->channels];
+}
+
+/* Integer taps for samples [s0, s1) of row y into acc rows (stride apart), scalar (edges, no SSE2) */
+static void m_bank_row_int(const pixel_t *in, float *acc, int32_t y, int s0, int s1, const m_bank_t *b) {
+    const int stride = b->stride;
+    for (int s = s0; s < s1; s++) {
+        const int32_t x = s / b->channels;
+        for (int k = 0; k < b->count; k++) {
+            const int16_t *coef = b->icoef + k * b->taps;
+            int32_t sum = 0;
+            for (int t = 0; t < b->taps; t++) {
+                sum += m_bank_tap(in, b, t, x, y, s) * coef[t];
+            }
+            acc[k * stride + s] = (float) sum;
+        }
+    }
+}
+
+#ifdef REPICT_SSE2
+/* Integer taps over interior samples [s0, s1) of row y, 8 at a time: each neighbourhood is
+    loaded and widened once, taps go in pairs so one madd does two multiply-adds per pixel
+    for every kernel in the bank.  Responses go to acc, or when 'direct' is given straight
+    to those outputs (scaled and saturated).  Returns the first sample not done */
+static REPICT_FORCE_INLINE int m_bank_row_sse2_n(const pixel_t *in, float *acc, int32_t y, int s0, int s1,
+        const m_bank_t *b, int16_t **direct, const float *scale, const int count) {
+    const int stride = b->stride;
+    const int npairs = (b->taps + 1) / 2;
+    const __m128i zero = _mm_setzero_si128();
+    const pixel_t *row = in + (size_t) y * stride;
+    __m128i lo[REPICT_BANK_MAX], hi[REPICT_BANK_MAX];
+    int s = s0;
+    for (; s + 8 <= s1; s += 8) {
+        for (int k = 0; k < count; k++) {
+            lo[k] = hi[k] = zero;
+        }
+        for (int p = 0; p < npairs; p++) {
+            const int t = 2 * p;
+            const __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + s + b->off[t])), zero);
+            __m128i vb = zero;
+            if (t + 1 < b->taps) {
+                vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (row + s + b->off[t + 1])), zero);
+            }
+            const __m128i ab_lo = _mm_unpacklo_epi16(va, vb), ab_hi = _mm_unpackhi_epi16(va, vb);
+            for (int k = 0; k < count; k++) {
+                const __m128i c = _mm_set1_epi32(b->pairs[k * npairs + p]);
+                lo[k] = _mm_add_epi32(lo[k], _mm_madd_epi16(ab_lo, c));
+                hi[k] = _mm_add_epi32(hi[k], _mm_madd_epi16(ab_hi, c));
+            }
+        }
+        for (int k = 0; k < count; k++) {
+            if (direct == NULL) {
+                _mm_storeu_ps(acc + k * stride + s, _mm_cvtepi32_ps(lo[k]));
+                _mm_storeu_ps(acc + k * stride + s + 4, _mm_cvtepi32_ps(hi[k]));
+            }
+            else if (direct[k] == NULL) {
+                continue;
+            }
+            else if (scale[k] == 1.0f) { // packs saturates just like m_sat16
+                _mm_storeu_si128((__m128i *) (direct[k] + (size_t) y * stride + s), _mm_packs_epi32(lo[k], hi[k]));
+            }
+            else {
+                const __m128 sk = _mm_set1_ps(scale[k]);
+                m_sat16_x8(_mm_mul_ps(_mm_cvtepi32_ps(lo[k]), sk), _mm_mul_ps(_mm_cvtepi32_ps(hi[k]), sk),
+                        direct[k] + (size_t) y * stride + s);
+            }
+        }
+    }
+    return s;
+}
+
+/* m_bank_row_sse2_n with the common bank sizes compiled separately, so accumulators stay in registers */
+static int m_bank_row_sse2(const pixel_t *in, float *acc, int32_t y, int s0, int s1, const m_bank_t *b,
+        int16_t **direct, const float *scale) {
+    switch (b->count) {
+        case 1: return m_bank_row_sse2_n(in, acc, y, s0, s1, b, direct, scale, 1);
+        case 2: return m_bank_row_sse2_n(in, acc, y, s0, s1, b, direct, scale, 2);
+        case 4: return m_bank_row_sse2_n(in, acc, y, s0, s1, b, direct, scale, 4);
+        default: return m_bank_row_sse2_n(in, acc, y, s0, s1, b, direct, scale, b->count);
+    }
+}
+#endif
+
+/* Float taps for samples [s0, s1) of row y into acc rows, scalar */
+static void m_bank_row_float(const pixel_t *in, float *acc, int32_t y, int s0, int s1, const m_bank_t *b) {
+    const int stride = b->stride;
+    for (int s = s0; s < s1; s++) {
+        const int32_t x = s / b->channels;
+        for (int k = 0; k < b->count; k++) {
+            const kernel_t *coef = b->fcoef + k * b->taps;
+            float sum = 0;
+            for (int t = 0; t < b->taps; t++) {
+                sum += m_bank_tap(in, b, t, x, y, s) * coef[t];
+            }
+            acc[k * stride + s] = sum;
+        }
+    }
+}
+
+/* Write samples [s0, s1) of one row of responses (acc, one row per kernel) to the bank's outputs
+    as its fuse mode says */
+static void m_bank_finish_row(const float *acc, int32_t y, int s0, int s1, const m_bank_t *b) {
+    const int stride = b->stride, count = b->count;
+    const float *scale = b->scale;
+    int16_t **outputs = b->outputs;
+    const int fuse = b->fuse;
+    const size_t base = (size_t) y * stride;
+    switch (fuse) {
+        case REPICT_FUSE_GRADIENT: {
+        const float *ax = acc, *ay = acc + stride;
+        int16_t *mag = outputs[0], *dir = outputs[1];
+        int s = s0;
+#ifdef REPICT_SSE2
+        if (mag != NULL) {
+            const __m128 sx = _mm_set1_ps(scale[0]), sy = _mm_set1_ps(scale[1]);
+            for (; s + 8 <= s1; s += 8) {
+                const __m128 x0 = _mm_mul_ps(_mm_loadu_ps(ax + s), sx), x1 = _mm_mul_ps(_mm_loadu_ps(ax + s + 4), sx);
+                const __m128 y0 = _mm_mul_ps(_mm_loadu_ps(ay + s), sy), y1 = _mm_mul_ps(_mm_loadu_ps(ay + s + 4), sy);
+                m_sat16_x8(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x0, x0), _mm_mul_ps(y0, y0))),
+                        _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x1, x1), _mm_mul_ps(y1, y1))), mag + base + s);
+            }
+        }
+#endif
+        for (; mag != NULL && s < s1; s++) {
+            const float gx = ax[s] * scale[0], gy = ay[s] * scale[1];
+            mag[base + s] = m_sat16(sqrtf(gx * gx + gy * gy));
+        }
+        for (s = s0; dir != NULL && s < s1; s++) {
+            dir[base + s] = (int16_t) lrintf(atan2f(ay[s] * scale[1], ax[s] * scale[0])
+                    * (float) (180.0 / M_PI) * REPICT_ANGLE_SCALE);
+        }
+        }
+        break;
+
+        case REPICT_FUSE_MAX:
+        for (int s = s0; s < s1; s++) {
+            float best = -1;
+            int16_t which = 0;
+            for (int k = 0; k < count; k++) {
+                const float v = fabsf(acc[k * stride + s] * scale[k]);
+                if (v > best) {
+                    best = v;
+                    which = (int16_t) k;
+                }
+            }
+            if (outputs[0] != NULL) {
+                outputs[0][base + s] = m_sat16(best);
+            }
+            if (outputs[1] != NULL) {
+                outputs[1][base + s] = which;
+            }
+        }
+        break;
+
+        default:
+        for (int k = 0; k < count; k++) {
+            if (outputs[k] == NULL) {
+                continue;
+            }
+            const float *a = acc + k * stride;
+            int16_t *out = outputs[k] + base;
+            int s = s0;
+#ifdef REPICT_SSE2
+            const __m128 sk = _mm_set1_ps(scale[k]);
+            for (; s + 8 <= s1; s += 8) {
+                m_sat16_x8(_mm_mul_ps(_mm_loadu_ps(a + s), sk), _mm_mul_ps(_mm_loadu_ps(a + s + 4), sk), out + s);
+            }
+#endif
+            for (; s < s1; s++) {
+                out[s] = m_sat16(a[s] * scale[k]);
+            }
+        }
+    }
+}
+
+/* Output pixels [x0, x1) x [y0, y1) of a kernel bank */
+static void m_bank_tile(void *arg, int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    const m_bank_t *b = (const m_bank_t *) arg;
+    const int khl = b->khl, c = b->channels;
+    const int t0 = x0 * c, t1 = x1 * c;
+    // one row of responses per kernel, indexed by sample like the image rows
+    float *acc = (float *) malloc(sizeof(float) * b->stride * b->count);
+    if (acc == NULL) {
+        error("convolution allocation failure");
+        return;
+    }
+
+    for (int32_t y = y0; y < y1; y++) {
+        if (! b->integer) {
+            m_bank_row_float(b->in, acc, y, t0, t1, b);
+            m_bank_finish_row(acc, y, t0, t1, b);
+            continue;
+        }
+        int s = t0;
+#ifdef REPICT_SSE2
+        // samples whose taps all land inside the image; plain responses skip acc
+        const int s0 = t0 > khl * c ? t0 : khl * c;
+        const int s1 = t1 < (b->width - khl) * c ? t1 : (b->width - khl) * c;
+        if (y >= khl && y < b->height - khl && s0 < s1) {
+            int16_t **direct = b->fuse == REPICT_FUSE_NONE ? b->outputs : NULL;
+            m_bank_row_int(b->in, acc, y, t0, s0, b);
+            m_bank_finish_row(acc, y, t0, s0, b);
+            s = m_bank_row_sse2(b->in, acc, y, s0, s1, b, direct, b->scale);
+            if (direct == NULL) {
+                m_bank_finish_row(acc, y, s0, s, b);
+            }
+        }
+#endif
+        m_bank_row_int(b->in, acc, y, s, t1, b);
+        m_bank_finish_row(acc, y, s, t1, b);
+    }
+    free(acc);
+}
+
+/* Convolve the working image with count kernels of width kn in one pass (see repict_convolve_bank),
+    response k multiplied by scale[k] before it is written */
+static int m_convolve_bank(const kernel_t *const *kernels, int kn, int count, const float *scale,
+        int16_t **outputs, int fuse) {
+    const int khl = kn / 2;
+    const int stride = r_width * r_channels;
+    const int cells = kn * kn;
+    m_bank_t b;
+    b.count = count;
+    b.tx = (int *) malloc(sizeof(int) * cells * 3);
+    b.fcoef = (kernel_t *) malloc(sizeof(kernel_t) * cells * count);
+    b.icoef = (int16_t *) malloc(sizeof(int16_t) * cells * count);
+    b.pairs = (int32_t *) malloc(sizeof(int32_t) * (cells + 1) / 2 * count);
+    if (b.tx == NULL || b.fcoef == NULL || b.icoef == NULL || b.pairs == NULL) {
+        free(b.tx);
+        free(b.fcoef);
+        free(b.icoef);
+        free(b.pairs);
+        error("convolution allocation failure");
+        return -1;
+    }
+    b.ty = b.tx + cells;
+    b.off = b.ty + cells;
+
+    // positions where any kernel has a non-zero tap, as offsets from the output pixel
+    int pos[KERNEL_MAX * KERNEL_MAX];
+    b.taps = 0;
+    for (int i = 0; i < cells; i++) {
+        for (int k = 0; k < count; k++) {
+            if (kernels[k][i] != 0) {
+                pos[b.taps++] = i;
+                break;
+            }
+        }
+    }
+    b.integer = true;
+    for (int k = 0; k < count; k++) {
+        float abs_sum = 0;
+        for (int t = 0; t < b.taps; t++) {
+            const kernel_t v = kernels[k][pos[t]];
+            b.fcoef[k * b.taps + t] = v;
+            b.icoef[k * b.taps + t] = (int16_t) v;
+            b.integer = b.integer && v == (kernel_t) b.icoef[k * b.taps + t] && v == floorf(v);
+            abs_sum += fabsf(v);
+        }
+        // whole number taps are exact in 32 bits as long as the largest possible sum fits
+        b.integer = b.integer && abs_sum * PIXEL_MAX < (float) INT32_MAX;
+    }
+    for (int t = 0; t < b.taps; t++) {
+        const int i = pos[t] / kn - khl, j = pos[t] % kn - khl;
+        b.tx[t] = i;
+        b.ty[t] = j;
+        b.off[t] = -j * stride - i * (int) r_channels;
+    }
+    const int npairs = (b.taps + 1) / 2;
+    for (int k = 0; k < count; k++) {
+        for (int p = 0; p < npairs; p++) {
+            const int16_t ca = b.icoef[k * b.taps + 2 * p];
+            const int16_t cb = 2 * p + 1 < b.taps ? b.icoef[k * b.taps + 2 * p + 1] : 0;
+            b.pairs[k * npairs + p] = (int32_t) (((uint32_t) (uint16_t) cb << 16) | (uint16_t) ca);
+        }
+    }
+
+    b.in = working_img;
+    b.width = r_width;
+    b.height = r_height;
+    b.channels = r_channels;
+    b.stride = stride;
+    b.khl = khl;
+    b.edge_mode = r_edge_mode;
+    b.fill = m_edge_constant();
+    b.scale = scale;
+    b.outputs = outputs;
+    b.fuse = fuse;
+    m_run_tiled(r_width, r_height, m_bank_tile, &b);
+
+    free(b.tx);
+    free(b.fcoef);
+    free(b.icoef);
+    free(b.pairs);
     return 1;
 }
 
+/**
+ * Convolve the working image into out (width * height * channels int16, same layout),
+ * each channel on its own, without clamping to 0-255.  The kernel is applied in the same
+ * orientation as repict_convolve and border taps read as the edge mode says (TRASH reads
+ * 0 here, the border is still computed).  The response
+ * is divided as norm says (REPICT_NORM_*), multiplied by scale and saturated to int16.
+ * Kernels with whole number taps (Sobel, Laplacian, binomial...) are summed exactly in
+ * 32 bit integers, with SSE2 where available; others in float.  The working image is
+ * left as it is.
+*/
+int repict_convolve_s16(const kernel_t *ker, int kn, int16_t *out, int norm, float scale) {
+    if (working_img == NULL) {
+        error("image not initialized");
+        return -1;
+    }
+    if (ker == NULL || out == NULL) {
+        error("no kernel or output for convolution");
+        return -1;
+    }
+    if (kn < 1 || kn > KERNEL_MAX || kn % 2 == 0) {
+        error("kernel width must be odd");
+        return -1;
+    }
+    float sum = 0, abs_sum = 0;
+    for (int i = 0; i < kn * kn; i++) {
+        sum += ker[i];
+        abs_sum += fabsf(ker[i]);
+    }
+    if (norm == REPICT_NORM_SUM && sum != 0) {
+        scale /= sum;
+    }
+    else if (norm == REPICT_NORM_ABS && abs_sum != 0) {
+        scale /= abs_sum;
+    }
+
+    REPICT_TRACE("convolve s16", true);
+    const int status = m_convolve_bank(&ker, kn, 1, &scale, &out, REPICT_FUSE_NONE);
+    REPICT_TRACE("convolve s16", false);
+    return status;
+}
+
+/**
+ * Convolve the working image with 'count' kernels (each kn * kn, at most REPICT_BANK_MAX)
+ * in a single pass: every neighbourhood is read once and all responses are computed from
+ * it, as repict_convolve_s16 would (no normalization, scale 1).  fuse chooses the outputs:
+ *   REPICT_FUSE_NONE      outputs[k] = response of kernels[k]
+ *   REPICT_FUSE_GRADIENT  kernels are the x and y derivative (count 2): outputs[0] = magnitude,
+ *                         outputs[1] = orientation atan2(gy, gx) in degrees * REPICT_ANGLE_SCALE
+ *   REPICT_FUSE_MAX       outputs[0] = largest |response|, outputs[1] = index of its kernel
+ * Outputs are width * height * channels int16; any of them may be NULL to skip it (the
+ * fused modes always read two output pointers).
+*/
+int repict_convolve_bank(const kernel_t *const *kernels, int kn, int count, int16_t **outputs, int fuse) {
+    if (working_img == NULL) {
+        error("image not initialized");
+        return -1;
+    }
+    if (kernels == NULL || outputs == NULL || count < 1 || count > REPICT_BANK_MAX) {
+        error("kernel bank needs 1 to REPICT_BANK_MAX kernels and outputs");
+        return -1;
+    }
+    if (fuse == REPICT_FUSE_GRADIENT && count != 2) {
+        error("gradient needs exactly an x and a y kernel");
+        return -1;
+    }
+    if (kn < 1 || kn > KERNEL_MAX || kn % 2 == 0) {
+        error("kernel width must be odd");
+        return -1;
+    }
+    float scale[REPICT_BANK_MAX];
+    for (int k = 0; k < count; k++) {
+        if (kernels[k] == NULL) {
+            error("no kernel for convolution");
+            return -1;
+        }
+        scale[k] = 1.0f;
+    }
+
+    REPICT_TRACE("convolve bank", true);
+    const int status = m_convolve_bank(kernels, kn, count, scale, outputs, fuse);
+    REPICT_TRACE("convolve bank", false);
+    return status;
+}
+
 
 /* keep: all channels vs 1 channel.  sig = gaussian values and radius, n = convolutions */
 int repict_gaussian_filter(float sig, int n, bool keep) {
@@ -395,6 +1481,7 @@ int repict_gaussian_filter(float sig, int n, bool keep) {
         return -1;
     }
 
+    REPICT_TRACE("gaussian", true);
     if (! keep) {
         repict_bw(false);
     }
@@ -406,33 +1493,29 @@ int repict_gaussian_filter(float sig, int n, bool keep) {
     else
         sigma = sig;
 
-    const int kw = (2 * (int)(2 * sigma)) + 3; // kernel dimension appropriate for value of sigma
-    kernel_t *gauss_ker = m_generate_kernel_space(kw);
-
-    const float sig2 = sigma * sigma;
-    const float mean = (float) floor(kw / 2.0) + 1;
-
-    // generate kernel values for gaussian filter, function of sigma
-    size_t c = 0;
-    for (unsigned int i = 1; i <= kw; i++) {
-        for (unsigned int j = 1; j <= kw; j++) {
-            gauss_ker[c] = (kernel_t) gaussian(i - mean, j - mean, sig2) / (2 * M_PI * sig2);
-            c++;
-        }
+    // kernel for this sigma, built on first use and cached
+    const repict_gauss_t *g = m_gauss_acquire(sigma);
+    if (g == NULL) {
+        m_release_image(new_img, (size_t) r_width * r_height * r_channels);
+        REPICT_TRACE("gaussian", false);
+        return -1;
     }
 
-    // convolution performed n times
-    m_convolve_kernel(working_img, new_img, gauss_ker, kw);
-    pixel_t *temp_img;
+    // convolution performed n times, alternating between two buffers
+    m_convolve_kernel(working_img, new_img, g->k2d, g->kw);
     if (n > 1) {
-        temp_img = repict_alloc_image(r_width, r_height, r_channels);
-    }
-    for (unsigned int i = 1; i < n; i++) {
-        printf("convolution #%d\n", i+1);
-        m_convolve_kernel(new_img, temp_img, gauss_ker, kw);
-        new_img = temp_img;
+        pixel_t *temp_img = repict_alloc_image(r_width, r_height, r_channels);
+        for (unsigned int i = 1; i < n; i++) {
+            m_convolve_kernel(new_img, temp_img, g->k2d, g->kw);
+            pixel_t *t = new_img;
+            new_img = temp_img;
+            temp_img = t;
+        }
+        m_release_image(temp_img, (size_t) r_width * r_height * r_channels);
     }
+    m_gauss_release(g);
     m_swap_working(new_img);
+    REPICT_TRACE("gaussian", false);
     return 1;
 }
 
@@ -443,26 +1526,196 @@ int repict_average_filter(float width, int n, bool keep) {
         error("image not initialized");
         return -1;
     }
+    REPICT_TRACE("average", true);
     if (! keep) {
         repict_bw(false);
     }
-    pixel_t *new_img = repict_alloc_image(r_width, r_height, r_channels);
     kernel_t *avg_ker = m_generate_kernel_space(width);
+    if (avg_ker == NULL) {
+        REPICT_TRACE("average", false);
+        return -1;
+    }
+    pixel_t *new_img = repict_alloc_image(r_width, r_height, r_channels);
 
     // generate kernel values for average filter
     size_t c = 0;
     for (unsigned int i = 1; i <= width; i++) {
         for (unsigned int j = 1; j <= width; j++) {
             avg_ker[c] = (kernel_t) 1;
+            c++;
         }
     }
-    for (unsigned int i = 0; i < n; i++) {
-        m_convolve_kernel(working_img, new_img, avg_ker, width);
+
+    // convolution performed n times, alternating between two buffers
+    m_convolve_kernel(working_img, new_img, avg_ker, width);
+    if (n > 1) {
+        pixel_t *temp_img = repict_alloc_image(r_width, r_height, r_channels);
+        for (unsigned int i = 1; i < n; i++) {
+            m_convolve_kernel(new_img, temp_img, avg_ker, width);
+            pixel_t *t = new_img;
+            new_img = temp_img;
+            temp_img = t;
+        }
+        m_release_image(temp_img, (size_t) r_width * r_height * r_channels);
     }
+    free(avg_ker);
     m_swap_working(new_img);
     if (! keep) {
         r_channels = 1;
     }
+    REPICT_TRACE("average", false);
+    return 1;
+}
+
+
+// ======== Regions of interest ========
+// The _roi filters work on a rectangle of the working image in place and leave the rest
+// of it untouched: only the rectangle is computed, reading just the kernel's halo around
+// it.  They keep the image's channels (a gray rectangle in a color image stays RGB).  A
+// borrowed source is copied before the first of them writes to it.
+
+/**
+ * Convolve the w x h rectangle at (x, y) of the working image n times in place.  Each pass
+ * goes to a rectangle sized buffer, reading the halo from the image around it, and is
+ * copied back, so pass k + 1 sees pass k inside the rectangle and the original pixels
+ * outside.  The rectangle is clipped to the image.
+*/
+static int m_convolve_roi(const kernel_t *ker, int kn, int n, int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (! m_clip_rect(&x, &y, &w, &h, r_width, r_height)) {
+        return 1; // nothing of it on the image
+    }
+    if (m_writable_working() == NULL) {
+        return -1;
+    }
+    const repict_view_t img = repict_working_view();
+    const size_t row = (size_t) w * r_channels;
+    pixel_t *buf = repict_alloc_image(w, h, r_channels);
+    if (buf == NULL) {
+        return -1;
+    }
+    const repict_view_t out = repict_view(buf, w, h, 0, r_channels);
+    for (int i = 0; i < (n > 1 ? n : 1); i++) {
+        m_convolve_view(img, x, y, out, ker, kn);
+        for (int32_t r = 0; r < h; r++) {
+            memcpy(img.data + (size_t) (y + r) * img.stride + (size_t) x * r_channels, buf + r * row, row);
+        }
+    }
+    m_release_image(buf, row * h);
+    return 1;
+}
+
+/**
+ * Convolve the dst.width x dst.height rectangle at (x, y) of src into dst, the halo read
+ * from src around it (edge mode past src's borders).  Both may be strided views into
+ * larger images; dst mustn't overlap the rectangle or its halo.  Independent of the working
+ * image, uses this thread's edge mode
+*/
+int repict_convolve_view(repict_view_t src, int32_t x, int32_t y, repict_view_t dst, const kernel_t *ker, int kn) {
+    if (src.data == NULL || dst.data == NULL || ker == NULL) {
+        error("no image or kernel for convolution");
+        return -1;
+    }
+    if (src.channels != dst.channels || src.channels < 1 || src.channels > 4) {
+        error("source and destination views need the same channels (1-4)");
+        return -1;
+    }
+    if (x < 0 || y < 0 || x + dst.width > src.width || y + dst.height > src.height) {
+        error("rectangle must lie inside the source view");
+        return -1;
+    }
+    if (kn < 1 || kn > KERNEL_MAX || kn % 2 == 0) {
+        error("kernel width must be odd");
+        return -1;
+    }
+    if (dst.width < 1 || dst.height < 1) {
+        return 1;
+    }
+    m_convolve_view(src, x, y, dst, ker, kn);
+    return 1;
+}
+
+/* Convolve only the w x h rectangle at (x, y) of the working image with ker (kn x kn) */
+int repict_convolve_roi(const kernel_t *ker, int kn, int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (working_img == NULL) {
+        error("image not initialized");
+        return -1;
+    }
+    if (ker == NULL || kn < 1 || kn > KERNEL_MAX || kn % 2 == 0) {
+        error("kernel width must be odd");
+        return -1;
+    }
+    REPICT_TRACE("convolve roi", true);
+    const int status = m_convolve_roi(ker, kn, 1, x, y, w, h);
+    REPICT_TRACE("convolve roi", false);
+    return status;
+}
+
+/* Gaussian blur of only the w x h rectangle at (x, y) of the working image, n times */
+int repict_gaussian_filter_roi(float sig, int n, int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (working_img == NULL) {
+        error("image not initialized");
+        return -1;
+    }
+    REPICT_TRACE("gaussian roi", true);
+    const repict_gauss_t *g = m_gauss_acquire(sig < 0 ? GAUSS_SIG_DEFAULT : sig);
+    if (g == NULL) {
+        REPICT_TRACE("gaussian roi", false);
+        return -1;
+    }
+    const int status = m_convolve_roi(g->k2d, g->kw, n, x, y, w, h);
+    m_gauss_release(g);
+    REPICT_TRACE("gaussian roi", false);
+    return status;
+}
+
+/* Average blur (width x width) of only the w x h rectangle at (x, y) of the working image, n times */
+int repict_average_filter_roi(float width, int n, int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (working_img == NULL) {
+        error("image not initialized");
+        return -1;
+    }
+    kernel_t *avg_ker = m_generate_kernel_space(width);
+    if (avg_ker == NULL) {
+        return -1;
+    }
+    REPICT_TRACE("average roi", true);
+    for (int i = 0; i < (int) width * (int) width; i++) {
+        avg_ker[i] = (kernel_t) 1;
+    }
+    const int status = m_convolve_roi(avg_ker, (int) width, n, x, y, w, h);
+    free(avg_ker);
+    REPICT_TRACE("average roi", false);
+    return status;
+}
+
+/* Gray the w x h rectangle at (x, y) of the working image (channel average in every channel) */
+int repict_bw_roi(int32_t x, int32_t y, int32_t w, int32_t h) {
+    if (working_img == NULL) {
+        error("image not initialized");
+        return -1;
+    }
+    if (r_channels == 1 || ! m_clip_rect(&x, &y, &w, &h, r_width, r_height)) {
+        return 1;
+    }
+    if (m_writable_working() == NULL) {
+        return -1;
+    }
+    REPICT_TRACE("bw roi", true);
+    const repict_view_t roi = repict_view_roi(repict_working_view(), x, y, w, h);
+    for (int32_t r = 0; r < roi.height; r++) {
+        pixel_t *p = roi.data + (size_t) r * roi.stride;
+        for (int32_t i = 0; i < roi.width; i++, p += r_channels) {
+            int32_t avg = 0;
+            for (unsigned int k = 0; k < r_channels; k++) {
+                avg += p[k];
+            }
+            avg /= r_channels;
+            for (unsigned int k = 0; k < r_channels; k++) {
+                p[k] = (pixel_t) avg;
+            }
+        }
+    }
+    REPICT_TRACE("bw roi", false);
     return 1;
 }
 
@@ -43,6 +43,10 @@ pixel_t *gauss_op(pixel_t *data, int argc, char **argv) {
     if (argc > 1) {
         n = atoi(argv[1]);
     }
+    if (roi_def) { // only the --roi rectangle, channels kept
+        repict_gaussian_filter_roi((float) atof(argv[0]), n, roi[0], roi[1], roi[2], roi[3]);
+        return repict_get_result();
+    }
     repict_gaussian_filter((float) atof(argv[0]), n, false); // false = convert to single channel
     return repict_get_result();
 }
@@ -53,12 +57,20 @@ pixel_t *average_op(pixel_t *data, int argc, char **argv) {
     if (argc > 1) {
         n = atoi(argv[1]);
     }
+    if (roi_def) {
+        repict_average_filter_roi(atoi(argv[0]), n, roi[0], roi[1], roi[2], roi[3]);
+        return repict_get_result();
+    }
     repict_average_filter(atoi(argv[0]), n, false); // false = convert to single channel
     return repict_get_result();
 }
 
 /* Apply B&W filter */
 pixel_t *bw_op(pixel_t *data, int argc, char **argv) {
+    if (roi_def) {
+        repict_bw_roi(roi[0], roi[1], roi[2], roi[3]);
+        return repict_get_result();
+    }
     repict_bw(false);
     return repict_get_result();
 }
@@ -68,9 +80,118 @@ pixel_t *canny_op(pixel_t *data, int argc, char **argv) {
     return data;
 }
 
-/* Apply custom kernal to image from input kernel.txt file */
+/* Apply custom kernel to image from input kernel file arg[0] (parsed once per file, see kernel_file.h) */
 pixel_t *custom_kernel_op(pixel_t *data, int argc, char **argv) {
+    const kernel_file_t *kf = kernel_file_load(argv[0]);
+    if (kf == NULL) {
+        return repict_get_result();
+    }
+    if (verbose) {
+        printf("Kernel: %dx%d, %d of %d taps non-zero, %sseparable\n", kf->kn, kf->kn,
+                kf->nonzero, kf->kn * kf->kn, kf->separable ? "" : "not ");
+    }
+    if (roi_def) { // the rest of the image keeps its channels, so no magnitude image: negative responses clamp to 0
+        repict_convolve_roi(kf->k, kf->kn, roi[0], roi[1], roi[2], roi[3]);
+        kernel_file_release(kf);
+        return repict_get_result();
+    }
+    repict_bw(false); // convolution works on a single channel
+    if (kf->sum != 0) {
+        repict_convolve(kf->k, kf->kn);
+        kernel_file_release(kf);
+        return repict_get_result();
+    }
+
+    // derivative kernel (sums to 0): signed response, written as its magnitude
+    const size_t n = (size_t) repict_get_working_width() * repict_get_working_height();
+    int16_t *response = (int16_t *) malloc(sizeof(int16_t) * n);
+    pixel_t *mag = repict_get_result();
+    if (response != NULL && repict_convolve_s16(kf->k, kf->kn, response, REPICT_NORM_NONE, 1.0f) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const int v = abs(response[i]);
+            mag[i] = (pixel_t) (v > PIXEL_MAX ? PIXEL_MAX : v);
+        }
+    }
+    free(response);
+    kernel_file_release(kf);
+    return mag;
+}
+
+/**
+ * Edge strength of the gray image through one kernel bank pass (repict_convolve_bank):
+ *   sobel    Sobel x and y fused into the gradient magnitude (default)
+ *   angle    their orientation, -180..180 degrees spread over 0-255
+ *   lines    strongest of the 4 line detectors (horizontal, vertical, both diagonals)
+ *   compass  strongest of the 8 Kirsch compass kernels
+ * Responses above 255 are written as 255.
+*/
+pixel_t *gradient_op(pixel_t *data, int argc, char **argv) {
+    static const kernel_t sobel[2][9] = {   // d/dx, d/dy in the library's orientation (a kernel row runs down x)
+        {1, 2, 1, 0, 0, 0, -1, -2, -1},
+        {1, 0, -1, 2, 0, -2, 1, 0, -1}
+    };
+    static const kernel_t lines[4][9] = {
+        {-1, -1, -1, 2, 2, 2, -1, -1, -1},
+        {-1, 2, -1, -1, 2, -1, -1, 2, -1},
+        {-1, -1, 2, -1, 2, -1, 2, -1, -1},
+        {2, -1, -1, -1, 2, -1, -1, -1, 2}
+    };
+    static const int ring[8] = {0, 1, 2, 5, 8, 7, 6, 3};    // the 3x3 border, clockwise from the top left
+    kernel_t kirsch[8][9];
+    const kernel_t *bank[REPICT_BANK_MAX];
+    const char *mode = argc > 0 ? argv[0] : "sobel";
+    int count = 2, fuse = REPICT_FUSE_GRADIENT;
+
+    if (strcmp(mode, "sobel") == 0 || strcmp(mode, "angle") == 0) {
+        bank[0] = sobel[0];
+        bank[1] = sobel[1];
+    }
+    else if (strcmp(mode, "lines") == 0) {
+        count = 4;
+        fuse = REPICT_FUSE_MAX;
+        for (int k = 0; k < count; k++) {
+            bank[k] = lines[k];
+        }
+    }
+    else if (strcmp(mode, "compass") == 0) {
+        count = 8;
+        fuse = REPICT_FUSE_MAX;
+        for (int k = 0; k < count; k++) { // each kernel is the one before turned by 45 degrees
+            kirsch[k][4] = 0;
+            for (int p = 0; p < 8; p++) {
+                kirsch[k][ring[p]] = ((p - k + 8) % 8) < 3 ? 5 : -3;
+            }
+            bank[k] = kirsch[k];
+        }
+    }
+    else {
+        printf("repict: gradient takes sobel, angle, lines or compass\n");
+        return repict_get_result();
+    }
+    if (roi_def) {
+        printf("repict: gradient runs on the whole image, --roi ignored\n");
+    }
 
+    repict_bw(false); // the bank works on a single channel
+    const size_t n = (size_t) repict_get_working_width() * repict_get_working_height();
+    int16_t *strength = (int16_t *) malloc(sizeof(int16_t) * n);
+    int16_t *angle = (int16_t *) malloc(sizeof(int16_t) * n);
+    pixel_t *out = repict_get_result();
+    const bool want_angle = strcmp(mode, "angle") == 0;
+    int16_t *outputs[2] = { want_angle ? NULL : strength, want_angle ? angle : NULL };
+    if (strength != NULL && angle != NULL && repict_convolve_bank(bank, 3, count, outputs, fuse) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (want_angle) { // 1/100 degree, -18000..18000
+                out[i] = (pixel_t) ((angle[i] + 18000) * PIXEL_MAX / 36000);
+            }
+            else {
+                out[i] = (pixel_t) (strength[i] > PIXEL_MAX ? PIXEL_MAX : strength[i]);
+            }
+        }
+    }
+    free(strength);
+    free(angle);
+    return out;
 }
 
 // =======================================================
@@ -86,9 +207,24 @@ void print_help() {
         printf(":  \t");
         print_usage_f(functions[i], true);
     }
-    printf("\nUse -o <out.png> to set custom output file (use supported extensions)\n");
+    printf("\nRepeat -f to chain functions on one image, e.g. -f bw -f gauss 1.4\n");
+    printf("Use -o <out.png> to set custom output file (use supported extensions)\n");
+    printf("Use - as the input or -o - to read stdin / write stdout, --in-format / --out-format <ext> to name the format\n");
     printf("Use -v to turn on verbose feedback\n");
-    printf("Use -n to set number of times function applied\n\n");
+    printf("Use -n to set number of times function applied\n");
+    printf("Use --png-level <0-9> to trade PNG size for speed (default %d, 0 = uncompressed)\n", PNG_LEVEL_DEFAULT);
+    printf("Use --png-fast to skip per-row PNG filter selection\n");
+    printf("Use --jpeg-quality <1-100> to set JPEG quality (default %d)\n", JPEG_QUALITY_DEFAULT);
+    printf("Use --edge <zero|trash|clamp|mirror|wrap|constant N> to choose how filters treat image borders\n");
+    printf("Use --roi <x> <y> <w> <h> to filter only that rectangle and leave the rest of the image as it is\n");
+    printf("Use --cache <dir> to keep results and skip jobs already done on the same input, --cache-max <MB> to bound it (default %d)\n",
+            (int) (RESULT_CACHE_MAX_DEFAULT >> 20));
+    printf("Use --perf-counters to print IPC, cache and branch misses per pixel for each stage (Linux)\n");
+    printf("Use -t <trace.json> to record a per-stage timeline (open in chrome://tracing or Perfetto)\n");
+    printf("Use 'repict serve <socket | ->' to run jobs (one command line each) without restarting\n");
+    printf("Use 'repict bench [-n runs] [-s WxH ...]' to time every function and format\n");
+    printf("    add --save <file> to record, --baseline <file> [--max-drop pct] to check output and speed\n");
+    printf("Use 'repict compare <a> <b> [min psnr]' to diff two images (exact unless a PSNR is given, exit 0 if they match)\n\n");
     printf("Supported extensions:\n");
     for (unsigned int i = 0; i < MAX_FORMATS; i++) {
         if (formats[i].format == NONE) {
@@ -107,13 +243,16 @@ FORMAT match_file_format(char *file) {
         return NONE;
     }
 
-    char *ext = strchr(file, (int) '.');
+    char *ext = strrchr(file, (int) '.');
     if (ext == NULL) {
         printf("repict: enter a valid pathname to image\n");
         return NONE;
     }
-    ext++;
+    return match_format_ext(ext + 1);
+}
 
+/* Get file format from an extension (png, bmp, ...), NONE if not supported */
+FORMAT match_format_ext(const char *ext) {
     for (unsigned int i = 0; i < MAX_FORMATS; i++) {
         if (strcmp(ext, formats[i].ext) == 0) {
             file_type = formats[i].ext;
@@ -137,7 +276,7 @@ function_t *match_function(char *in) {
     return NULL;
 }
 
-/* Handle -f function select and args, call function */
+/* Handle -f function select and args, append to ops */
 bool handle_function(const int argc, char **argv) {
     char *func_name = argv[0];
     function_t *func = match_function(func_name);
@@ -146,29 +285,38 @@ bool handle_function(const int argc, char **argv) {
         return false;
     }
     function = *func;
+    if (op_count >= MAX_OPS) {
+        printf("repict: too many functions, at most %d can be chained\n", MAX_OPS);
+        return false;
+    }
     if (argc - 1 >= func->arg_min) {
+        op_t *op = &ops[op_count];
         int a = 1;
-        f_argc = 0;
-        f_argv = malloc(func->arg_max * sizeof(char *));
+        op->func = *func;
+        op->argc = 0;
+        op->argv = malloc((func->arg_max + 1) * sizeof(char *));
 
         // accumulate args: within bounds, within max, not the next flag
         while (a < argc && a - 1 < func->arg_max && argv[a][0] != '-') {
-            f_argv[a - 1] = argv[a];
+            op->argv[a - 1] = argv[a];
             a++;
         }
-        f_argc = a - 1;
+        op->argc = a - 1;
 
-        if (f_argc < func->arg_min) {
+        if (op->argc < func->arg_min) {
             printf("repict: too few arguments given to specified function\n");
             usage_req = true;
+            free(op->argv);
             return false;
         }
-        else if (f_argc > func->arg_max) {
+        else if (op->argc > func->arg_max) {
             printf("repict: too many arguments given to specified function\n");
             usage_req = true;
+            free(op->argv);
             return false;
         }
 
+        op_count++;
         function_def = true;
         return true;
 
@@ -178,35 +326,462 @@ bool handle_function(const int argc, char **argv) {
     return false;
 }
 
-/* Open file to pixels for use, return false on failure */
-bool open_file(char *file, FORMAT format) {
+/* Run every op in order on the library's working image, return the result
+    each op picks up the working image and channels the previous one left */
+pixel_t *run_ops(pixel_t *data) {
+    pixel_t *result = data;
+    for (int k = 0; k < op_count; k++) {
+        print_verbose("Function:", ops[k].func.name);
+        trace_span(ops[k].func.name, true);
+        perf_begin();
+        result = ops[k].func.exec(result, ops[k].argc, ops[k].argv);
+        perf_end(ops[k].func.name, (double) width * height);
+        trace_span(ops[k].func.name, false);
+    }
+    return result;
+}
+
+/* Free op args */
+void free_ops(void) {
+    for (int k = 0; k < op_count; k++) {
+        free(ops[k].argv);
+    }
+    op_count = 0;
+}
+
+/* Channels to decode input to for the op chain: 1 when it only needs luminance */
+int ops_channels(void) {
+    return (op_count > 0 && ops[0].func.luma && ! roi_def) ? 1 : CHANNELS; // --roi keeps color outside the rectangle
+}
+
+/* Collapse decoded pixels to one channel in place, the same average repict_bw takes of RGB */
+static void gray_in_place(image_t *img) {
+    const int c = img->channels;
+    const size_t n = (size_t) img->width * img->height;
+    pixel_t *p = img->pixels;
+    for (size_t i = 0; i < n; i++) {
+        const pixel_t *s = p + i * c;
+        p[i] = c >= 3 ? (pixel_t) ((s[0] + s[1] + s[2]) / 3) : s[0]; // gray (+ alpha) is already the value
+    }
+    img->channels = 1;
+}
+
+// ======== Streams (- for input or output) ========
+// A - input is read whole from stdin in large reads, then decoded from memory like a
+// mapped file (BMP/PGM/PPM pixels can be a view of the buffer).  A -o - output is
+// written straight to stdout by the same writev-based writers used for files, while
+// the run's own messages are moved to stderr so they can't corrupt the image.
+
+static bool is_stream(const char *path) {
+    return path != NULL && strcmp(path, STREAM_PATH) == 0;
+}
+
+/* Ask for a bigger pipe buffer so each read/write moves more per wakeup (no-op if fd isn't a pipe) */
+static void stream_pipe_size(int fd) {
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    fcntl(fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+#endif
+}
+
+/* Read fd to EOF into one malloc'd buffer, NULL on failure or empty input */
+static uint8_t *stream_read_all(int fd, size_t *len) {
+    size_t cap = STREAM_READ_CHUNK, n = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        cap = (size_t) st.st_size + 1; // redirected file: one read, plus one to see EOF
+    }
+    stream_pipe_size(fd);
+    uint8_t *buf = (uint8_t *) malloc(cap);
+    while (buf != NULL) {
+        if (n == cap) {
+            uint8_t *grown = (uint8_t *) realloc(buf, cap * 2);
+            if (grown == NULL) {
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        const ssize_t r = read(fd, buf + n, cap - n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            if (r == 0 && n > 0) {
+                *len = n;
+                return buf;
+            }
+            break;
+        }
+        n += (size_t) r;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Format of an image in memory from its first bytes, NONE if it isn't one of formats[] */
+static FORMAT stream_sniff(const uint8_t *buf, size_t len) {
+    if (len >= 8 && memcmp(buf, "\x89PNG\r\n\x1a\n", 8) == 0) {
+        return F_PNG;
+    }
+    if (len >= 2 && buf[0] == 'B' && buf[1] == 'M') {
+        return F_BMP;
+    }
+    if (len >= 2 && buf[0] == 'P' && (buf[1] == '5' || buf[1] == '6')) {
+        return buf[1] == '5' ? F_PGM : F_PPM;
+    }
+    if (len >= 4 && memcmp(buf, "qoif", 4) == 0) {
+        return F_QOI;
+    }
+    if (len >= 3 && buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff) {
+        return F_JPG;
+    }
+    return NONE;
+}
+
+/* Encode image data to an open descriptor in format */
+static bool encode_fd(int fd, FORMAT format, const pixel_t *data, int32_t w, int32_t h, int c) {
+    switch (format) {
+        case F_BMP:
+        return write_bmp_fd(fd, w, h, c, data);
+
+        case F_PNG:
+        return write_png_fd(fd, w, h, c, data, png_level, png_filter);
+
+        case F_PGM:
+        case F_PPM:
+        return write_pnm_fd(fd, w, h, c, data, format == F_PPM);
+
+        case F_QOI:
+        return write_qoi_fd(fd, w, h, c, data);
+
+        case F_JPG:
+        return write_jpeg_fd(fd, w, h, c, data, jpeg_quality);
+
+        default:
+        return false;
+    }
+}
+
+/* Decode image file into img with desired channels (1: gray as repict_bw averages it), false on failure */
+bool decode_image(char *file, FORMAT format, int desired, image_t *img) {
+    memset(img, 0, sizeof(image_t));
     if (file == NULL) {
         return false;
     }
-    pixels = stbi_load(file, &width, &height, &bpp, CHANNELS);
-    return true;
+    trace_span("decode", true);
+    if (is_stream(file)) {
+        img->stream = stream_read_all(0, &img->stream_len);
+        if (img->stream == NULL) {
+            printf("repict: nothing to read on stdin\n");
+            trace_span("decode", false);
+            return false;
+        }
+        if (format == NONE) {
+            format = stream_sniff(img->stream, img->stream_len);
+        }
+        if (format == NONE) {
+            printf("repict: can't tell the format of stdin, give --in-format\n");
+        }
+    }
+    img->format = format;
+    // gray: decode the file's own layout (no expansion of gray files to RGB), then average
+    // down in place rather than letting the decoders weight the channels their own way
+    const int request = desired == 1 ? 0 : desired;
+    if (format == F_BMP) { // native reader, no copy when the file layout already matches
+        const bool ok = img->stream != NULL
+                ? decode_bmp(img->stream, img->stream_len, &img->bmp, request, true)
+                : open_bmp(file, &img->bmp, request, true);
+        if (ok) {
+            img->pixels = img->bmp.pixels;
+            img->width = img->bmp.width;
+            img->height = img->bmp.height;
+            img->channels = img->bmp.channels;
+        }
+    }
+    else if (format == F_PGM || format == F_PPM) { // likewise, and the reader averages RGB to gray itself
+        const bool ok = img->stream != NULL
+                ? decode_pnm(img->stream, img->stream_len, &img->pnm, desired, true)
+                : open_pnm(file, &img->pnm, desired, true);
+        if (ok) {
+            img->pixels = img->pnm.pixels;
+            img->width = img->pnm.width;
+            img->height = img->pnm.height;
+            img->channels = img->pnm.channels;
+        }
+    }
+    else if (format == F_QOI) { // native, always decoded straight to the requested channels
+        img->pixels = img->stream != NULL
+                ? decode_qoi(img->stream, img->stream_len, &img->width, &img->height, &img->channels, desired)
+                : load_qoi(file, &img->width, &img->height, &img->channels, desired);
+    }
+    else if (format != NONE) {
+        int file_channels;
+        img->pixels = img->stream != NULL
+                ? stbi_load_from_memory(img->stream, (int) img->stream_len, &img->width, &img->height, &file_channels, request)
+                : stbi_load(file, &img->width, &img->height, &file_channels, request);
+        img->channels = request != 0 ? request : file_channels;
+    }
+    // keep the stdin bytes only while the pixels are a view of them
+    if (img->stream != NULL && (img->pixels < img->stream || img->pixels >= img->stream + img->stream_len)) {
+        free(img->stream);
+        img->stream = NULL;
+    }
+    if (img->pixels != NULL && desired == 1 && img->channels > 1) {
+        gray_in_place(img);
+    }
+    trace_span("decode", false);
+    return img->pixels != NULL;
 }
 
-/* Write pixels_out to file */
-bool write_file(char *file, FORMAT format) {
+/* Release pixels from decode_image */
+void free_image(image_t *img) {
+    if (img->stream != NULL) { // view of the stdin buffer
+        free(img->stream);
+        img->stream = NULL;
+    }
+    else if (img->format == F_BMP) {
+        close_bmp(&img->bmp);
+    }
+    else if (img->format == F_PGM || img->format == F_PPM) {
+        close_pnm(&img->pnm);
+    }
+    else if (img->format == F_QOI) {
+        free(img->pixels);
+    }
+    else {
+        stbi_image_free(img->pixels);
+    }
+    img->pixels = NULL;
+}
+
+/* Make img the library's source without copying it.  Heap pixels are adopted, so the
+    library frees them as soon as the first filter replaces them; views of a mapped file or
+    of the stdin buffer are borrowed and stay with img until free_image */
+static void source_image(image_t *img) {
+    if (img->stream != NULL || img->bmp.map != NULL || img->pnm.map != NULL) {
+        repict_set_source(img->pixels, img->width, img->height, img->channels, REPICT_SOURCE_BORROW);
+        return;
+    }
+    repict_free_fn dealloc = free;
+    if (img->format == F_BMP) {
+        img->bmp.pixels = NULL;
+    }
+    else if (img->format == F_PGM || img->format == F_PPM) {
+        img->pnm.pixels = NULL;
+    }
+    else if (img->format != F_QOI) {
+        dealloc = stbi_image_free;
+    }
+    repict_adopt_source(img->pixels, img->width, img->height, img->channels, dealloc);
+    img->pixels = NULL; // the library's now, free_image leaves it alone
+}
+
+/* Encode image data to file in format */
+bool encode_image(char *file, FORMAT format, const pixel_t *data, int32_t w, int32_t h, int c) {
     if (file == NULL) {
         return false;
     }
+    bool ok;
+    trace_span("encode", true);
+    if (is_stream(file)) {
+        ok = encode_fd(stream_out >= 0 ? stream_out : 1, format, data, w, h, c);
+        trace_span("encode", false);
+        return ok;
+    }
     switch (format) {
         case F_BMP:
-            stbi_write_bmp(file, width, height, channels_out, pixels_out);
+            ok = write_bmp(file, w, h, c, data, 0);
         break;
 
         case F_PNG:
-            stbi_write_png(file, width, height, channels_out, pixels_out, width*channels_out);
+            ok = write_png(file, w, h, c, data, png_level, png_filter);
+        break;
+
+        case F_PGM:
+            ok = write_pnm(file, w, h, c, data, false);
+        break;
+
+        case F_PPM:
+            ok = write_pnm(file, w, h, c, data, true);
+        break;
+
+        case F_QOI:
+            ok = write_qoi(file, w, h, c, data);
+        break;
+
+        case F_JPG:
+            ok = write_jpeg(file, w, h, c, data, jpeg_quality);
         break;
 
         default:
+        ok = false;
+    }
+    trace_span("encode", false);
+    return ok;
+}
+
+/* Open file to pixels for use, return false on failure */
+bool open_file(char *file, FORMAT format) {
+    perf_begin();
+    if (! decode_image(file, format, function_def ? ops_channels() : CHANNELS, &image_in)) {
+        perf_cancel(); // nothing decoded, nothing to charge
+        return false;
+    }
+    perf_end("decode", (double) image_in.width * image_in.height);
+    pixels = image_in.pixels;
+    width = image_in.width;
+    height = image_in.height;
+    bpp = image_in.channels;
+    return true;
+}
+
+/* Release input pixels from open_file */
+void close_file(FORMAT format) {
+    free_image(&image_in);
+    pixels = NULL;
+}
+
+/* Write pixels_out to file */
+bool write_file(char *file, FORMAT format) {
+    perf_begin();
+    const bool ok = encode_image(file, format, pixels_out, width, height, channels_out);
+    perf_end("encode", (double) width * height);
+    return ok;
+}
+
+// ======== Result cache (--cache) ========
+// A job's key is the XXH64 of a canonical text: the hash of the input file's bytes, the
+// output format with only the encoder settings that format uses, and the op chain with
+// numbers in one form (1.4 == 1.40) and kernel files replaced by the hash of their parsed
+// taps (an edited kernel is a new job).  Edge handling is only part of it when there are
+// ops.  Stdin input isn't keyed, it would have to be read whole before the lookup.
+
+/* Append printf text to the key, *n past size marks it truncated */
+static void cache_key_add(char *text, size_t *n, const char *fmt, ...) {
+    if (*n >= CACHE_KEY_TEXT) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    *n += (size_t) vsnprintf(text + *n, CACHE_KEY_TEXT - *n, fmt, args);
+    va_end(args);
+}
+
+/* Key of the job turning file into format with the current ops and flags, false if it can't be cached */
+static bool cache_job_key(const char *file, FORMAT format, uint64_t *key) {
+    uint64_t input;
+    if (cache_dir == NULL || file == NULL || is_stream(file) || ! xxh64_file(file, 0, &input)) {
+        return false;
+    }
+    char text[CACHE_KEY_TEXT];
+    size_t n = 0;
+    cache_key_add(text, &n, "repict %d|in %016llx|out %d", RESULT_CACHE_VERSION, (unsigned long long) input, (int) format);
+    if (format == F_PNG) {
+        cache_key_add(text, &n, " level %d filter %d", png_level, png_filter);
+    }
+    else if (format == F_JPG) {
+        cache_key_add(text, &n, " quality %d", jpeg_quality);
+    }
+    if (op_count > 0 && roi_def) {
+        cache_key_add(text, &n, "|roi %d %d %d %d", (int) roi[0], (int) roi[1], (int) roi[2], (int) roi[3]);
+    }
+    if (op_count > 0) {
+        cache_key_add(text, &n, "|edge %d", edge_mode);
+        if (edge_mode == REPICT_EDGE_CONSTANT) {
+            cache_key_add(text, &n, " %d", edge_value);
+        }
+    }
+    for (int k = 0; k < op_count; k++) {
+        cache_key_add(text, &n, "|%s", ops[k].func.name);
+        for (int a = 0; a < ops[k].argc; a++) {
+            const char *arg = ops[k].argv[a];
+            char *end;
+            const double v = strtod(arg, &end);
+            if (ops[k].func.func == CUSTOM_KER) {
+                const kernel_file_t *kf = kernel_file_load(arg);
+                if (kf == NULL) {
+                    return false;
+                }
+                cache_key_add(text, &n, " kernel %d %016llx", kf->kn,
+                        (unsigned long long) xxh64(kf->k, sizeof(kernel_t) * kf->kn * kf->kn, 0));
+                kernel_file_release(kf);
+            }
+            else if (end != arg && *end == '\0') {
+                cache_key_add(text, &n, " %.17g", v);
+            }
+            else {
+                cache_key_add(text, &n, " '%s'", arg);
+            }
+        }
+    }
+    if (n >= CACHE_KEY_TEXT) {
         return false;
     }
+    *key = xxh64(text, n, 0);
     return true;
 }
 
+/* Write len bytes to file (stdout for -), true on success */
+static bool write_bytes_out(char *file, const uint8_t *buf, size_t len) {
+    struct iovec iov = { (void *) buf, len };
+    if (is_stream(file)) {
+        return bmp_writev_all(stream_out >= 0 ? stream_out : 1, &iov, 1);
+    }
+#ifdef _WIN32
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0) {
+        perror("Couldn't open output file");
+        return false;
+    }
+    bool ok = bmp_writev_all(fd, &iov, 1);
+    ok = (close(fd) == 0) && ok;
+    return ok;
+}
+
+/* Copy the stored result for key to file, false on a miss */
+static bool cache_fetch(uint64_t key, char *file) {
+    size_t len = 0;
+    const uint8_t *entry = result_cache_map(cache_dir, key, &len);
+    if (entry == NULL) {
+        return false;
+    }
+    trace_span("cache copy", true);
+    const bool ok = write_bytes_out(file, entry, len);
+    trace_span("cache copy", false);
+    result_cache_unmap(entry, len);
+    return ok;
+}
+
+/* Encode into a new cache entry for key and copy it to file; encodes straight to file when the cache can't be written */
+static bool cache_encode(uint64_t key, char *file, FORMAT format, const pixel_t *data, int32_t w, int32_t h, int c) {
+    char temp[RESULT_CACHE_PATH_MAX];
+    const int fd = result_cache_temp(cache_dir, temp, sizeof(temp));
+    bool ok = fd >= 0;
+    if (ok) {
+        trace_span("encode", true);
+        ok = encode_fd(fd, format, data, w, h, c);
+        ok = (close(fd) == 0) && ok;
+        trace_span("encode", false);
+    }
+    size_t len = 0;
+    const uint8_t *encoded = ok ? bmp_map_file(temp, &len) : NULL;
+    if (encoded == NULL) { // cache directory unwritable or full
+        if (fd >= 0) {
+            unlink(temp);
+        }
+        print_verbose("Cache:", "can't store results in the cache directory");
+        return encode_image(file, format, data, w, h, c);
+    }
+    ok = write_bytes_out(file, encoded, len);
+    bmp_unmap_file(encoded, len);
+    result_cache_commit(cache_dir, temp, key, cache_max);
+    return ok;
+}
+
+
 /* Handle flags */
 bool handle_flags(const int argc, char **argv) {
     for (unsigned int i = 2; i < argc; i++) {
@@ -226,6 +801,38 @@ bool handle_flags(const int argc, char **argv) {
                 verbose = true;
                 break;
 
+                case 'r':
+                batch = true;
+                break;
+
+                case 't':
+                if (i + 1 >= argc) {
+                    printf("repict: -t needs an output file for the trace\n");
+                    return false;
+                }
+                trace_out = argv[++i];
+                break;
+
+                case 'j':
+                if (i + STAGES >= argc) {
+                    printf("repict: -j needs <decode> <filter> <encode> worker counts\n");
+                    return false;
+                }
+                for (unsigned int s = 0; s < STAGES; s++) {
+                    batch_workers[s] = atoi(argv[i + 1 + s]);
+                    if (batch_workers[s] < 0) {
+                        printf("repict: worker counts must be 0 (one per core) or more\n");
+                        return false;
+                    }
+                }
+                break;
+
+                case '-':
+                if (! handle_long_flag(argc, argv, &i)) {
+                    return false;
+                }
+                break;
+
                 case 'o':
                 if (argc >= i) {
                     file_out = argv[i + 1];
@@ -243,29 +850,389 @@ bool handle_flags(const int argc, char **argv) {
 }
 
 
-/* Main */
-int main(const int argc, char** argv) {
+/* Handle --long flags, *i left on the last argument consumed */
+bool handle_long_flag(const int argc, char **argv, unsigned int *i) {
+    const char *name = argv[*i] + 2;
 
-    // initialization
+    if (strcmp(name, "png-level") == 0) {
+        if (*i + 1 >= argc) {
+            printf("repict: --png-level needs a level 0-9\n");
+            return false;
+        }
+        png_level = atoi(argv[++(*i)]);
+        if (png_level < 0 || png_level > 9) {
+            printf("repict: --png-level must be 0-9\n");
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(name, "jpeg-quality") == 0) {
+        if (*i + 1 >= argc) {
+            printf("repict: --jpeg-quality needs a quality 1-100\n");
+            return false;
+        }
+        jpeg_quality = atoi(argv[++(*i)]);
+        if (jpeg_quality < 1 || jpeg_quality > 100) {
+            printf("repict: --jpeg-quality must be 1-100\n");
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(name, "roi") == 0) {
+        if (*i + 4 >= argc) {
+            printf("repict: --roi needs <x> <y> <width> <height>\n");
+            return false;
+        }
+        for (int k = 0; k < 4; k++) {
+            roi[k] = atoi(argv[++(*i)]);
+        }
+        if (roi[2] <= 0 || roi[3] <= 0) {
+            printf("repict: --roi width and height must be greater than 0\n");
+            return false;
+        }
+        roi_def = true;
+        return true;
+    }
+    if (strcmp(name, "cache") == 0) {
+        if (*i + 1 >= argc) {
+            printf("repict: --cache needs a directory to keep results in\n");
+            return false;
+        }
+        cache_dir = argv[++(*i)];
+        return true;
+    }
+    if (strcmp(name, "cache-max") == 0) {
+        const long mb = *i + 1 < argc ? atol(argv[++(*i)]) : 0;
+        if (mb <= 0) {
+            printf("repict: --cache-max needs a size in MB greater than 0\n");
+            return false;
+        }
+        cache_max = (uint64_t) mb << 20;
+        return true;
+    }
+    if (strcmp(name, "png-fast") == 0) {
+        png_filter = PNG_FILTER_FAST;
+        return true;
+    }
+    if (strcmp(name, "trace") == 0) {
+        if (*i + 1 >= argc) {
+            printf("repict: --trace needs an output file for the trace\n");
+            return false;
+        }
+        trace_out = argv[++(*i)];
+        return true;
+    }
+    if (strcmp(name, "edge") == 0) {
+        static const char *modes[] = {"zero", "trash", "clamp", "mirror", "wrap", "constant"};
+        const char *mode = *i + 1 < argc ? argv[++(*i)] : "";
+        for (int m = REPICT_EDGE_ALL; m <= REPICT_EDGE_CONSTANT; m++) {
+            if (strcmp(mode, modes[m]) == 0) {
+                edge_mode = m;
+            }
+        }
+        if (strcmp(mode, modes[edge_mode]) != 0) {
+            printf("repict: --edge must be zero, trash, clamp, mirror, wrap or constant <0-255>\n");
+            return false;
+        }
+        if (edge_mode == REPICT_EDGE_CONSTANT) {
+            char *end = NULL;
+            const long value = *i + 1 < argc ? strtol(argv[++(*i)], &end, 10) : -1;
+            if (end == NULL || end == argv[*i] || *end != '\0' || value < 0 || value > PIXEL_MAX) {
+                printf("repict: --edge constant needs a value 0-255\n");
+                return false;
+            }
+            edge_value = (int) value;
+        }
+        return true;
+    }
+    if (strcmp(name, "perf-counters") == 0) {
+        perf_counters = true;
+        return true;
+    }
+    if (strcmp(name, "in-format") == 0 || strcmp(name, "out-format") == 0) {
+        const FORMAT f = *i + 1 < argc ? match_format_ext(argv[++(*i)]) : NONE;
+        if (f == NONE) {
+            printf("repict: --%s needs a supported extension (png, bmp, pgm, ppm, qoi, jpg)\n", name);
+            return false;
+        }
+        if (name[0] == 'i') {
+            stream_in_format = f;
+        }
+        else {
+            stream_out_format = f;
+        }
+        return true;
+    }
+
+    printf("repict: unknown flag %s\n", argv[*i]);
+    return false;
+}
+
+
+// ======== Batch mode (-r) ========
+// Decode workers read files and hand each image to the thread pool as a task, which runs
+// the function through the library (its state is per thread) on the same workers as the
+// tiles of the filters themselves, so images and tiles share the cores without adding
+// threads.  Encode workers write the results.  Decode and encode have their own thread
+// counts (-j) so disk and compute overlap; at most batch_inflight_max images are held
+// between the start of a decode and the end of its encode.
+
+typedef struct {
+    STAGE stage;
+    batch_queue_t *in;
+} batch_stage_t;
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_slot_free = PTHREAD_COND_INITIALIZER;
+static int batch_done, batch_failed, batch_cached;
+static int batch_inflight, batch_inflight_max;  // images decoded (or decoding) and not yet written
+static int batch_filter_max;                    // images filtered at once
+static pool_group_t batch_filters;              // filter tasks on the pool
+static batch_queue_t *batch_encode_queue;       // filtered images, room for every image in flight
+
+static void batch_decode(batch_item_t *item) {
+    item->cache_keyed = cache_job_key(item->path_in, item->image.format, &item->cache_key);
+    if (item->cache_keyed && cache_fetch(item->cache_key, item->path_out)) {
+        item->cached = true;
+        return;
+    }
+    item->failed = ! decode_image(item->path_in, item->image.format, ops_channels(), &item->image);
+}
+
+static void batch_filter(batch_item_t *item) {
+    if (item->failed || item->cached) {
+        return;
+    }
+    image_t *img = &item->image;
+    repict_set_edge_mode(edge_mode, (pixel_t) edge_value);
+    source_image(img);
+    run_ops(img->pixels);
+    item->result = repict_get_result_as_copy();
+    item->channels_out = repict_get_working_channels();
+    repict_clean();
+    item->failed = (item->result == NULL);
+}
+
+/* Pool task: filter one image and queue it for the encoders (never blocks, see run_batch) */
+static void batch_filter_task(void *arg, int unused) {
+    batch_item_t *item = (batch_item_t *) arg;
+    batch_filter(item);
+    queue_push(batch_encode_queue, item);
+}
+
+static void batch_encode(batch_item_t *item) {
+    if (! item->failed && ! item->cached) {
+        item->failed = item->cache_keyed
+                ? ! cache_encode(item->cache_key, item->path_out, item->image.format, item->result,
+                        item->image.width, item->image.height, item->channels_out)
+                : ! encode_image(item->path_out, item->image.format, item->result,
+                        item->image.width, item->image.height, item->channels_out);
+    }
+
+    pthread_mutex_lock(&batch_lock);
+    if (item->failed) {
+        batch_failed++;
+        printf("repict: failed on %s\n", item->path_in);
+    }
+    else {
+        batch_done++;
+        batch_cached += item->cached;
+        print_verbose(item->path_in, item->path_out);
+    }
+    batch_inflight--;
+    pthread_cond_signal(&batch_slot_free);
+    pthread_mutex_unlock(&batch_lock);
+
+    free_image(&item->image);
+    free(item->result);
+    free(item);
+}
+
+static void *batch_worker(void *arg) {
+    batch_stage_t *st = (batch_stage_t *) arg;
+    batch_item_t *item;
+    while ((item = (batch_item_t *) queue_pop(st->in)) != NULL) {
+        if (st->stage != STAGE_DECODE) {
+            batch_encode(item);
+            continue;
+        }
+        pthread_mutex_lock(&batch_lock);
+        while (batch_inflight >= batch_inflight_max) {
+            pthread_cond_wait(&batch_slot_free, &batch_lock);
+        }
+        batch_inflight++;
+        pthread_mutex_unlock(&batch_lock);
+
+        batch_decode(item);
+        pool_wait(&batch_filters, batch_filter_max - 1);
+        pool_submit(&batch_filters, batch_filter_task, item, 0);
+    }
+    return NULL;
+}
+
+/* Run function over every supported image in directory dir, output to dir out */
+bool run_batch(char *dir, char *out) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        printf("repict: cannot open input directory %s\n", dir);
+        return false;
+    }
+#ifdef _WIN32
+    mkdir(out);
+#else
+    mkdir(out, 0755);
+#endif
+
+    batch_done = 0;
+    batch_failed = 0;
+    batch_cached = 0;
+
+    int workers[STAGES];
+    for (int s = 0; s < STAGES; s++) {
+        workers[s] = batch_workers[s] > 0 ? batch_workers[s] : pool_core_count();
+    }
+    batch_filter_max = batch_workers[STAGE_FILTER] > 0 ? batch_workers[STAGE_FILTER] : pool_threads();
+    batch_inflight = 0;
+    batch_inflight_max = workers[STAGE_DECODE] + batch_filter_max + BATCH_QUEUE_DEPTH * workers[STAGE_ENCODE];
+    atomic_init(&batch_filters.pending, 0);
+
+    // files feed the decoders; the encode queue holds every image in flight, so filter tasks
+    // never block a pool worker on it
+    batch_queue_t files, encoded;
+    batch_stage_t decoders = { STAGE_DECODE, &files }, encoders = { STAGE_ENCODE, &encoded };
+    const int total = workers[STAGE_DECODE] + workers[STAGE_ENCODE];
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * total);
+    if (threads == NULL || ! queue_init(&files, BATCH_QUEUE_DEPTH * workers[STAGE_DECODE], 1)) {
+        free(threads);
+        closedir(d);
+        return false;
+    }
+    if (! queue_init(&encoded, batch_inflight_max, 1)) {
+        queue_free(&files);
+        free(threads);
+        closedir(d);
+        return false;
+    }
+    batch_encode_queue = &encoded;
+    int t = 0, decoding = 0;
+    for (int k = 0; k < total; k++) {
+        batch_stage_t *st = k < workers[STAGE_DECODE] ? &decoders : &encoders;
+        if (pthread_create(&threads[t], NULL, batch_worker, st) == 0) {
+            t++;
+            decoding += (st == &decoders);
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' || strrchr(name, '.') == NULL) {
+            continue;
+        }
+        FORMAT format = match_file_format((char *) name);
+        if (format == NONE) {
+            continue;
+        }
+        batch_item_t *item = (batch_item_t *) calloc(1, sizeof(batch_item_t));
+        if (item == NULL) {
+            break;
+        }
+        snprintf(item->path_in, BATCH_PATH_MAX, "%s/%s", dir, name);
+        snprintf(item->path_out, BATCH_PATH_MAX, "%s/%s", out, name);
+        item->image.format = format;
+        queue_push(&files, item);
+    }
+    closedir(d);
+    queue_close(&files);
+
+    // decoders first, then the filter tasks they submitted, then the encoders drain
+    for (int k = 0; k < decoding; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    pool_wait(&batch_filters, 0);
+    queue_close(&encoded);
+    for (int k = decoding; k < t; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(threads);
+    queue_free(&files);
+    queue_free(&encoded);
+
+    const double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("repict: %d images processed, %d failed in %.2fs (%.1f images/s)\n",
+            batch_done, batch_failed, secs, secs > 0 ? batch_done / secs : 0.0);
+    if (cache_dir != NULL) {
+        printf("repict: %d of them copied from the cache\n", batch_cached);
+    }
+    return batch_failed == 0;
+}
+
+
+/* Reset per-run CLI state, so serve mode can run one job after another */
+void reset_state(void) {
     // CLI status
     verbose = false;
     function_def = false;
     out_def = false;
     usage_req = false;
+    batch = false;
+    free_ops();
+    const int workers[STAGES] = BATCH_WORKERS_DEFAULT;
+    memcpy(batch_workers, workers, sizeof(batch_workers));
 
     // assume default output file
     file_out = DEFAULT_OUT_FILE;
+    channels_out = CHANNELS;
+    png_level = PNG_LEVEL_DEFAULT;
+    png_filter = PNG_FILTER_BEST;
+    jpeg_quality = JPEG_QUALITY_DEFAULT;
+    roi_def = false;
+    cache_dir = NULL;
+    cache_max = RESULT_CACHE_MAX_DEFAULT;
+    trace_out = NULL;
+    perf_counters = false;
+    edge_mode = REPICT_EDGE_STRATEGY;
+    edge_value = 0;
+    stream_in_format = NONE;
+    stream_out_format = NONE;
 
     // for usage buffer
     clear_buffer();
-    // ---------------------------------------------------------------------
+}
 
-    // check for help
-    if(argc > 1 && strcmp(argv[1], "help") == 0) {
-        print_help();
-        return 0;
+/* Run one command line, tracing it when -t was given */
+int run_job(const int argc, char **argv) {
+    const int status = run_command(argc, argv);
+    if (stream_out >= 0) { // -o -: give stdout back once the image is out
+        fflush(stdout);
+        dup2(stream_out, 1);
+        close(stream_out);
+        stream_out = -1;
+    }
+    if (perf_counters) {
+        perf_report();
+        perf_close();
+    }
+    if (trace_out != NULL) {
+        if (! trace_write(trace_out)) {
+            printf("repict: failure writing trace to %s\n", trace_out);
+        }
+        trace_stop();
     }
-    
+    return status;
+}
+
+/* Parse and run one command line */
+static int run_command(const int argc, char **argv) {
+
+    // initialization
+    reset_state();
+    // ---------------------------------------------------------------------
+
     // get input file or fail
     if (argc < 4) {
         printf("repict: not enough arguments provided\n");
@@ -277,6 +1244,53 @@ int main(const int argc, char** argv) {
     file_in = argv[1];
     // ---------------------------------------------------------------------
 
+    // go through all FLAGS
+    if (! handle_flags(argc, argv)) {
+        // errors handled within
+        if (usage_req) {
+            print_usage_f(function, false);
+        }
+        free_ops();
+        return 0;
+    }
+    if (serving && (is_stream(file_in) || is_stream(file_out))) {
+        printf("repict: serve jobs can't read stdin or write stdout, give file paths\n");
+        free_ops();
+        return 0;
+    }
+    if (is_stream(file_out) && ! batch) {
+        // the image owns stdout: every message of this run goes to stderr instead
+        fflush(stdout);
+        stream_out = dup(1);
+        dup2(2, 1);
+        stream_pipe_size(stream_out);
+    }
+    if (trace_out != NULL) {
+        trace_start();
+    }
+    if (perf_counters) {
+        if (batch) {
+            printf("repict: --perf-counters applies to single images, ignored with -r\n");
+            perf_counters = false;
+        }
+        else {
+            pool_shutdown(); // a running pool (serve) restarts on first use, its new workers counted too
+            if (! perf_open()) {
+                printf("repict: hardware counters unavailable (%s)\n", strerror(errno));
+                perf_counters = false;
+            }
+        }
+    }
+    // ---------------------------------------------------------------------
+
+    // BATCH mode: input is a directory, -o names the output directory
+    if (batch) {
+        const bool ok = run_batch(file_in, out_def ? file_out : DEFAULT_OUT_DIR);
+        free_ops();
+        return ok ? 1 : 0;
+    }
+    // ---------------------------------------------------------------------
+
     // check INPUT FILE FORMAT
     // special case: use r to use default out file as input (out/output.png)
     FORMAT format;
@@ -285,84 +1299,667 @@ int main(const int argc, char** argv) {
         format = DEFAULT_OUT_FORMAT.format;
         file_type = DEFAULT_OUT_FORMAT.ext;
     }
+    else if (is_stream(file_in)) { // stdin: --in-format, else told from the first bytes
+        format = stream_in_format;
+        file_type = "stdin";
+    }
     else { // regular case
         format = match_file_format(file_in);
         if (format == NONE) {
             printf("repict: error reading file format of input\n");
+            free_ops();
             return 0;
         }
     }
+    print_verbose("Input filetype:", file_type);
+    // ---------------------------------------------------------------------
+
+    // write output to OUTPUT FILE with format specification
+    FORMAT format_out;
+    if (is_stream(file_out)) { // stdout: --out-format, else png
+        format_out = stream_out_format != NONE ? stream_out_format : DEFAULT_OUT_FORMAT.format;
+        file_type = "stdout";
+    }
+    else {
+        format_out = match_file_format(file_out);
+    }
+    if (format_out == NONE) {
+        printf("repict: error reading file format of output\n");
+        free_ops();
+        return 0;
+    }
+    print_verbose("Output filetype:", file_type);
+
+    // NO FUNCTION defined, only continue if its a format converstion
+    if (! function_def && ! out_def) {
+        // no output specified either, so quit
+        printf("repict: no function specification provided.\n");
+        print_usage(false);
+        return 0;
+    }
+    // ---------------------------------------------------------------------
+
+    // CACHE: the same input bytes through the same job, copy the stored output instead
+    uint64_t cache_key = 0;
+    const bool cache_keyed = cache_job_key(file_in, format_out, &cache_key);
+    if (cache_keyed && cache_fetch(cache_key, file_out)) {
+        print_verbose("Cache:", "hit, output copied from the cache");
+        free_ops();
+        return 1;
+    }
     // ---------------------------------------------------------------------
 
     // OPEN FILE, store data in pixels
     if (! open_file(file_in, format)) {
         printf("repict: failure opening file\n");
+        free_ops();
         return 0;
     }
     // ---------------------------------------------------------------------
 
-    // go through all FLAGS
-    if (! handle_flags(argc, argv)) {
-        // errors handled within
-        if (usage_req) {
-            print_usage_f(function, false);
+    int status = 1;
+    if (! function_def) {
+        // output defined, its a format converstion (or just a rewrite/rename)
+        print_verbose("Image write:", "writing to new location/format");
+        pixels_out = pixels;    // just use pixels input as output
+        channels_out = bpp;
+    }
+    else {
+        // call FUNCTION EXEC for every -f in order, one decode and one write for the chain
+        repict_set_edge_mode(edge_mode, (pixel_t) edge_value);
+        source_image(&image_in);                                // no copy, the library may free it
+        pixels_out = run_ops(pixels);                           // get output data
+        channels_out = repict_get_working_channels();           // get output channels for write
+    }
+
+    // write out using file out and format out, through the cache when it's on
+    const bool written = cache_keyed
+            ? cache_encode(cache_key, file_out, format_out, pixels_out, width, height, channels_out)
+            : write_file(file_out, format_out);
+    if (! written) {
+        printf("repict: failure writing output file\n");
+        status = 0;
+    }
+    // ---------------------------------------------------------------------
+
+    // FREE image memory
+    if (function_def) {
+        repict_clean();
+    }
+    close_file(format);
+    free_ops();
+
+    return status;
+}
+
+
+// ======== Server mode (repict serve) ========
+// Jobs arrive one per line, each written exactly like a repict command line without the
+// program name, e.g. "in.png -f bw -f gauss 1.4 -o out.png".  Every job gets back one
+// line: "ok <ms>" or "error <ms>".  The process, thread pool and the library's image
+// buffers stay warm between jobs, so a job costs only its decode, filters and encode.
+
+/* Split line into argv (argv[0] = program name), honouring "double quoted" args */
+static int split_job(char *line, char **argv, int max) {
+    int argc = 0;
+    argv[argc++] = DEFAULT_ARG;
+    char *p = line;
+    while (*p != '\0' && argc < max) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (*p == '\0') {
+            break;
+        }
+        if (*p == '"') {
+            argv[argc++] = ++p;
+            while (*p != '\0' && *p != '"') p++;
+        }
+        else {
+            argv[argc++] = p;
+            while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        }
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+    }
+    return argc;
+}
+
+/* Run the jobs read from 'in', answering each on descriptor 'out' until EOF or "quit"
+    return false if asked to quit */
+static bool serve_stream(FILE *in, int out) {
+    char *line = NULL;
+    size_t cap = 0;
+    char *argv[SERVE_MAX_ARGS];
+    char reply[64];
+    bool keep = true;
+
+    while (getline(&line, &cap, in) > 0) {
+        const int argc = split_job(line, argv, SERVE_MAX_ARGS);
+        if (argc < 2) {
+            continue;
+        }
+        if (strcmp(argv[1], "quit") == 0) {
+            keep = false;
+            break;
+        }
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        const int status = run_job(argc, argv);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        fflush(stdout);
+
+        const double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        const int n = snprintf(reply, sizeof(reply), "%s %.3f\n", status ? "ok" : "error", ms);
+        if (write(out, reply, n) != n) {
+            break; // client went away
         }
+    }
+    free(line);
+    return keep;
+}
+
+/* repict serve <socket path | -> : run jobs from a Unix socket or stdin */
+int run_server(const int argc, char **argv) {
+    if (argc < 3) {
+        printf("Usage:  repict serve <socket path | ->\n");
         return 0;
     }
-    print_verbose("Input filetype:", file_type);
-    // ---------------------------------------------------------------------
+    pool_init(0);
+    repict_set_buffer_pool(SERVE_BUFFER_POOL);
+    serving = true;
+
+    if (strcmp(argv[2], "-") == 0) {
+        // replies own stdout; messages from jobs go to stderr instead
+        const int out = dup(1);
+        dup2(2, 1);
+        serve_stream(stdin, out);
+        close(out);
+        return 1;
+    }
 
-    // write output to OUTPUT FILE with format specification
-    FORMAT format_out = match_file_format(file_out);
-    if (format_out == NONE) {
-        printf("repict: error reading file format of output\n");
+#ifndef _WIN32
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+        printf("repict: socket path too long\n");
         return 0;
     }
-    print_verbose("Output filetype:", file_type);
+    strcpy(addr.sun_path, argv[2]);
 
-    // ---------------------------------------------------------------------
+    const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argv[2]);
+    if (sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sock, 16) != 0) {
+        perror("repict: cannot listen on socket");
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    printf("repict: serving on %s\n", argv[2]);
+    fflush(stdout);
+
+    // one client at a time, jobs run in the order they arrive
+    bool keep = true;
+    while (keep) {
+        const int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
+        FILE *in = fdopen(conn, "r");
+        if (in == NULL) {
+            close(conn);
+            continue;
+        }
+        keep = serve_stream(in, conn);
+        fclose(in);
+    }
+    close(sock);
+    unlink(argv[2]);
+    return 1;
+#else
+    printf("repict: only 'repict serve -' (stdin) is supported on this platform\n");
+    return 0;
+#endif
+}
 
-    // NO FUNCTION defined, only continue if its a format converstion
-    if (! function_def) {
 
-        // output defined, its a format converstion (or just a rewrite/rename)
-        if (out_def) {
-            print_verbose("Image write:", "writing to new location/format");
-            pixels_out = pixels;    // just use pixels input as output
-
-            // write out using file out and format out
-            if (! write_file(file_out, format_out)) {
-                printf("repict: failure writing output file\n");
-                return 0;
+// ======== Benchmark mode (repict bench) ========
+// Deterministic synthetic images at a few resolutions; every function with bench_args
+// and every format's encode/decode is timed BENCH_RUNS times and reported as megapixels
+// per second at the median and 95th percentile run, so releases can be compared.
+// Each case also hashes its output (function result, decoded roundtrip): --save keeps
+// speeds and hashes in a file, --baseline checks a later run against it and fails on any
+// changed output or on a case more than --max-drop percent slower.
+
+typedef enum {BENCH_NOISE, BENCH_GRADIENT, BENCH_EDGES, BENCH_KINDS} BENCH_KIND;
+static const char *bench_kind_names[BENCH_KINDS] = {"noise", "gradient", "edges"};
+static const int bench_png_levels[BENCH_PNG_LEVELS] = {PNG_LEVEL_DEFAULT, 0, 1, 9};  // the first keeps the plain "png" name
+
+static double now_sec(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint32_t bench_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Fill img (w x h x c) with one kind of synthetic content, same bytes every run */
+static void bench_image(pixel_t *img, int32_t w, int32_t h, int c, BENCH_KIND kind) {
+    uint32_t seed = 0x9E3779B9u;
+    for (int32_t y = 0; y < h; y++) {
+        for (int32_t x = 0; x < w; x++) {
+            pixel_t *p = img + ((size_t) y * w + x) * c;
+            for (int k = 0; k < c; k++) {
+                switch (kind) {
+                    case BENCH_NOISE:
+                    p[k] = (pixel_t) bench_rand(&seed);
+                    break;
+
+                    case BENCH_GRADIENT:
+                    p[k] = (pixel_t) ((x * 255 / w + y * 255 / h + k * 40) / 2);
+                    break;
+
+                    default: { // text-like: 3x5 glyph cells of dark strokes on a light page
+                    const int32_t cx = x / 12, cy = y / 18, gx = (x % 12) / 4, gy = (y % 18) / 3;
+                    uint32_t g = (uint32_t) (cx * 73856093u) ^ (uint32_t) (cy * 19349663u);
+                    g ^= g >> 13;
+                    g *= 0x5bd1e995u;
+                    const bool ink = gy < 5 && ((g >> (gy * 3 + gx)) & 1);
+                    p[k] = ink ? 20 : 235;
+                    }
+                }
             }
-            return 1; // finish by writing file to new format
         }
+    }
+}
 
-        // no output specified either, so quit
-        printf("repict: no function specification provided.\n");
-        print_usage(false);
-        return 0;
+typedef struct {
+    char name[64];          // case \t image \t WxH
+    double mps;             // megapixels/s at the median run
+    uint64_t hash;          // output hash, 0 = nothing to compare
+} bench_case_t;
+
+static bench_case_t *bench_cases = NULL;
+static int bench_case_count = 0, bench_case_cap = 0;
+
+/* FNV-1a over an output image, so a run can be checked against a baseline exactly */
+static uint64_t bench_hash(const pixel_t *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
     }
-    // ---------------------------------------------------------------------
+    return h;
+}
 
-    // call FUNCTION EXEC (TODO: implement multiple calls)
-    repict_set_source(pixels, width, height, CHANNELS, true);
-    pixels_out = function.exec(pixels, f_argc, f_argv);     // get output data
-    channels_out = repict_get_working_channels();           // get output channels for write
+static void bench_record(const char *what, const char *image, int32_t w, int32_t h, double mps, uint64_t hash) {
+    if (bench_case_count == bench_case_cap) {
+        const int cap = bench_case_cap > 0 ? bench_case_cap * 2 : 64;
+        bench_case_t *c = (bench_case_t *) realloc(bench_cases, sizeof(bench_case_t) * cap);
+        if (c == NULL) {
+            return;
+        }
+        bench_cases = c;
+        bench_case_cap = cap;
+    }
+    bench_case_t *c = &bench_cases[bench_case_count++];
+    snprintf(c->name, sizeof(c->name), "%s\t%s\t%dx%d", what, image, w, h);
+    c->mps = mps;
+    c->hash = hash;
+}
 
-    free(f_argv);
+/* Write recorded cases as "case \t image \t WxH \t MP/s \t hash" lines */
+static bool bench_save(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+    for (int i = 0; i < bench_case_count; i++) {
+        fprintf(fp, "%s\t%.4f\t%016llx\n", bench_cases[i].name, bench_cases[i].mps,
+                (unsigned long long) bench_cases[i].hash);
+    }
+    return fclose(fp) == 0;
+}
 
-    if (! write_file(file_out, format_out)) {
-        printf("repict: failure writing output file\n");
+/* Check recorded cases against a --save file, return the number of failures (-1: unreadable) */
+static int bench_check(const char *path, double max_drop) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    bool *seen = (bool *) calloc(bench_case_count > 0 ? bench_case_count : 1, sizeof(bool));
+    if (seen == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    int failures = 0, matched = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        // the name is everything before the last two tab separated fields
+        char *hash_s = strrchr(line, '\t');
+        if (hash_s == NULL) {
+            continue;
+        }
+        *hash_s++ = '\0';
+        char *mps_s = strrchr(line, '\t');
+        if (mps_s == NULL) {
+            continue;
+        }
+        *mps_s++ = '\0';
+        const double base_mps = atof(mps_s);
+        const uint64_t base_hash = strtoull(hash_s, NULL, 16);
+
+        bool found = false;
+        for (int i = 0; i < bench_case_count; i++) {
+            const bench_case_t *c = &bench_cases[i];
+            if (strcmp(c->name, line) != 0) {
+                continue;
+            }
+            found = seen[i] = true;
+            matched++;
+            if (c->hash != base_hash) {
+                printf("repict: output changed: %s\n", c->name);
+                failures++;
+            }
+            else if (base_mps > 0 && c->mps < base_mps * (1.0 - max_drop / 100.0)) {
+                printf("repict: slower: %s  %.2f -> %.2f MP/s (%.1f%%)\n", c->name, base_mps, c->mps,
+                        100.0 * (c->mps - base_mps) / base_mps);
+                failures++;
+            }
+        }
+        if (! found) { // renamed or dropped since the baseline was saved
+            printf("repict: not run: %s\n", line);
+            failures++;
+        }
+    }
+    fclose(fp);
+    for (int i = 0; i < bench_case_count; i++) {
+        if (! seen[i]) { // new since the baseline, nothing to check it against
+            printf("repict: not in baseline: %s\n", bench_cases[i].name);
+            failures++;
+        }
+    }
+    free(seen);
+    if (matched == 0) { // an empty or foreign baseline checks nothing
+        printf("repict: no case of %s matched this run\n", path);
+        failures++;
+    }
+    printf("repict: %d cases checked against %s, %d failed\n", matched, path, failures);
+    return failures;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Print and record one result line from n run times (sorted in place), bytes: encoded size (0 = none) */
+static void bench_report(const char *what, const char *image, int32_t w, int32_t h, double *t, int n, uint64_t hash, size_t bytes) {
+    qsort(t, n, sizeof(double), cmp_double);
+    const double mp = (double) w * h / 1e6;
+    const double med = t[n / 2];
+    const double p95 = t[(int) ((n - 1) * 0.95 + 0.5)];
+    printf("%-14s %-9s %5dx%-5d %10.3f %10.3f %10.2f %10.2f", what, image, w, h,
+            med * 1e3, p95 * 1e3, mp / med, mp / p95);
+    if (bytes > 0) {
+        printf(" %8.3f", (double) bytes / ((double) w * h));
+    }
+    printf("\n");
+    fflush(stdout);
+    bench_record(what, image, w, h, mp / med, hash);
+}
+
+/* repict bench [-n runs] [-s WxH ...] [--save file] [--baseline file] [--max-drop pct]
+    time every function and format on synthetic images, 0 when no baseline check failed */
+int run_bench(const int argc, char **argv) {
+    int runs = BENCH_RUNS;
+    int32_t sizes[BENCH_MAX_SIZES][2] = {{640, 480}, {1920, 1080}};
+    int nsizes = 2, given = 0;
+    const char *save = NULL, *baseline = NULL;
+    double max_drop = BENCH_MAX_DROP;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-drop") == 0 && i + 1 < argc) {
+            max_drop = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc && given < BENCH_MAX_SIZES) {
+            if (sscanf(argv[++i], "%dx%d", &sizes[given][0], &sizes[given][1]) == 2
+                    && sizes[given][0] > 0 && sizes[given][1] > 0) {
+                nsizes = ++given;
+            }
+        }
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+    double *t = (double *) malloc(sizeof(double) * runs);
+#ifdef _WIN32
+    mkdir(BENCH_DIR);
+#else
+    mkdir(BENCH_DIR, 0755);
+#endif
+
+    printf("%-14s %-9s %11s %10s %10s %10s %10s %8s\n", "case", "image", "size", "med ms", "p95 ms", "MP/s med", "MP/s p95", "B/px");
+    for (int si = 0; si < nsizes; si++) {
+        const int32_t w = sizes[si][0], h = sizes[si][1];
+        pixel_t *img = repict_alloc_image(w, h, CHANNELS);
+        if (img == NULL || t == NULL) {
+            break;
+        }
+        for (int kind = 0; kind < BENCH_KINDS; kind++) {
+            bench_image(img, w, h, CHANNELS, (BENCH_KIND) kind);
+
+            // functions, each reading the source in place
+            for (int f = 0; f < MAX_FUNCTIONS; f++) {
+                if (bench_args[f] == NULL) {
+                    continue;
+                }
+                char args[64];
+                char *argv_f[4];
+                int argc_f = 0;
+                snprintf(args, sizeof(args), "%s", bench_args[f]);
+                for (char *tok = strtok(args, " "); tok != NULL && argc_f < 4; tok = strtok(NULL, " ")) {
+                    argv_f[argc_f++] = tok;
+                }
+                uint64_t hash = 0;
+                for (int r = 0; r < runs; r++) {
+                    repict_set_source(img, w, h, CHANNELS, REPICT_SOURCE_BORROW);
+                    const double t0 = now_sec();
+                    functions[f].exec(img, argc_f, argv_f);
+                    t[r] = now_sec() - t0;
+                    if (r == 0) {
+                        hash = bench_hash(repict_get_result(), (size_t) w * h * repict_get_working_channels());
+                    }
+                    repict_clean();
+                }
+                bench_report(functions[f].name, bench_kind_names[kind], w, h, t, runs, hash, 0);
+            }
+
+            // formats: encode to a scratch file, then decode it back; PNG also at the other
+            // bench_png_levels so its size and speed can be weighed against the rest
+            for (int fi = 0; fi < MAX_FORMATS * BENCH_PNG_LEVELS; fi++) {
+                const format_t *fmt = &formats[fi % MAX_FORMATS];
+                const int level = fi / MAX_FORMATS;
+                if (level > 0 && fmt->format != F_PNG) {
+                    continue;
+                }
+                char path[BATCH_PATH_MAX];
+                char name[16];
+                char label[32];
+                snprintf(path, sizeof(path), "%s/bench.%s", BENCH_DIR, fmt->ext);
+                if (level > 0) {
+                    snprintf(name, sizeof(name), "%s L%d", fmt->ext, bench_png_levels[level]);
+                }
+                else {
+                    snprintf(name, sizeof(name), "%s", fmt->ext);
+                }
+                png_level = bench_png_levels[level];
+
+                for (int r = 0; r < runs; r++) {
+                    const double t0 = now_sec();
+                    encode_image(path, fmt->format, img, w, h, CHANNELS);
+                    t[r] = now_sec() - t0;
+                }
+                struct stat st;
+                const size_t bytes = stat(path, &st) == 0 ? (size_t) st.st_size : 0;
+                snprintf(label, sizeof(label), "encode %s", name);
+                bench_report(label, bench_kind_names[kind], w, h, t, runs, 0, bytes); // encoders may change bytes, the roundtrip may not
+
+                uint64_t hash = 0;
+                for (int r = 0; r < runs; r++) {
+                    image_t dec;
+                    const double t0 = now_sec();
+                    const bool ok = decode_image(path, fmt->format, CHANNELS, &dec);
+                    t[r] = now_sec() - t0;
+                    if (ok) {
+                        if (r == 0) {
+                            hash = bench_hash(dec.pixels, (size_t) w * h * dec.channels);
+                        }
+                        free_image(&dec);
+                    }
+                }
+                snprintf(label, sizeof(label), "decode %s", name);
+                bench_report(label, bench_kind_names[kind], w, h, t, runs, hash, 0);
+                remove(path);
+            }
+        }
+        free(img);
+    }
+    free(t);
+    png_level = PNG_LEVEL_DEFAULT;
+
+    int status = 0; // informational like help, unless a baseline check fails (then make bench fails too)
+    if (save != NULL && ! bench_save(save)) {
+        printf("repict: failure writing %s\n", save);
+        status = 2;
+    }
+    if (baseline != NULL) {
+        const int failures = bench_check(baseline, max_drop);
+        if (failures < 0) {
+            printf("repict: failure reading baseline %s\n", baseline);
+        }
+        if (failures != 0) {
+            status = 2;
+        }
+    }
+    free(bench_cases);
+    bench_cases = NULL;
+    bench_case_count = bench_case_cap = 0;
+    return status;
+}
+
+
+// ======== Compare (repict compare) ========
+
+/* repict compare <a> <b> [min psnr] : pixel compare two images, exact unless min psnr given;
+    0 when they match, 1 when they differ, 2 when one can't be read (like cmp) */
+int run_compare(const int argc, char **argv) {
+    if (argc < 4) {
+        printf("repict: usage: repict compare <a> <b> [min psnr dB]\n");
+        return 2;
+    }
+    const double min_psnr = argc > 4 ? atof(argv[4]) : -1;
+    image_t a, b;
+    FORMAT fa = match_file_format(argv[2]);
+    FORMAT fb = match_file_format(argv[3]);
+    if (fa == NONE || fb == NONE) {
+        printf("repict: error reading file format of input\n");
+        return 2;
+    }
+    if (! decode_image(argv[2], fa, CHANNELS, &a)) {
+        printf("repict: failure opening %s\n", argv[2]);
+        return 2;
+    }
+    if (! decode_image(argv[3], fb, CHANNELS, &b)) {
+        printf("repict: failure opening %s\n", argv[3]);
+        free_image(&a);
+        return 2;
+    }
+
+    int status = 1;
+    if (a.width != b.width || a.height != b.height) {
+        printf("repict: size differs: %dx%d vs %dx%d\n", a.width, a.height, b.width, b.height);
+    }
+    else {
+        const size_t n = (size_t) a.width * a.height * CHANNELS;
+        size_t differ = 0;
+        int max_diff = 0;
+        double sq = 0;
+        for (size_t i = 0; i < n; i++) {
+            const int d = abs((int) a.pixels[i] - (int) b.pixels[i]);
+            if (d > 0) {
+                differ++;
+                sq += (double) d * d;
+                if (d > max_diff) {
+                    max_diff = d;
+                }
+            }
+        }
+        const double psnr = differ == 0 ? INFINITY : 10.0 * log10(255.0 * 255.0 / (sq / n));
+        printf("repict: %zu of %zu samples differ, max %d, PSNR %.2f dB\n", differ, n, max_diff, psnr);
+        status = (differ == 0 || (min_psnr >= 0 && psnr >= min_psnr)) ? 0 : 1;
+    }
+    free_image(&a);
+    free_image(&b);
+    return status;
+}
+
+
+/* Main */
+int main(const int argc, char** argv) {
+
+    // check for help
+    if(argc > 1 && strcmp(argv[1], "help") == 0) {
+        print_help();
         return 0;
     }
-    // ---------------------------------------------------------------------
 
-    // FREE image memory
-    repict_clean();
-    stbi_image_free(pixels);
+    // convolution tiles run on the thread pool (not in the serial reference build make test checks against)
+#ifndef REPICT_SERIAL
+    repict_set_parallel(pool_parallel_for);
+#endif
+
+    // long running server: jobs arrive as command lines
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        const int status = run_server(argc, argv);
+        kernel_file_cache_clear();
+        repict_gauss_cache_clear();
+        pool_shutdown();
+        return status;
+    }
 
-    return 1;
+    // image diff for checking filter changes
+    if (argc > 1 && strcmp(argv[1], "compare") == 0) {
+        return run_compare(argc, argv);
+    }
+
+    // timings on synthetic images
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        const int status = run_bench(argc, argv);
+        repict_gauss_cache_clear();
+        pool_shutdown();
+        return status;
+    }
+
+    const int status = run_job(argc, argv);
+    kernel_file_cache_clear();
+    repict_gauss_cache_clear();
+    pool_shutdown();
+    return status;
 }
 
 
@@ -1,18 +1,56 @@
 
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
 
-#include "repict.h"
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
-#define MAX_FUNCTIONS 7             // number of functions implemented
-#define MAX_FORMATS 2               // number of image formats supported
+#include "repict.h"
+#include "bmpio.h"
+#include "pnmio.h"
+#include "qoiio.h"
+#include "png_out.h"
+#include "jpeg_out.h"
+#include "batch_queue.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "kernel_file.h"
+#include "result_cache.h"
+
+#define MAX_FUNCTIONS 8             // number of functions implemented
+#define MAX_FORMATS 6               // number of image formats supported
+#define MAX_OPS 32                  // functions chained in one run (-f ... -f ...)
 #define CHANNELS 3                           // color channels on input
 #define DEFAULT_OUT_FILE "out/output.png"    // default output file path
-
-#define DEFAULT_USAGE "<image.png> -f <function>"         // default console usage
+#define DEFAULT_OUT_DIR "out"                // default output directory for -r
+#define BATCH_QUEUE_DEPTH 4                  // images waiting per worker of the next stage
+#define BATCH_WORKERS_DEFAULT {2, 0, 2}      // -j when not given
+#define BATCH_PATH_MAX 4096
+#define BENCH_RUNS 7                         // timed runs per case (repict bench -n)
+#define BENCH_MAX_SIZES 8
+#define BENCH_DIR "out"                      // scratch files for format timings
+#define BENCH_MAX_DROP 10.0                  // percent slower than --baseline that fails
+#define BENCH_PNG_LEVELS 4                   // PNG compression levels timed by bench
+#define SERVE_MAX_ARGS 128                   // args in one serve job line
+#define SERVE_BUFFER_POOL ((size_t) 512 << 20)  // image bytes the library keeps warm in serve mode
+#define STREAM_PATH "-"                      // input or -o path meaning stdin / stdout
+#define STREAM_READ_CHUNK (1 << 20)          // bytes asked of each read() on stdin
+#define STREAM_PIPE_SIZE (1 << 20)           // pipe buffer asked for on stdin / stdout (Linux)
+#define CACHE_KEY_TEXT 4096                  // canonical job text hashed into a --cache key
+
+#define DEFAULT_USAGE "<image.png> -f <function> [-f <function> ...]"   // default console usage
 #define DEFAULT_OUT "-o <out.[bmp/png/...]>"              // default console output usage
 #define DEFAULT_ARG "repict"
 
@@ -23,10 +61,11 @@ typedef enum {
     FAST = 3,           // apply fast average blur
     BW = 4,             // apply black and white filter
     CANNY = 5,          // find edges
-    CUSTOM_KER = 6      // apply custom kernel from file
+    CUSTOM_KER = 6,     // apply custom kernel from file
+    GRADIENT = 7        // edge strength from a bank of derivative kernels
 } FUNCTION;
 
-typedef enum {NONE, F_BMP, F_PNG} FORMAT; // supported I/O formats
+typedef enum {NONE, F_BMP, F_PNG, F_PGM, F_PPM, F_QOI, F_JPG} FORMAT; // supported I/O formats
 
 typedef char *file_path_t;
 typedef pixel_t * (*RepictFunction) (pixel_t *data, int argc, char **argv);
@@ -38,54 +77,157 @@ typedef struct {
     unsigned int arg_max;   // max arguments, some optional
     const char *usage;      // usage string, printed to console
     const char *name;
+    bool luma;              // reads luminance only: a chain starting with it is decoded to one channel
 } function_t;
 
+typedef struct {
+    function_t func;        // function to run
+    int argc;               // its args
+    char **argv;
+} op_t;
+
 typedef struct {
     FORMAT format;          // format identifier
     char *ext;              // format extension
 } format_t;
 
+typedef struct {
+    pixel_t *pixels;        // decoded image, top-down rows
+    int32_t width, height;
+    int channels;
+    FORMAT format;
+    bmp_image_t bmp;        // BMP input, pixels may be a view of the mapped file
+    pnm_image_t pnm;        // PGM/PPM input, likewise
+    uint8_t *stream;        // input read from stdin, BMP/PGM/PPM pixels may be a view of it
+    size_t stream_len;
+} image_t;
+
+typedef enum {STAGE_DECODE, STAGE_FILTER, STAGE_ENCODE, STAGES} STAGE; // batch pipeline stages
+
+typedef struct {
+    char path_in[BATCH_PATH_MAX];
+    char path_out[BATCH_PATH_MAX];
+    image_t image;          // decoded input
+    pixel_t *result;        // filtered output (malloc)
+    int channels_out;
+    uint64_t cache_key;     // --cache key of the job, when cache_keyed
+    bool cache_keyed;
+    bool cached;            // output copied from the cache, nothing decoded
+    bool failed;
+} batch_item_t;
+
 static const format_t DEFAULT_OUT_FORMAT = {F_PNG, "png"};
 
 bool verbose;           // print verbose
 bool function_def;      // make sure a function has been given
 bool out_def;           // output has been specified
 bool usage_req;         // print usage on error
+bool batch;             // -r: input is a directory
 
 file_path_t file_in;    // file to read from
 file_path_t file_out;   // file to output to (default to DEFAULT_OUT)
 char *file_type;        // used for infile type and outfile type
+FORMAT stream_in_format;    // --in-format: format of - input (NONE: told from its first bytes)
+FORMAT stream_out_format;   // --out-format: format of -o - output (NONE: png)
+int stream_out = -1;        // stdout saved for -o - while messages go to stderr, -1 when not streaming
+bool serving;               // jobs come from serve mode, stdin/stdout aren't theirs
 
-function_t function;    // function to be executed
-int f_argc;             // internal arg count
-char **f_argv;          // internal args
+function_t function;    // last function parsed (for usage on error)
+op_t ops[MAX_OPS];      // functions to be executed, in order
+int op_count;
 
 pixel_t *pixels;        // image data
 pixel_t *pixels_out;    // output image data
 int32_t width, height;  // dimensionss
 int bpp;                // bytes per pixel for png
+image_t image_in;       // decoded input file (owns pixels)
 
 int channels_out = CHANNELS;       // channels written to output image, default to same as input
 
+int png_level = PNG_LEVEL_DEFAULT;  // --png-level: deflate effort 0 (store) - 9
+int png_filter = PNG_FILTER_BEST;   // --png-fast: fixed row filter instead of trying all five
+int jpeg_quality = JPEG_QUALITY_DEFAULT;    // --jpeg-quality: 1-100
+int edge_mode = REPICT_EDGE_STRATEGY;   // --edge: border handling for filters
+int edge_value = 0;                     // --edge constant <value>
+
+int32_t roi[4];         // --roi: x, y, width, height the filters are limited to
+bool roi_def;
+
+char *cache_dir;                                // --cache: directory of stored results (NULL = off)
+uint64_t cache_max = RESULT_CACHE_MAX_DEFAULT;  // --cache-max: its size budget in bytes
+
+char *trace_out;        // -t: write a Chrome trace of the run here (NULL = off)
+bool perf_counters;     // --perf-counters: hardware counters around each stage
+
+int batch_workers[STAGES] = BATCH_WORKERS_DEFAULT;  // -j: decode threads, images filtered at once, encode threads for -r (0 = one per core)
+
 
 /* Get file format from input path */
 FORMAT match_file_format(char *file);
 
+/* Get file format from an extension (png, bmp, ...), NONE if not supported */
+FORMAT match_format_ext(const char *ext);
+
 /* Get function from input */
 function_t *match_function(char *in);
 
-/* Handle -f function select and args, call function */
+/* Handle -f function select and args, append to ops */
 bool handle_function(const int argc, char **argv);
 
+/* Run every op in order on the library's working image, return the result */
+pixel_t *run_ops(pixel_t *data);
+
+/* Free op args */
+void free_ops(void);
+
+/* Channels to decode input to for the op chain: 1 when it only needs luminance */
+int ops_channels(void);
+
+/* Decode image file into img with desired channels (1: gray as repict_bw averages it), false on failure */
+bool decode_image(char *file, FORMAT format, int desired, image_t *img);
+
+/* Release pixels from decode_image */
+void free_image(image_t *img);
+
+/* Encode image data to file in format */
+bool encode_image(char *file, FORMAT format, const pixel_t *data, int32_t w, int32_t h, int c);
+
 /* Open file for use */
 bool open_file(char *file, FORMAT format);
 
+/* Release input pixels from open_file */
+void close_file(FORMAT format);
+
 /* Write new pixels to file */
 bool write_file(char *file, FORMAT format);
 
+/* Run function over every supported image in directory dir, output to dir out */
+bool run_batch(char *dir, char *out);
+
+/* Reset per-run CLI state */
+void reset_state(void);
+
+/* Run one command line (argv[0] is the program), return 1 on success and 0 on failure */
+int run_job(const int argc, char **argv);
+
+/* run_job without the trace bookkeeping */
+static int run_command(const int argc, char **argv);
+
+/* repict serve <socket path | -> : run jobs from a Unix socket or stdin */
+int run_server(const int argc, char **argv);
+
+/* repict bench [-n runs] [-s WxH ...] : time every function and format on synthetic images */
+int run_bench(const int argc, char **argv);
+
+/* repict compare <a> <b> [min psnr] : pixel compare two images */
+int run_compare(const int argc, char **argv);
+
 /* Handle flags */
 bool handle_flags(const int argc, char **argv);
 
+/* Handle --long flags, *i left on the last argument consumed */
+bool handle_long_flag(const int argc, char **argv, unsigned int *i);
+
 /* Print commandline usage of repict for specific function */
 void print_usage_f(function_t f, bool omit_out);
 
@@ -117,9 +259,12 @@ pixel_t *bw_op(pixel_t *data, int argc, char **argv);
 /* Find edges */
 pixel_t *canny_op(pixel_t *data, int argc, char **argv);
 
-/* Apply custom kernal to image from input kernel.txt file */
+/* Apply custom kernel to image from input kernel file: arg[0] */
 pixel_t *custom_kernel_op(pixel_t *data, int argc, char **argv);
 
+/* Edge strength, arg[0] picks the kernels: sobel, angle, lines or compass */
+pixel_t *gradient_op(pixel_t *data, int argc, char **argv);
+
 /* Print help menu */
 void print_help();
 
@@ -132,7 +277,8 @@ function_t functions[MAX_FUNCTIONS] = {
         0,
         0,
         "",
-        "def"
+        "def",
+        false
     },
     {
         RESIZE,
@@ -140,7 +286,8 @@ function_t functions[MAX_FUNCTIONS] = {
         2, // need width and height
         3, // optional select color correction mode
         "<width> <height> <optl: color mode>",
-        "resize"
+        "resize",
+        false
     },
     {
         GAUSS,
@@ -148,7 +295,8 @@ function_t functions[MAX_FUNCTIONS] = {
         1,
         2,
         "<sigma> <optl: times>",
-        "gauss"
+        "gauss",
+        true
     },
     {
         FAST,
@@ -156,7 +304,8 @@ function_t functions[MAX_FUNCTIONS] = {
         1,
         2,
         "<kernel size> <optl: times>",
-        "average"
+        "average",
+        true
     },
     {
         BW,
@@ -164,7 +313,8 @@ function_t functions[MAX_FUNCTIONS] = {
         0,
         0,
         "",
-        "bw"
+        "bw",
+        true
     },
     {
         CANNY,
@@ -172,7 +322,8 @@ function_t functions[MAX_FUNCTIONS] = {
         0,
         3,
         "<optl: gauss size> <optl: min thresh> <optl: max thresh>",
-        "canny"
+        "canny",
+        false
     },
     {
         CUSTOM_KER,
@@ -180,10 +331,32 @@ function_t functions[MAX_FUNCTIONS] = {
         1,
         1,
         "<kernel file>",
-        "kernel"
+        "kernel",
+        true
+    },
+    {
+        GRADIENT,
+        gradient_op,
+        0,
+        1,
+        "<optl: sobel | angle | lines | compass>",
+        "gradient",
+        true
     }
 };
 
+/* Arguments each function is benchmarked with (repict bench), NULL: not benchmarked */
+const char *bench_args[MAX_FUNCTIONS] = {
+    "",         // def
+    NULL,       // resize (not implemented)
+    "1.4",      // gauss
+    "3",        // average
+    "",         // bw
+    NULL,       // canny (not implemented)
+    NULL,       // kernel (needs a kernel file)
+    ""          // gradient
+};
+
 const format_t formats[MAX_FORMATS] = {
     {
         F_PNG,
@@ -192,6 +365,22 @@ const format_t formats[MAX_FORMATS] = {
     {
         F_BMP,
         "bmp"
+    },
+    {
+        F_PGM,
+        "pgm"
+    },
+    {
+        F_PPM,
+        "ppm"
+    },
+    {
+        F_QOI,
+        "qoi"
+    },
+    {
+        F_JPG,
+        "jpg"
     }
 };
 // ==========================================================
\ No newline at end of file
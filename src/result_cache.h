@@ -0,0 +1,291 @@
+/**
+ * Content-addressed cache of encoded results, one file per job in a cache directory
+ *
+ * A job is keyed by a 64-bit XXH64 hash the caller builds from everything that decides
+ * its output: the input file's bytes and the canonical op chain, edge mode, output format
+ * and encoder settings (see cache_job_key in the CLI).  The entry is the encoded output
+ * file itself, so a hit is one write of the mapped entry to the output: no decode, no
+ * filter, no encode.
+ *
+ * Entries are written to a temporary file first and published with rename(), so readers
+ * in other processes never see half an entry.  Each hit refreshes the entry's mtime, and
+ * result_cache_commit() removes the least recently used entries once the directory holds
+ * more than its byte budget.
+*/
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bmpio.h"      // file mapping and writev helpers
+
+#define RESULT_CACHE_VERSION 1                          // part of every key, bump when outputs change
+#define RESULT_CACHE_MAX_DEFAULT ((uint64_t) 1 << 30)   // bytes kept per cache directory
+#define RESULT_CACHE_PATH_MAX 4096
+#define RESULT_CACHE_EXT ".rc"                          // finished entries: <16 hex digits>.rc
+#define RESULT_CACHE_TEMP_EXT ".part"                   // entries still being written
+#define RESULT_CACHE_TEMP_AGE 3600                      // seconds before an abandoned .part is removed
+
+typedef struct {
+    char name[32];
+    double used;            // mtime, seconds
+    uint64_t size;
+} result_cache_file_t;
+
+static pthread_mutex_t result_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char result_cache_dir[RESULT_CACHE_PATH_MAX];    // directory result_cache_bytes counts
+static uint64_t result_cache_bytes;                     // its size as of the last trim, plus commits since
+static atomic_uint result_cache_serial;                 // temporary file names within the process
+
+
+// ======== XXH64 ========
+// https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8); // little-endian hosts, as the BMP reader assumes
+    return v;
+}
+
+static inline uint32_t xxh_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* XXH64 of len bytes */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *) data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) { // four lanes over 32-byte stripes
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += (uint64_t) len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* XXH64 of a whole file's bytes, false if it can't be read */
+bool xxh64_file(const char *path, uint64_t seed, uint64_t *hash) {
+    struct stat st;
+    if (stat(path, &st) != 0 || ! S_ISREG(st.st_mode) || st.st_size <= 0) {
+        return false;
+    }
+    size_t len = 0;
+    const uint8_t *map = bmp_map_file(path, &len);
+    if (map == NULL) {
+        return false;
+    }
+    *hash = xxh64(map, len, seed);
+    bmp_unmap_file(map, len);
+    return true;
+}
+
+
+// ======== Entries ========
+
+static void result_cache_entry_path(const char *dir, uint64_t key, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx" RESULT_CACHE_EXT, dir, (unsigned long long) key);
+}
+
+/* Map the entry for key and mark it recently used, NULL on a miss; release with result_cache_unmap */
+const uint8_t *result_cache_map(const char *dir, uint64_t key, size_t *len) {
+    char path[RESULT_CACHE_PATH_MAX];
+    result_cache_entry_path(dir, key, path, sizeof(path));
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size <= 0) { // a miss isn't an error, don't let the mapper report it
+        return NULL;
+    }
+#ifndef _WIN32
+    utimensat(AT_FDCWD, path, NULL, 0); // now, for the LRU order
+#endif
+    return bmp_map_file(path, len);
+}
+
+void result_cache_unmap(const uint8_t *map, size_t len) {
+    bmp_unmap_file(map, len);
+}
+
+/* Create a temporary file in dir (made if missing) for a new entry, its fd or -1; its name goes to path */
+int result_cache_temp(const char *dir, char *path, size_t size) {
+#ifdef _WIN32
+    mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+    snprintf(path, size, "%s/tmp-%ld-%u" RESULT_CACHE_TEMP_EXT, dir, (long) getpid(),
+            atomic_fetch_add(&result_cache_serial, 1));
+#ifdef _WIN32
+    return open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+#endif
+}
+
+static int result_cache_cmp_used(const void *a, const void *b) {
+    const double x = ((const result_cache_file_t *) a)->used, y = ((const result_cache_file_t *) b)->used;
+    return (x > y) - (x < y);
+}
+
+static bool result_cache_has_ext(const char *name, const char *ext) {
+    const size_t n = strlen(name), e = strlen(ext);
+    return n > e && strcmp(name + n - e, ext) == 0;
+}
+
+/* Remove the least recently used entries until dir holds at most max_bytes (lock held) */
+static void result_cache_trim(const char *dir, uint64_t max_bytes) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    result_cache_file_t *files = NULL;
+    size_t count = 0, cap = 0;
+    uint64_t total = 0;
+    const time_t now = time(NULL);
+    char path[RESULT_CACHE_PATH_MAX];
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const bool entry = result_cache_has_ext(ent->d_name, RESULT_CACHE_EXT);
+        const bool temp = result_cache_has_ext(ent->d_name, RESULT_CACHE_TEMP_EXT);
+        if ((! entry && ! temp) || strlen(ent->d_name) >= sizeof(files->name)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (temp) { // left behind by a writer that died
+            if (now - st.st_mtime > RESULT_CACHE_TEMP_AGE) {
+                unlink(path);
+            }
+            continue;
+        }
+        if (count == cap) {
+            cap = cap > 0 ? cap * 2 : 256;
+            result_cache_file_t *grown = (result_cache_file_t *) realloc(files, sizeof(result_cache_file_t) * cap);
+            if (grown == NULL) {
+                break;
+            }
+            files = grown;
+        }
+        strcpy(files[count].name, ent->d_name);
+        files[count].used = st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+        files[count].size = (uint64_t) st.st_size;
+        total += files[count].size;
+        count++;
+    }
+    closedir(d);
+
+    if (total > max_bytes) {
+        qsort(files, count, sizeof(result_cache_file_t), result_cache_cmp_used);
+        for (size_t i = 0; i < count && total > max_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+            if (unlink(path) == 0) {
+                total -= files[i].size;
+            }
+        }
+    }
+    free(files);
+    snprintf(result_cache_dir, sizeof(result_cache_dir), "%s", dir);
+    result_cache_bytes = total;
+}
+
+/**
+ * Publish a finished temporary file (result_cache_temp) as the entry for key, then keep dir
+ * within max_bytes.  The directory is only scanned when the bytes committed by this process
+ * since the last scan could have pushed it over, true if the entry was published
+*/
+bool result_cache_commit(const char *dir, const char *temp, uint64_t key, uint64_t max_bytes) {
+    char path[RESULT_CACHE_PATH_MAX];
+    result_cache_entry_path(dir, key, path, sizeof(path));
+    struct stat st;
+    if (stat(temp, &st) != 0 || rename(temp, path) != 0) {
+        unlink(temp);
+        return false;
+    }
+
+    pthread_mutex_lock(&result_cache_lock);
+    if (strcmp(result_cache_dir, dir) != 0) {
+        result_cache_trim(dir, max_bytes); // first commit here: find out what's already in it
+    }
+    else {
+        result_cache_bytes += (uint64_t) st.st_size;
+        if (result_cache_bytes > max_bytes) {
+            result_cache_trim(dir, max_bytes);
+        }
+    }
+    pthread_mutex_unlock(&result_cache_lock);
+    return true;
+}
+
+#endif
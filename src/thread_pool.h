@@ -0,0 +1,392 @@
+/**
+ * Work-stealing thread pool shared by the library, the CLI and the writers
+ *
+ * The pool runs one worker per online core, each with its own deque of tasks.  A worker
+ * pushes and pops at the bottom of its own deque (newest first, its data still in cache)
+ * and when that runs dry steals from the top of the others (oldest first, usually the
+ * biggest piece of work left).  Threads outside the pool push to a shared inbox that the
+ * workers steal from.
+ *
+ * pool_parallel_for(count, fn, arg) runs fn(arg, i) for every i in [0, count) and returns
+ * once all of them have finished.  A worker waiting for its loop runs that loop's queued
+ * tasks in the meantime, so loops nest (images of a batch x tiles of each image) without
+ * adding threads: the machine runs one thread per core however the work is split.  It never
+ * runs another loop's tasks while it waits: those would run on top of the waiting task's
+ * stack and share its thread-local state (the library's working image, say).  A thread
+ * outside the pool sleeps until its loop is done.  pool_submit()/pool_wait() do the same
+ * for single tasks gathered in a pool_group_t.  The pool starts itself on first use
+ * (pool_init or REPICT_THREADS to choose the worker count).
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define POOL_MAX_WORKERS 256
+#define POOL_DEQUE_INITIAL 64       // tasks a deque holds before it grows
+
+typedef void (*pool_task_fn) (void *arg, int index);
+typedef void (*pool_trace_fn) (const char *name, bool begin);
+
+// tasks waited on together (pool_submit, pool_wait), zero it before use
+typedef struct {
+    atomic_int pending;     // submitted and not finished yet
+} pool_group_t;
+
+typedef struct {
+    pool_task_fn fn;
+    void *arg;
+    int index;
+    pool_group_t *group;
+} pool_task_t;
+
+// the owner works at the bottom, thieves take from the top
+typedef struct {
+    pthread_mutex_t lock;
+    pool_task_t *tasks;     // ring of cap tasks
+    int cap;
+    int top;                // oldest task
+    int count;
+} pool_deque_t;
+
+typedef struct {
+    pthread_t threads[POOL_MAX_WORKERS];
+    pool_deque_t deques[POOL_MAX_WORKERS];  // one per worker
+    pool_deque_t inbox;                     // tasks from threads outside the pool
+    int workers;
+    bool started;
+    atomic_bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // idle workers and waiting threads sleep here
+    atomic_int queued;      // tasks sitting in deques
+    atomic_int sleepers;    // threads waiting on wake
+} thread_pool_t;
+
+static thread_pool_t pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER
+};
+
+static _Atomic pool_trace_fn pool_trace = NULL;     // called around each task when set
+static _Thread_local int pool_self = -1;            // deque of the calling worker, -1 outside the pool
+
+
+/* Number of online cores, at least 1 */
+int pool_core_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors > 0 ? (int) si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#endif
+}
+
+static bool pool_deque_init(pool_deque_t *d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->tasks = (pool_task_t *) malloc(sizeof(pool_task_t) * POOL_DEQUE_INITIAL);
+    d->cap = d->tasks != NULL ? POOL_DEQUE_INITIAL : 0;
+    d->top = 0;
+    d->count = 0;
+    return d->tasks != NULL;
+}
+
+static void pool_deque_free(pool_deque_t *d) {
+    free(d->tasks);
+    d->tasks = NULL;
+    d->cap = 0;
+    pthread_mutex_destroy(&d->lock);
+}
+
+/* Add n tasks at the bottom, false if the deque can't grow to hold them */
+static bool pool_deque_push(pool_deque_t *d, const pool_task_t *t, int n) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count + n > d->cap) {
+        int cap = d->cap > 0 ? d->cap : POOL_DEQUE_INITIAL;
+        while (cap < d->count + n) {
+            cap *= 2;
+        }
+        pool_task_t *tasks = (pool_task_t *) malloc(sizeof(pool_task_t) * cap);
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&d->lock);
+            return false;
+        }
+        for (int i = 0; i < d->count; i++) { // unwrap the ring
+            tasks[i] = d->tasks[(d->top + i) % d->cap];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->cap = cap;
+        d->top = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        d->tasks[(d->top + d->count++) % d->cap] = t[i];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+/* Take the newest task (owner) or the oldest (thief) */
+static bool pool_deque_take(pool_deque_t *d, pool_task_t *out, bool newest) {
+    pthread_mutex_lock(&d->lock);
+    const bool found = d->count > 0;
+    if (found) {
+        if (newest) {
+            *out = d->tasks[(d->top + d->count - 1) % d->cap];
+        }
+        else {
+            *out = d->tasks[d->top];
+            d->top = (d->top + 1) % d->cap;
+        }
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* Take the newest task of group g, wherever it sits in the deque */
+static bool pool_deque_take_group(pool_deque_t *d, pool_task_t *out, const pool_group_t *g) {
+    pthread_mutex_lock(&d->lock);
+    int i = d->count - 1;
+    while (i >= 0 && d->tasks[(d->top + i) % d->cap].group != g) {
+        i--;
+    }
+    const bool found = i >= 0;
+    if (found) {
+        *out = d->tasks[(d->top + i) % d->cap];
+        for (; i < d->count - 1; i++) { // close the gap
+            d->tasks[(d->top + i) % d->cap] = d->tasks[(d->top + i + 1) % d->cap];
+        }
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/* Wake sleeping threads, if there are any, to look at the deques or their groups again */
+static void pool_notify(void) {
+    if (atomic_load(&pool.sleepers) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/* Next task for the calling worker: its own newest, else the oldest of another deque */
+static bool pool_find(pool_task_t *t) {
+    bool found = pool_self >= 0 && pool_deque_take(&pool.deques[pool_self], t, true);
+    for (int k = 1; ! found && k <= pool.workers; k++) {
+        const int victim = (pool_self + k) % (pool.workers + 1);
+        found = pool_deque_take(victim < pool.workers ? &pool.deques[victim] : &pool.inbox, t, false);
+    }
+    if (found) {
+        atomic_fetch_sub(&pool.queued, 1);
+    }
+    return found;
+}
+
+/* A queued task of group g for a worker waiting on it: its own deque first, then the others */
+static bool pool_find_group(pool_task_t *t, const pool_group_t *g) {
+    bool found = false;
+    for (int k = 0; ! found && k <= pool.workers; k++) {
+        const int victim = (pool_self + k) % (pool.workers + 1);
+        found = pool_deque_take_group(victim < pool.workers ? &pool.deques[victim] : &pool.inbox, t, g);
+    }
+    if (found) {
+        atomic_fetch_sub(&pool.queued, 1);
+    }
+    return found;
+}
+
+static void pool_run(const pool_task_t *t) {
+    pool_trace_fn trace = atomic_load(&pool_trace);
+    if (trace != NULL) {
+        trace("pool task", true);
+    }
+    t->fn(t->arg, t->index);
+    if (trace != NULL) {
+        trace("pool task", false);
+    }
+    atomic_fetch_sub(&t->group->pending, 1);
+    pool_notify();
+}
+
+/* Queue n tasks on the caller's deque (the inbox outside the pool); run them here if that fails */
+static void pool_push(const pool_task_t *t, int n) {
+    pool_deque_t *d = pool_self >= 0 ? &pool.deques[pool_self] : &pool.inbox;
+    if (! pool_deque_push(d, t, n)) {
+        for (int i = 0; i < n; i++) {
+            pool_run(&t[i]);
+        }
+        return;
+    }
+    atomic_fetch_add(&pool.queued, n);
+    pool_notify();
+}
+
+static void *pool_worker(void *arg) {
+    pool_self = (int) (intptr_t) arg;
+    pthread_mutex_lock(&pool.lock); // wait for pool_init to finish counting workers
+    pthread_mutex_unlock(&pool.lock);
+    while (! atomic_load(&pool.stop)) {
+        pool_task_t t;
+        if (pool_find(&t)) {
+            pool_run(&t);
+            continue;
+        }
+        pthread_mutex_lock(&pool.lock);
+        atomic_fetch_add(&pool.sleepers, 1);
+        while (atomic_load(&pool.queued) <= 0 && ! atomic_load(&pool.stop)) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        atomic_fetch_sub(&pool.sleepers, 1);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/* Start the pool with 'threads' workers (0 = REPICT_THREADS from the environment, else one per core); no-op once started */
+void pool_init(int threads) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.started) {
+        pthread_mutex_unlock(&pool.lock);
+        return;
+    }
+    if (threads <= 0 && getenv("REPICT_THREADS") != NULL) {
+        threads = atoi(getenv("REPICT_THREADS"));
+    }
+    if (threads <= 0) {
+        threads = pool_core_count();
+    }
+    if (threads > POOL_MAX_WORKERS) {
+        threads = POOL_MAX_WORKERS;
+    }
+    atomic_store(&pool.stop, false);
+    atomic_store(&pool.queued, 0);
+    pool.workers = 0;
+    pool_deque_init(&pool.inbox);
+    for (int i = 0; i < threads; i++) {
+        if (! pool_deque_init(&pool.deques[i])) {
+            pool_deque_free(&pool.deques[i]);
+            break;
+        }
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, (void *) (intptr_t) i) != 0) {
+            pool_deque_free(&pool.deques[i]);
+            break;
+        }
+        pool.workers++;
+    }
+    if (pool.workers < threads) {
+        fprintf(stderr, "thread pool: could only start %d workers\n", pool.workers);
+    }
+    pool.started = true;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Threads a loop can run on */
+int pool_threads(void) {
+    pool_init(0);
+    return pool.workers > 0 ? pool.workers : 1;
+}
+
+/* Queue fn(arg, index) as part of group g (runs right here when the pool has no workers) */
+void pool_submit(pool_group_t *g, pool_task_fn fn, void *arg, int index) {
+    pool_init(0);
+    if (pool.workers == 0) {
+        fn(arg, index);
+        return;
+    }
+    atomic_fetch_add(&g->pending, 1);
+    const pool_task_t t = { fn, arg, index, g };
+    pool_push(&t, 1);
+}
+
+/* Return once at most 'limit' tasks of g are unfinished; workers run queued tasks of g meanwhile */
+void pool_wait(pool_group_t *g, int limit) {
+    while (atomic_load(&g->pending) > limit) {
+        pool_task_t t;
+        if (pool_self >= 0 && pool_find_group(&t, g)) {
+            pool_run(&t);
+            continue;
+        }
+        // the rest of g is running elsewhere (or, for a shared group, not pushed yet): sleep until
+        // a task finishes or is queued, then look again
+        pthread_mutex_lock(&pool.lock);
+        atomic_fetch_add(&pool.sleepers, 1);
+        while (atomic_load(&g->pending) > limit) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+            if (pool_self >= 0) {
+                break;
+            }
+        }
+        atomic_fetch_sub(&pool.sleepers, 1);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/* Run fn(arg, i) for i in [0, count) on the pool, return when all are done */
+void pool_parallel_for(int count, pool_task_fn fn, void *arg) {
+    if (count <= 0) {
+        return;
+    }
+    pool_init(0);
+    pool_task_t *tasks = NULL;
+    if (count > 1 && pool.workers > 0) {
+        tasks = (pool_task_t *) malloc(sizeof(pool_task_t) * count);
+    }
+    if (tasks == NULL) { // trivial, no workers or no memory: run inline
+        for (int i = 0; i < count; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    pool_group_t g;
+    atomic_init(&g.pending, count);
+    for (int i = 0; i < count; i++) { // a worker pops from the bottom: index 0 last in, first run
+        tasks[i] = (pool_task_t) { fn, arg, pool_self >= 0 ? count - 1 - i : i, &g };
+    }
+    pool_push(tasks, count);
+    free(tasks);
+    pool_wait(&g, 0);
+}
+
+/* Report the begin/end of every task run by the pool to fn (NULL: off) */
+void pool_set_trace(pool_trace_fn fn) {
+    atomic_store(&pool_trace, fn);
+}
+
+/* Stop and join all workers */
+void pool_shutdown(void) {
+    pthread_mutex_lock(&pool.lock);
+    if (! pool.started) {
+        pthread_mutex_unlock(&pool.lock);
+        return;
+    }
+    atomic_store(&pool.stop, true);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.workers; i++) {
+        pthread_join(pool.threads[i], NULL);
+        pool_deque_free(&pool.deques[i]);
+    }
+    pool_deque_free(&pool.inbox);
+    pool.workers = 0;
+    pool.started = false;
+}
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * Span recorder that writes Chrome trace_event JSON (chrome://tracing, Perfetto, speedscope)
+ *
+ * trace_start() turns recording on and hooks the library and the thread pool; trace_span()
+ * marks the begin/end of a stage on the calling thread.  trace_write(path) dumps everything
+ * recorded so far as "B"/"E" duration events with one track per thread, trace_stop() turns
+ * recording off and drops the events.  When not started, trace_span costs one branch.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "repict.h"
+#include "thread_pool.h"
+
+#define TRACE_INITIAL_EVENTS 4096
+
+typedef struct {
+    const char *name;       // static string, never copied
+    double ts;              // microseconds since trace_start
+    int tid;
+    bool begin;
+} trace_event_t;
+
+static bool trace_on = false;
+static trace_event_t *trace_events = NULL;
+static size_t trace_count = 0;
+static size_t trace_cap = 0;
+static struct timespec trace_t0;
+static int trace_threads = 0;       // tids handed out so far
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int trace_tid = 0;     // 0: not yet assigned
+
+
+/* Record the begin or end of span 'name' on the calling thread */
+void trace_span(const char *name, bool begin) {
+    if (! trace_on) {
+        return;
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    const double ts = (t.tv_sec - trace_t0.tv_sec) * 1e6 + (t.tv_nsec - trace_t0.tv_nsec) / 1e3;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_tid == 0) {
+        trace_tid = ++trace_threads;
+    }
+    if (trace_count == trace_cap) {
+        size_t cap = trace_cap > 0 ? trace_cap * 2 : TRACE_INITIAL_EVENTS;
+        trace_event_t *e = (trace_event_t *) realloc(trace_events, cap * sizeof(trace_event_t));
+        if (e == NULL) { // out of memory: drop the event rather than the run
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+        trace_events = e;
+        trace_cap = cap;
+    }
+    trace_events[trace_count++] = (trace_event_t) { name, ts, trace_tid, begin };
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_library_hook(const char *name, bool begin, void *unused) {
+    trace_span(name, begin);
+}
+
+/* Start a fresh recording and hook the library and pool */
+void trace_start(void) {
+    pthread_mutex_lock(&trace_lock);
+    trace_count = 0;
+    if (trace_tid == 0) { // the thread starting the trace gets the first track
+        trace_tid = ++trace_threads;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+    trace_on = true;
+    pthread_mutex_unlock(&trace_lock);
+    repict_set_trace(trace_library_hook, NULL);
+    pool_set_trace(trace_span);
+}
+
+/* Write recorded events to path as a trace_event JSON object */
+bool trace_write(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&trace_lock);
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (int t = 1; t <= trace_threads; t++) { // name the tracks, the thread that started the first trace is main
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                t > 1 ? ",\n" : "", t, t == 1 ? "main" : "thread", t);
+    }
+    for (size_t i = 0; i < trace_count; i++) {
+        const trace_event_t *e = &trace_events[i];
+        fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+                e->name, e->begin ? 'B' : 'E', e->ts, e->tid);
+    }
+    fprintf(fp, "\n]}\n");
+    pthread_mutex_unlock(&trace_lock);
+    return fclose(fp) == 0;
+}
+
+/* Stop recording, unhook and free the events */
+void trace_stop(void) {
+    repict_set_trace(NULL, NULL);
+    pool_set_trace(NULL);
+    pthread_mutex_lock(&trace_lock);
+    trace_on = false;
+    free(trace_events);
+    trace_events = NULL;
+    trace_count = 0;
+    trace_cap = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#endif
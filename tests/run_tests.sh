@@ -0,0 +1,152 @@
+#!/bin/sh
+# make test: every function and format checked against the stored references in tests/ref,
+# and the optimized build (SIMD, convolution tiles on the thread pool) against the plain one
+# (REPICT_NO_SIMD, REPICT_SERIAL) on the same jobs.
+#
+#   tests/run_tests.sh <repict> <plain repict> [--update]
+#
+# --update rewrites the references from the plain build; look at what changed before committing.
+# repict exits 1 once a job is done, so jobs are judged by the files they leave behind.
+
+REPICT=$1
+PLAIN=$2
+UPDATE=$3
+DIR=$(dirname "$0")
+DATA=$DIR/data
+REF=$DIR/ref
+TMP=${TMPDIR:-/tmp}/repict_test.$$
+
+if [ ! -x "$REPICT" ] || [ ! -x "$PLAIN" ]; then
+    echo "usage: $0 <repict> <plain repict> [--update]"
+    exit 2
+fi
+rm -rf "$TMP"
+mkdir -p "$TMP/opt" "$TMP/plain"
+trap 'rm -rf "$TMP"' EXIT
+
+passed=0
+failed=0
+
+fail() {
+    echo "FAIL: $1"
+    failed=$((failed + 1))
+}
+
+# same <a> <b> [min psnr]: quiet repict compare
+same() {
+    "$REPICT" compare "$@" > "$TMP/compare.txt"
+}
+
+# check <name> <out ext> <min psnr | exact> <input> [args...]
+# runs the job on both builds; their outputs must match each other exactly, and the reference
+# tests/ref/<name>.png exactly or to the PSNR given (lossy formats)
+check() {
+    name=$1
+    ext=$2
+    psnr=$3
+    in=$4
+    shift 4
+    "$REPICT" "$in" "$@" -o "$TMP/opt/$name.$ext" > /dev/null
+    "$PLAIN" "$in" "$@" -o "$TMP/plain/$name.$ext" > /dev/null
+    if [ ! -f "$TMP/opt/$name.$ext" ] || [ ! -f "$TMP/plain/$name.$ext" ]; then
+        fail "$name: no output"
+        return
+    fi
+    if ! same "$TMP/opt/$name.$ext" "$TMP/plain/$name.$ext"; then
+        fail "$name: optimized build differs from plain: $(cat "$TMP/compare.txt")"
+        return
+    fi
+    if [ "$UPDATE" = "--update" ]; then
+        "$PLAIN" "$TMP/plain/$name.$ext" -o "$REF/$name.png" > /dev/null
+    fi
+    if [ ! -f "$REF/$name.png" ]; then
+        fail "$name: no reference $REF/$name.png (run with --update)"
+        return
+    fi
+    if [ "$psnr" = "exact" ]; then
+        psnr=
+    fi
+    if ! same "$TMP/opt/$name.$ext" "$REF/$name.png" $psnr; then
+        fail "$name: differs from reference: $(cat "$TMP/compare.txt")"
+        return
+    fi
+    passed=$((passed + 1))
+}
+
+IMG=$DATA/shroom.png
+GRAY=$DATA/shroom_gray.pgm
+
+# functions
+check convert       png exact $IMG
+check bw            png exact $IMG -f bw
+check gauss         png exact $IMG -f gauss 1.4
+check gauss_wide    png exact $IMG -f gauss 3.0 2
+check average       png exact $IMG -f average 5
+check average_3x    png exact $IMG -f average 3 3
+check kernel        png exact $IMG -f kernel $DATA/sobel.txt
+check gradient      png exact $IMG -f gradient
+check grad_angle    png exact $IMG -f gradient angle
+check grad_lines    png exact $IMG -f gradient lines
+check grad_compass  png exact $IMG -f gradient compass
+check chain         png exact $IMG -f bw -f gauss 1.4 -f average 3
+check gray_gauss    png exact $GRAY -f gauss 2.0
+
+# borders
+check edge_clamp    png exact $IMG -f gauss 2.5 --edge clamp
+check edge_mirror   png exact $IMG -f gauss 2.5 --edge mirror
+check edge_wrap     png exact $IMG -f gauss 2.5 --edge wrap
+check edge_constant png exact $IMG -f average 7 --edge constant 200
+check edge_compass  png exact $IMG -f gradient compass --edge mirror
+
+# regions
+check roi_gauss     png exact $IMG -f gauss 2.0 --roi 20 30 90 60
+check roi_bw        png exact $IMG -f bw --roi 0 0 75 118
+check roi_kernel    png exact $IMG -f kernel $DATA/sobel.txt --roi 40 10 64 64 --edge mirror
+
+# formats: written, read back and compared (JPEG to a PSNR)
+check out_bmp       bmp exact $IMG -f gauss 1.4
+check out_ppm       ppm exact $IMG -f gauss 1.4
+check out_pgm       pgm exact $IMG -f bw
+check out_qoi       qoi exact $IMG -f gauss 1.4
+check out_png_l0    png exact $IMG -f gauss 1.4 --png-level 0
+check out_png_fast  png exact $IMG -f gauss 1.4 --png-level 9 --png-fast
+check out_jpg       jpg 40    $IMG -f gauss 1.4
+check out_jpg_q95   jpg 40    $IMG -f gauss 1.4 --jpeg-quality 95
+check in_pgm        png exact $GRAY
+
+# stdin / stdout
+cat "$IMG" | "$REPICT" - -f gauss 1.4 -o - --out-format ppm > "$TMP/opt/pipe.ppm" 2> /dev/null
+if same "$TMP/opt/pipe.ppm" "$REF/gauss.png"; then
+    passed=$((passed + 1))
+else
+    fail "pipe: differs from reference: $(cat "$TMP/compare.txt")"
+fi
+
+# batches: images filtered at once on several pool workers, each waiting on its own tiles,
+# must come out as they do one at a time (random images of assorted sizes)
+mkdir -p "$TMP/batch_in"
+i=0
+while [ $i -lt 32 ]; do
+    w=$((97 + i * 37 % 300))
+    h=$((61 + i * 53 % 240))
+    { printf 'P6\n%d %d\n255\n' $w $h; head -c $((w * h * 3)) /dev/urandom; } > "$TMP/batch_in/img$i.ppm"
+    i=$((i + 1))
+done
+for jobs in "4 8 2" "2 0 2"; do
+    rm -rf "$TMP/batch" "$TMP/serial"
+    REPICT_THREADS=8 "$REPICT" "$TMP/batch_in" -r -f gauss 2.0 -f average 3 -j $jobs -o "$TMP/batch" > /dev/null 2>&1
+    REPICT_THREADS=1 "$PLAIN" "$TMP/batch_in" -r -f gauss 2.0 -f average 3 -j 1 1 1 -o "$TMP/serial" > /dev/null 2>&1
+    differ=0
+    for f in "$TMP/batch_in"/*; do
+        f=${f##*/}
+        same "$TMP/batch/$f" "$TMP/serial/$f" 2> /dev/null || differ=$((differ + 1))
+    done
+    if [ $differ -eq 0 ]; then
+        passed=$((passed + 1))
+    else
+        fail "batch -j $jobs: $differ of 32 images differ from one at a time"
+    fi
+done
+
+echo "repict tests: $passed passed, $failed failed"
+[ $failed -eq 0 ]